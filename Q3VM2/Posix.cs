@@ -0,0 +1,69 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+namespace Q3VM2 {
+    unsafe static class Posix {
+        public const int PROT_NONE = 0;
+        public const int PROT_READ = 1;
+        public const int PROT_WRITE = 2;
+        public const int PROT_EXEC = 4;
+
+        public const int O_RDONLY = 0;
+
+        public const int MADV_HUGEPAGE = 14;
+
+        public const int MAP_SHARED = 0x01;
+        public const int MAP_PRIVATE = 0x02;
+        public const int MAP_FIXED = 0x10;
+        public const int MAP_ANONYMOUS = 0x20;
+        public const int MAP_NORESERVE = 0x4000;
+
+        // sizeof(pthread_attr_t) is 56 on x86-64 glibc
+        public const int PTHREAD_ATTR_SIZE = 64;
+
+        public static readonly IntPtr MAP_FAILED = (IntPtr)(-1);
+
+        public static bool IsLinuxX64 {
+            get {
+                return RuntimeInformation.IsOSPlatform(OSPlatform.Linux) && RuntimeInformation.ProcessArchitecture == Architecture.X64;
+            }
+        }
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern IntPtr mmap(IntPtr addr, UIntPtr length, int prot, int flags, int fd, IntPtr offset);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int munmap(IntPtr addr, UIntPtr length);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int mprotect(IntPtr addr, UIntPtr length, int prot);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int madvise(IntPtr addr, UIntPtr length, int advice);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int memfd_create(string name, uint flags);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int ftruncate(int fd, long length);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int open(string path, int flags);
+
+        [DllImport("libc", SetLastError = true)]
+        public static extern int close(int fd);
+
+        // libpthread, glibc before 2.34 does not have them in libc
+        [DllImport("libpthread.so.0")]
+        public static extern IntPtr pthread_self();
+
+        [DllImport("libpthread.so.0")]
+        public static extern int pthread_getattr_np(IntPtr thread, byte* attr);
+
+        [DllImport("libpthread.so.0")]
+        public static extern int pthread_attr_getstack(byte* attr, out IntPtr stackaddr, out UIntPtr stacksize);
+
+        [DllImport("libpthread.so.0")]
+        public static extern int pthread_attr_destroy(byte* attr);
+    }
+}
@@ -1,5 +1,6 @@
 ﻿using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Linq;
 using System.Runtime.InteropServices;
@@ -8,59 +9,127 @@ using System.Threading.Tasks;
 
 namespace Q3VM2 {
     internal unsafe static class Program {
-        static IntPtr systemCalls(ref VirtMachine vm, params IntPtr[] args) {
-            int SyscallID = -1 - (int)args[0];
-            // Console.WriteLine("INT {0}", SyscallID);
-
-            switch (SyscallID) {
-                // Print
-                case -1:
-                    string Str = Marshal.PtrToStringAnsi(VM.TranslateAddress(args[1], ref vm));
-                    Console.Write(Str);
-                    break;
-
-                // MEMSET
-                case -3:
-                    if (VM.VM_MemoryRangeValid(args[1], (uint)args[3], ref vm) == 0) {
-                        IntPtr Arg1 = VM.TranslateAddress(args[1], ref vm);
-                        VM.memset((void*)Arg1, (int)args[2], (uint)args[3]);
-                    }
-
-                    return args[1];
-
-                // MEMCPY
-                case -4:
-                    if (VM.VM_MemoryRangeValid(args[1], (uint)args[3], ref vm) == 0 && VM.VM_MemoryRangeValid(args[2], (uint)args[3], ref vm) == 0) {
-                        IntPtr Arg1 = VM.TranslateAddress(args[1], ref vm);
-                        IntPtr Arg2 = VM.TranslateAddress(args[2], ref vm);
-
-                        VM.memcpy((void*)Arg1, (void*)Arg2, (uint)args[3]);
-                    }
-
-                    return args[1];
-
-                // MALLOC
-                case -5: {
-                    int AllocLen = (int)args[1];
-                    return VM.VM_VMMalloc(AllocLen, ref vm, out IntPtr ptr);
+        // Print
+        static int Print(ref VirtMachine vm, int* args) {
+            string Str = Marshal.PtrToStringAnsi(VM.TranslateAddress((IntPtr)args[1], ref vm));
+            Console.Write(Str);
+            return 0;
+        }
+
+        // MEMSET
+        static int Memset(ref VirtMachine vm, int* args) {
+            if (VM.VM_MemoryRangeValid((IntPtr)args[1], (uint)args[3], ref vm) == 0) {
+                IntPtr Arg1 = VM.TranslateAddress((IntPtr)args[1], ref vm);
+                VM.memset((void*)Arg1, args[2], (uint)args[3]);
+                VM.VM_MarkDirty(ref vm, args[1], args[3]);
+            }
+
+            return args[1];
+        }
+
+        // MEMCPY
+        static int Memcpy(ref VirtMachine vm, int* args) {
+            if (VM.VM_MemoryRangeValid((IntPtr)args[1], (uint)args[3], ref vm) == 0 && VM.VM_MemoryRangeValid((IntPtr)args[2], (uint)args[3], ref vm) == 0) {
+                IntPtr Arg1 = VM.TranslateAddress((IntPtr)args[1], ref vm);
+                IntPtr Arg2 = VM.TranslateAddress((IntPtr)args[2], ref vm);
+
+                VM.memcpy((void*)Arg1, (void*)Arg2, (uint)args[3]);
+                VM.VM_MarkDirty(ref vm, args[1], args[3]);
+            }
+
+            return args[1];
+        }
+
+        // MALLOC
+        static int Malloc(ref VirtMachine vm, int* args) {
+            return (int)VM.VM_VMMalloc(args[1], ref vm, out IntPtr ptr);
+        }
+
+        // FREE
+        static int Free(ref VirtMachine vm, int* args) {
+            return VM.VM_VMFree((IntPtr)args[1], ref vm);
+        }
+
+        static int Nice(ref VirtMachine vm, int* args) {
+            Console.WriteLine("Nice.");
+            return 0;
+        }
+
+        // Indexed by -1 - syscall number, holes are bad system calls
+        static vmSyscallFunc_t[] systemCalls = new vmSyscallFunc_t[69];
+
+        static Program() {
+            systemCalls[0] = Print;
+            systemCalls[2] = Memset;
+            systemCalls[3] = Memcpy;
+            systemCalls[4] = Malloc;
+            systemCalls[5] = Free;
+            systemCalls[68] = Nice;
+        }
+
+        // Decoded code size against the old int per slot layout, and the time
+        // VM_Call and VM_CallBatch take on every engine
+        static void Bench(string FName, int command, int iterations) {
+            vmModule_t Module = VM.VM_LoadModule(FName, FName);
+
+            if (Module == null)
+                throw new Exception("Loading " + FName + " failed");
+
+            Console.WriteLine("{0}: {1} instructions, {2} bytes of decoded code, {3} before",
+                FName, Module.instructionCount, Module.codeSize + Module.instructionCount * sizeof(int),
+                Module.codeLength * 4 + Module.instructionCount * IntPtr.Size);
+
+            foreach (vmInterpret_t interpret in Enum.GetValues(typeof(vmInterpret_t))) {
+                VirtMachine Instance = new VirtMachine();
+                Stopwatch Watch = new Stopwatch();
+
+                if (interpret == vmInterpret_t.VMI_PRECOMPILED)
+                    continue;
+
+                if (!VM.VM_Create(ref Instance, FName, Module, systemCalls, interpret)) {
+                    Console.WriteLine("{0,-20} failed", interpret);
+                    continue;
                 }
 
-                // FREE
-                case -6:
-                    return IntPtr.Zero;
+                VM.VM_Call(ref Instance, command);
 
-                case -69:
-                    Console.WriteLine("Nice.");
-                    break;
+                Watch.Start();
+                for (int i = 0; i < iterations; i++)
+                    VM.VM_Call(ref Instance, command);
+                Watch.Stop();
 
-                default:
-                    throw new Exception("Bad system call");
+                Console.WriteLine("{0,-20} {1,10:F3} us/call", interpret, Watch.Elapsed.TotalMilliseconds * 1000 / iterations);
+                int[] Results = new int[iterations];
+
+                Watch.Restart();
+                VM.VM_CallBatch(ref Instance, command, Array.Empty<int>(), 0, Results);
+                Watch.Stop();
+
+                Console.WriteLine("{0,-20} {1,10:F3} us/call batched", "", Watch.Elapsed.TotalMilliseconds * 1000 / iterations);
+                VM.VM_Free(ref Instance);
             }
 
-            return (IntPtr)0;
+            VM.VM_FreeModule(Module);
         }
 
         static void Main(string[] args) {
+            // Q3VM2 -precompile <file.qvm> <cache directory>
+            if (args.Length == 3 && args[0] == "-precompile") {
+                if (!VM.VM_Precompile(args[1], File.ReadAllBytes(args[1]), args[2]))
+                    throw new Exception("Precompiling " + args[1] + " failed");
+
+                vmModule_t Precompiled = VM.VM_LoadModule(args[1], args[1]);
+                Console.WriteLine("{0} -> {1}", args[1], Path.Combine(args[2], VM.VM_ModuleHash(Precompiled) + ".dll"));
+                VM.VM_FreeModule(Precompiled);
+                return;
+            }
+
+            // Q3VM2 -bench <file.qvm> [command] [iterations]
+            if (args.Length >= 2 && args.Length <= 4 && args[0] == "-bench") {
+                Bench(args[1], args.Length > 2 ? int.Parse(args[2]) : 0, args.Length > 3 ? int.Parse(args[3]) : 1000);
+                return;
+            }
+
             string FName = "data/lmao.qvm";
             VirtMachine Instance = new VirtMachine();
 
@@ -68,9 +137,13 @@ namespace Q3VM2 {
             Console.WriteLine("Running {0}", FName);
             Console.WriteLine();
 
-            if (!VM.VM_Create(ref Instance, FName, File.ReadAllBytes(FName), systemCalls))
+            vmModule_t Module = VM.VM_LoadModule(FName, FName);
+
+            if (Module == null || !VM.VM_Create(ref Instance, FName, Module, systemCalls))
                 throw new Exception("Holy shit!");
 
+            VM.VM_FreeModule(Module);
+
             byte[] asm_bytes = File.ReadAllBytes("data/bytecode.qvm");
             int asm_bytes_vmaddr = (int)VM.VM_VMMalloc(asm_bytes.Length, ref Instance, out IntPtr asm_bytes_pointer);
 
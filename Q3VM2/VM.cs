@@ -1,5 +1,8 @@
 ﻿using System;
+using System.Collections.Generic;
+using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Threading;
 
 // https://www.icculus.org/~phaethon/q3mc/q3vm_specs.html
 
@@ -21,6 +24,13 @@ namespace Q3VM2 {
         VM_MALLOC_FAILED = -13,
         VM_BAD_INSTRUCTION = -14,
         VM_NOT_LOADED = -15,
+        VM_CLONE_FAILED = -16,
+        VM_RESTORE_ON_RUNNING_VM = -17,
+        VM_SNAPSHOT_MISMATCH = -18,
+        VM_REPLICA_MISMATCH = -19,
+        VM_BAD_IMAGE = -20,
+        VM_BAD_ARGUMENTS = -21,
+        VM_CALL_SUSPENDED = -22,
     }
 
     enum vmMallocType_t {
@@ -58,14 +68,22 @@ namespace Q3VM2 {
         [FieldOffset(0)] public uint ui;
     }
 
-    [StructLayout(LayoutKind.Explicit)]
-    unsafe struct header_union {
-        [FieldOffset(0)] public vmHeader_t* h;
-        [FieldOffset(0)] public byte* v;
-    }
-
     unsafe delegate IntPtr systemCallFunc(ref VirtMachine vm, params IntPtr[] parms);
 
+    // args points straight at image[programStack + 4]: args[0] is the syscall
+    // index, args[1] onwards the guest arguments
+    unsafe delegate int vmSyscallFunc_t(ref VirtMachine vm, int* args);
+
+    enum vmInterpret_t {
+        VMI_BYTECODE,
+        VMI_COMPILED,
+        VMI_COMPILED_NATIVE,
+        VMI_PRECOMPILED,
+        VMI_THREADED,
+        VMI_REGISTER,
+        VMI_TIERED
+    }
+
     enum opcode_t {
         OP_UNDEF,
 
@@ -155,6 +173,9 @@ namespace Q3VM2 {
         // IntPtr(*systemCall)(ref vm_t vm, IntPtr* parms);
         public systemCallFunc systemCall;
 
+        // Handlers indexed by -1 - syscall number, checked before systemCall
+        public vmSyscallFunc_t[] syscalls;
+
 
         //public fixed char name[64];
         public string Name;
@@ -168,19 +189,54 @@ namespace Q3VM2 {
         public int currentlyInterpreting;
 
         public int compiled;
+        public vmInterpret_t interpret;
+        public vmCompiledFunc_t[] compiledFunctions;
+        public vmNativeCode_t nativeCode;
+        public vmPrecompiledCode_t precompiledCode;
+        public vmRegisterCode_t registerCode;
+        public vmTieredCode_t tieredCode;
+
+        // The loaded QVM, the code and verifier results below point into it
+        public vmModule_t module;
         public byte* codeBase;
         public int entryOfs;
         public int codeLength;
+        public int codeSize;
 
-        public IntPtr* instructionPointers;
+        public int* instructionPointers;
         public int instructionCount;
+        public vmThreadedInstruction_t* threadedCode;
+        public int fusedInstructions;
+        public bool[] verifiedFunctions;
 
         public byte* dataBase;
         public int dataMask;
         public int dataAlloc;
 
+        // dataBase is a private mapping of dataAlloc bytes, see VMClone.cs
+        public bool dataMapped;
+
+        // dataBase sits in a guard page reservation, see VMGuard.cs
+        public bool dataGuarded;
+
+        // One byte per page of the data segment, set by every store. Allocated
+        // apart from dataBase, out of reach of the guest
+        public byte* dirtyPages;
+        public int[] pageGenerations;
+        public int generation;
+
         public int dataMallocLen;
         public int dataMallocStart;
+        public vmHeap_t heap;
+
+        // Released snapshots waiting to be reused, see VMSnapshot.cs
+        public Stack<vmSnapshot_t> snapshotPool;
+
+        // Streaming to or replaying for a standby, see VMReplicate.cs
+        public vmReplication_t replication;
+
+        // The call waiting on a syscall, see VMAsync.cs
+        public vmContinuation_t continuation;
 
         public int stackBottom;
 
@@ -194,10 +250,12 @@ namespace Q3VM2 {
         public vmErrorCode_t lastError;
     }
 
-    unsafe static class VM {
+    unsafe static partial class VM {
 
         static int vm_debugLevel;
 
+        const int VM_OPSTACK_SIZE = 1024 + 15;
+
         static void Com_Error(vmErrorCode_t level, string error) {
             string msg = string.Format("{0} - {1}", level, error);
             Console.WriteLine(msg);
@@ -210,16 +268,18 @@ namespace Q3VM2 {
         }
 
         public static void memset(void* str, int c, uint n) {
-            for (int i = 0; i < n; i++)
-                ((byte*)str)[i] = (byte)c;
+            byte* p = (byte*)str;
+            ulong v = (byte)c * 0x0101010101010101UL;
+
+            for (; n >= 8; n -= 8, p += 8)
+                *(ulong*)p = v;
+
+            for (; n > 0; n--)
+                *p++ = (byte)c;
         }
 
         public static void memcpy(void* dest, void* src, uint n) {
-            byte* dest_b = (byte*)dest;
-            byte* src_b = (byte*)src;
-
-            for (int i = 0; i < n; i++)
-                dest_b[i] = src_b[i];
+            Buffer.MemoryCopy(src, dest, n, n);
         }
 
         public static void memcpy(void* dest, byte[] src, uint n) {
@@ -233,151 +293,237 @@ namespace Q3VM2 {
             throw new Exception();
         }
 
-        static void* Com_malloc2(byte[] Data) {
-            byte* DataPtr = (byte*)Marshal.AllocHGlobal(Data.Length);
-            Marshal.Copy(Data, 0, (IntPtr)DataPtr, Data.Length);
-            return (void*)DataPtr;
+        static void* Com_malloc(uint size, vmMallocType_t type) {
+            return (void*)Marshal.AllocHGlobal((int)size);
         }
 
         static void* Com_malloc(uint size, ref VirtMachine vm, vmMallocType_t type) {
-            return (void*)Marshal.AllocHGlobal((int)size);
+            return Com_malloc(size, type);
         }
 
-        static void Com_free(void* p, ref VirtMachine vm, vmMallocType_t type) {
+        static void Com_free(void* p, vmMallocType_t type) {
             Marshal.FreeHGlobal((IntPtr)p);
         }
 
-        public static bool VM_Create(ref VirtMachine vm, string Name, byte[] Bytecode, systemCallFunc systemCalls) {
-            int length = Bytecode.Length;
-            byte* bytecode = (byte*)Com_malloc2(Bytecode);
+        static void Com_free(void* p, ref VirtMachine vm, vmMallocType_t type) {
+            Com_free(p, type);
+        }
+
+        public static bool VM_Create(ref VirtMachine vm, string Name, byte[] Bytecode, systemCallFunc systemCalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_Create(ref vm, Name, Bytecode, systemCalls, null, interpret);
+        }
+
+        public static bool VM_Create(ref VirtMachine vm, string Name, byte[] Bytecode, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_Create(ref vm, Name, Bytecode, null, syscalls, interpret);
+        }
+
+        public static bool VM_Create(ref VirtMachine vm, string Name, vmModule_t module, systemCallFunc systemCalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_Create(ref vm, Name, module, systemCalls, null, interpret);
+        }
+
+        public static bool VM_Create(ref VirtMachine vm, string Name, vmModule_t module, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_Create(ref vm, Name, module, null, syscalls, interpret);
+        }
+
+        // Loads a module only this vm uses, VM_Free releases it with the vm
+        static bool VM_Create(ref VirtMachine vm, string Name, byte[] Bytecode, systemCallFunc systemCalls, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret) {
+            vmModule_t module = VM_LoadModule(Name, Bytecode);
 
+            if (module == null) {
+                vm.lastError = vmErrorCode_t.VM_FAILED_TO_LOAD_BYTECODE;
+                Com_Error(vm.lastError, "Failed to load bytecode");
+                return false;
+            }
+
+            bool created = VM_Create(ref vm, Name, module, systemCalls, syscalls, interpret);
+            VM_FreeModule(module);
+
+            return created;
+        }
+
+        static bool VM_Create(ref VirtMachine vm, string Name, vmModule_t module, systemCallFunc systemCalls, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret) {
             // TODO
             /*if (vm == null) {
 				Com_Error(vmErrorCode_t.VM_INVALID_POINTER, "Invalid vm pointer");
 				return -1;
 			}*/
 
-            if (systemCalls == null) {
+            if (systemCalls == null && syscalls == null) {
                 vm.lastError = vmErrorCode_t.VM_NO_SYSCALL_CALLBACK;
                 Com_Error(vm.lastError, "No systemcalls provided");
                 return false;
             }
 
-
+            if (module == null || module.codeBase == null) {
+                vm.lastError = vmErrorCode_t.VM_NOT_LOADED;
+                Com_Error(vm.lastError, "Module not loaded");
+                return false;
+            }
 
             //memset(vm, 0, (uint)sizeof(vm_t));
             //Q_strncpyz(vm.name, name, sizeof(vm.name));
             vm.Name = Name;
 
-            vmHeader_t* header = VM_LoadQVM(ref vm, bytecode, length);
+            vm.systemCall = systemCalls;
+            vm.syscalls = syscalls;
+
+            VM_AttachModule(ref vm, module);
 
-            if (header == null) {
-                vm.lastError = vmErrorCode_t.VM_FAILED_TO_LOAD_BYTECODE;
-                Com_Error(vm.lastError, "Failed to load bytecode");
+            if (VM_CreateData(ref vm) != 0 || VM_PrepareEngine(ref vm, interpret) != 0) {
                 VM_Free(ref vm);
                 return false;
             }
 
-            vm.systemCall = systemCalls;
+            vm.programStack = vm.dataMask + 1;
+            vm.stackBottom = vm.programStack - module.stackSize;
 
-            vm.instructionCount = header->instructionCount;
-            vm.instructionPointers = (IntPtr*)Com_malloc((uint)(vm.instructionCount * IntPtr.Size), ref vm, vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
-            if (vm.instructionPointers == null) {
-                vm.lastError = vmErrorCode_t.VM_MALLOC_FAILED;
-                Com_Error(vm.lastError,
-                          "Instr. pointer malloc failed: out of memory?");
-                VM_Free(ref vm);
-                return false;
-            }
+            return true;
+        }
 
-            vm.codeLength = header->codeLength;
+        static void VM_AttachModule(ref VirtMachine vm, vmModule_t module) {
+            vm.module = module;
+            Interlocked.Increment(ref module.refCount);
+
+            vm.codeBase = module.codeBase;
+            vm.codeLength = module.codeLength;
+            vm.codeSize = module.codeSize;
+            vm.instructionPointers = module.instructionPointers;
+            vm.instructionCount = module.instructionCount;
+            vm.verifiedFunctions = module.verifiedFunctions;
+            vm.numSymbols = module.numSymbols;
+            vm.symbols = module.symbols;
+        }
 
+        // The compiler works from the decoded code, so the interpreter is always
+        // prepared and stays available as the fallback
+        static int VM_PrepareEngine(ref VirtMachine vm, vmInterpret_t interpret) {
             vm.compiled = 0;
-            if (vm.compiled == 0) {
-                if (VM_PrepareInterpreter(ref vm, header) != 0) {
-                    VM_Free(ref vm);
-                    return false;
-                }
+            vm.interpret = vmInterpret_t.VMI_BYTECODE;
+
+            // Only the interpreter runs from lazily decoded code
+            if (interpret != vmInterpret_t.VMI_BYTECODE) {
+                if (VM_DecodeModule(vm.module) != 0)
+                    return -1;
+                vm.verifiedFunctions = vm.module.verifiedFunctions;
             }
 
-            vm.programStack = vm.dataMask + 1;
-            vm.stackBottom = vm.programStack - 0x10000;
+            if (vm_precompiledPath != null && VM_LoadPrecompiled(ref vm, VM_ModuleHash(vm.module)) == 0) {
+                vm.compiled = 1;
+                vm.interpret = vmInterpret_t.VMI_PRECOMPILED;
+            } else if (interpret == vmInterpret_t.VMI_THREADED || interpret == vmInterpret_t.VMI_TIERED) {
+                // Tiered execution patches its threaded code, so it gets its own copy
+                if ((interpret == vmInterpret_t.VMI_TIERED ? VM_PrepareThreaded(ref vm) : VM_ShareThreaded(ref vm)) != 0)
+                    return -1;
+                if (interpret == vmInterpret_t.VMI_TIERED) {
+                    VM_PrepareTiered(ref vm);
+                }
+                vm.interpret = interpret;
+            } else if (interpret != vmInterpret_t.VMI_BYTECODE) {
+                if (VM_Compile(ref vm, interpret) == 0) {
+                    vm.compiled = 1;
+                    vm.interpret = interpret;
+                } else {
+                    Warn("Warning: {0} failed to compile, falling back to interpreter\n", vm.Name);
+                }
+            }
 
-            return true;
+            return 0;
         }
 
-        static vmHeader_t* VM_LoadQVM(ref VirtMachine vm, byte* bytecode, int length) {
+        // Validates the header and lays out the data segment, the data and lit
+        // segments are kept in the module in host byte order
+        // Fills header in host byte order. The file is only read, so it can be a
+        // read only mapping
+        static int VM_LoadQVM(vmModule_t module, byte* bytecode, int length, vmHeader_t* header) {
 
             int dataLength;
             int i;
 
-            header_union header = new header_union();
-            header.v = bytecode;
-
-            /*const union  {
-				const vmHeader_t* h;
-				const byte* v;
-			} header = { .v = bytecode };*/
+            Warn("Loading vm file {0}...\n", module.Name);
 
-            Warn("Loading vm file {0}...\n", vm.Name);
-
-            if (header.h == null || bytecode == null || length <= (int)sizeof(vmHeader_t) || length > 0x400000) {
+            if (bytecode == null || length <= (int)sizeof(vmHeader_t) || length > vm_maxFileSize) {
                 Warn("Failed.\n");
 
-                return null;
+                return -1;
             }
 
-            if (LittleEndianToHost((byte*)&(header.h->vmMagic)) == 0x12721444) {
+            if (LittleEndianToHost(bytecode) == 0x12721444) {
 
                 for (i = 0; i < (int)(sizeof(vmHeader_t)) / 4; i++) {
-                    ((int*)header.h)[i] = LittleEndianToHost((byte*)&(((int*)header.h)[i]));
+                    ((int*)header)[i] = LittleEndianToHost(bytecode + i * 4);
                 }
 
-                if (header.h->bssLength < 0 || header.h->dataLength < 0 ||
-                    header.h->litLength < 0 || header.h->codeLength <= 0 ||
-                    header.h->codeOffset < 0 || header.h->dataOffset < 0 ||
-                    header.h->instructionCount <= 0 || header.h->bssLength > 10485760 ||
-                    header.h->codeOffset + header.h->codeLength > length ||
-                    header.h->dataOffset + header.h->dataLength + header.h->litLength > length) {
+                if (header->bssLength < 0 || header->dataLength < 0 ||
+                    header->litLength < 0 || header->codeLength <= 0 ||
+                    header->codeOffset < 0 || header->dataOffset < 0 ||
+                    header->instructionCount <= 0 || header->bssLength > vm_maxBssSize ||
+                    header->codeOffset + header->codeLength > length ||
+                    header->dataOffset + header->dataLength + header->litLength > length) {
 
-                    Warn("Warning: {0} has bad header\n", vm.Name);
-                    return null;
+                    Warn("Warning: {0} has bad header\n", module.Name);
+                    return -1;
                 }
             } else {
-                Warn("Warning: Invalid magic number in header of \"{0}\". \n\nRead: {1}, expected: {2}\n", vm.Name, LittleEndianToHost((byte*)&(header.h->vmMagic)), 0x12721444);
-                return null;
+                Warn("Warning: Invalid magic number in header of \"{0}\". \n\nRead: {1}, expected: {2}\n", module.Name, LittleEndianToHost(bytecode), 0x12721444);
+                return -1;
             }
 
-            vm.dataMallocLen = 1024 * 150;
-            dataLength = header.h->dataLength + header.h->litLength + header.h->bssLength;
+            module.dataMallocLen = vm_heapSize;
+            module.stackSize = vm_stackSize;
+            dataLength = header->dataLength + header->litLength + header->bssLength;
 
-            vm.dataMallocStart = dataLength + 16;
-            dataLength += vm.dataMallocLen;
+            module.dataMallocStart = dataLength + 16;
 
-            for (i = 0; dataLength > (1 << i); i++) {
+            // Keep the heap clear of the program stack at the top
+            if ((long)module.dataMallocStart + module.dataMallocLen + module.stackSize > VM_MAX_DATA_LENGTH) {
+                Warn("Warning: {0} data segment too large\n", module.Name);
+                return -1;
             }
 
-            dataLength = 1 << i;
+            dataLength = module.dataMallocStart + module.dataMallocLen + module.stackSize;
+
+            for (i = 0; dataLength > (1 << i); i++) {
+            }
 
-            vm.dataAlloc = dataLength + 4;
-            vm.dataBase = (byte*)Com_malloc((uint)(vm.dataAlloc ), ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
-            vm.dataMask = dataLength - 1;
-            if (vm.dataBase == null) {
+            module.dataLength = 1 << i;
+            module.dataImageLength = header->dataLength + header->litLength;
+            module.dataImage = (byte*)Com_malloc((uint)module.dataImageLength, vmMallocType_t.VM_ALLOC_DATA_SEC);
+            if (module.dataImage == null) {
                 Com_Error(vmErrorCode_t.VM_MALLOC_FAILED, "Data malloc failed: out of memory?\n");
-                return null;
+                return -1;
             }
 
+            // Swapped on the way out of the file
+            for (i = 0; i < header->dataLength; i += sizeof(int)) {
+                *(int*)(module.dataImage + i) = LittleEndianToHost(bytecode + header->dataOffset + i);
+            }
 
+            memcpy(module.dataImage + header->dataLength, bytecode + header->dataOffset + header->dataLength, (uint)header->litLength);
 
-            memset(vm.dataBase, 0, (uint)vm.dataAlloc);
-            memcpy(vm.dataBase, header.v + header.h->dataOffset, (uint)(header.h->dataLength + header.h->litLength));
+            return 0;
+        }
 
-            for (i = 0; i < header.h->dataLength; i += sizeof(int)) {
-                *(int*)(vm.dataBase + i) =
-                    LittleEndianToHost((byte*)&(*(int*)(vm.dataBase + i)));
+        // Gives the vm its own data segment, initialized from the module
+        static int VM_CreateData(ref VirtMachine vm) {
+            vmModule_t module = vm.module;
+
+            vm.dataMallocStart = module.dataMallocStart;
+            vm.dataMallocLen = module.dataMallocLen;
+            vm.dataAlloc = module.dataLength + 4;
+            vm.dataBase = VM_AllocData(ref vm);
+            vm.dataMask = module.dataLength - 1;
+            vm.dirtyPages = vm.dataBase != null ? VM_AllocDirty(ref vm) : null;
+            if (vm.dataBase == null || vm.dirtyPages == null) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_MALLOC_FAILED, "Data malloc failed: out of memory?\n");
+                return -1;
             }
 
-            return header.h;
+            VM_AdviseData(ref vm);
+            memcpy(vm.dataBase, module.dataImage, (uint)module.dataImageLength);
+
+            vm.heap = VM_HeapCreate(vm.dataMallocStart, vm.dataMallocLen);
+
+            return 0;
         }
 
         public static IntPtr VM_Call(ref VirtMachine vm, int command, params int[] command_args) {
@@ -401,11 +547,119 @@ namespace Q3VM2 {
                     args[i] = command_args[i - 1];
             }
 
+            // Only the interpreter needs an op stack from its caller
+            byte* opStack = null;
+            if (vm.interpret == vmInterpret_t.VMI_BYTECODE) {
+                byte* buffer = stackalloc byte[VM_OPSTACK_SIZE];
+                opStack = buffer;
+            }
+
+            return VM_CallEntry(ref vm, 0, args, opStack);
+        }
+
+        public static bool VM_CallBatch(ref VirtMachine vm, int command, int[] args, int stride, int[] results) {
+            if (args == null || results == null || stride < 0 || (long)results.Length * stride > args.Length) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_ARGUMENTS, "VM_CallBatch arguments do not match the results");
+                return false;
+            }
+
+            fixed (int* tuples = args) {
+                fixed (int* r = results) {
+                    return VM_CallBatch(ref vm, command, tuples, stride, r, results.Length);
+                }
+            }
+        }
+
+        // Calls command count times, the i-th call with the stride ints at
+        // args + i * stride and its result in results[i]. The argument checks,
+        // the argument block and the op stack are set up once for all of them.
+        // Every call still goes through VM_CallEntry, so it behaves the same as
+        // through VM_Call. A call that suspends ends the batch with
+        // VM_CALL_SUSPENDED, the vm stays suspended and results[i] is left alone
+        public static bool VM_CallBatch(ref VirtMachine vm, int command, int* args, int stride, int* results, int count) {
+            int* callArgs = stackalloc int[13];
+            byte* opStack = stackalloc byte[VM_OPSTACK_SIZE];
+
+            if (vm.codeLength < 1) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_NOT_LOADED, "VM not loaded");
+                return false;
+            }
+
+            if (stride < 0 || stride > 12 || count < 0) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_ARGUMENTS, "VM_CallBatch with more than 12 arguments");
+                return false;
+            }
+
+            callArgs[0] = command;
+
+            for (int i = 0; i < count; i++, args += stride) {
+                for (int j = 0; j < stride; j++)
+                    callArgs[j + 1] = args[j];
+
+                int r = (int)VM_CallEntry(ref vm, 0, callArgs, opStack);
+
+                if (VM_Suspended(ref vm)) {
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_CALL_SUSPENDED, "VM_CallBatch call suspended");
+                    return false;
+                }
+
+                results[i] = r;
+            }
+
+            return true;
+        }
+
+        // Runs the function starting at instruction function, which is 0 for
+        // vmMain, with the 13 arguments at args
+        static IntPtr VM_CallEntry(ref VirtMachine vm, int function, int* args, byte* opStack) {
+            if (vm.callLevel == 0 && vm.continuation != null) {
+                if (vm.continuation.suspended) {
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_CALL_SUSPENDED, "VM_Call on a suspended vm");
+                    return (IntPtr)(-1);
+                }
+
+                // Left by a syscall that failed after VM_Suspend
+                vm.continuation = null;
+            }
+
+            if (vm.replication != null && vm.callLevel == 0)
+                VM_ReplicateCall(ref vm, function, args);
 
             ++vm.callLevel;
-            IntPtr r = (IntPtr)VM_CallInterpreted(ref vm, args);
+            IntPtr r = vm.dataGuarded ? VM_CallGuarded(ref vm, function, args, opStack) : VM_CallEngine(ref vm, function, args, opStack);
             --vm.callLevel;
 
+            if (vm.replication != null && vm.callLevel == 0)
+                VM_ReplicateReturn(ref vm, (int)r);
+
+            return r;
+        }
+
+        static IntPtr VM_CallEngine(ref VirtMachine vm, int function, int* args, byte* opStack) {
+            IntPtr r;
+
+            switch (vm.interpret) {
+                case vmInterpret_t.VMI_COMPILED:
+                    r = (IntPtr)VM_CallCompiled(ref vm, function, args);
+                    break;
+                case vmInterpret_t.VMI_COMPILED_NATIVE:
+                    r = (IntPtr)VM_CallNative(ref vm, function, args);
+                    break;
+                case vmInterpret_t.VMI_PRECOMPILED:
+                    r = (IntPtr)VM_CallPrecompiled(ref vm, function, args);
+                    break;
+                case vmInterpret_t.VMI_THREADED:
+                case vmInterpret_t.VMI_TIERED:
+                    r = (IntPtr)VM_CallThreaded(ref vm, function, args);
+                    break;
+                case vmInterpret_t.VMI_REGISTER:
+                    r = (IntPtr)VM_CallRegister(ref vm, function, args);
+                    break;
+                default:
+                    r = (IntPtr)VM_CallInterpreted(ref vm, function, args, opStack);
+                    break;
+            }
+
             return r;
         }
 
@@ -421,21 +675,60 @@ namespace Q3VM2 {
                 return;
             }
 
-            if (vm.codeBase != null) {
-                Com_free(vm.codeBase, ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
-                vm.codeBase = null;
-            }
+            vm.continuation = null;
 
             if (vm.dataBase != null) {
-                Com_free(vm.dataBase, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                if (vm.dataGuarded)
+                    VM_GuardUnmap(vm.dataBase);
+                else if (vm.dataMapped)
+                    Posix.munmap((IntPtr)vm.dataBase, (UIntPtr)(uint)vm.dataAlloc);
+                else
+                    Com_free(vm.dataBase, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
                 vm.dataBase = null;
+                vm.dataMapped = false;
+                vm.dataGuarded = false;
+                vm.pageGenerations = null;
             }
 
-            if (vm.instructionPointers != null) {
-                Com_free(vm.instructionPointers, ref vm, vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
-                vm.instructionPointers = null;
+            if (vm.dirtyPages != null) {
+                Com_free(vm.dirtyPages, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                vm.dirtyPages = null;
             }
 
+            if (vm.threadedCode != null) {
+                if (vm.module == null || vm.threadedCode != vm.module.threadedCode)
+                    Com_free(vm.threadedCode, ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                vm.threadedCode = null;
+                vm.fusedInstructions = 0;
+            }
+
+            // The code belongs to the module
+            vm.codeBase = null;
+            vm.codeLength = 0;
+            vm.codeSize = 0;
+            vm.instructionPointers = null;
+            vm.instructionCount = 0;
+            vm.numSymbols = 0;
+            vm.symbols = null;
+
+            if (vm.module != null) {
+                VM_FreeModule(vm.module);
+                vm.module = null;
+            }
+
+            VM_FreeNativeCode(ref vm);
+            VM_FreeSnapshotPool(ref vm);
+            vm.replication = null;
+
+            vm.compiledFunctions = null;
+            vm.precompiledCode = null;
+            vm.registerCode = null;
+            vm.tieredCode = null;
+            vm.verifiedFunctions = null;
+            vm.heap = null;
+            vm.compiled = 0;
+            vm.interpret = vmInterpret_t.VMI_BYTECODE;
+
             // TODO: Clear vm
             //memset(vm, 0, sizeof(*vm));
         }
@@ -501,6 +794,7 @@ namespace Q3VM2 {
             }
 
             memcpy(vm.dataBase + dest, vm.dataBase + src, n);
+            VM_MarkDirty(ref vm, (int)dest, (int)n);
         }
 
         // b is 4 bytes always
@@ -508,175 +802,299 @@ namespace Q3VM2 {
             return (b[0] << 0) | (b[1] << 8) | (b[2] << 16) | (b[3] << 24);
         }
 
-        static int VM_PrepareInterpreter(ref VirtMachine vm, vmHeader_t* header) {
+        // Decodes straight from the file into codeBase. The first pass finds
+        // where every instruction and function starts, the second decodes the
+        // functions. With vm_lazyDecode the second pass is left to
+        // VM_DecodeFunction, see VMLazy.cs
+        static int VM_PrepareInterpreter(vmModule_t module, byte* bytecode, vmHeader_t* header) {
             int op;
             int byte_pc;
-            int int_pc;
+            int code_pc;
+            int n;
             byte* code;
             int instruction;
-            int* codeBase;
+            List<int> functionStarts = new List<int>();
+            List<int> functionOffsets = new List<int>();
 
-            vm.codeBase = (byte*)Com_malloc((uint)(vm.codeLength * 4), ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            code_pc = byte_pc = 0;
+            instruction = 0;
+            code = bytecode + header->codeOffset;
 
-            if (vm.codeBase == null) {
+            while (instruction < header->instructionCount) {
+                if (byte_pc >= header->codeLength) {
+                    Com_Error(vmErrorCode_t.VM_PC_OUT_OF_RANGE,
+                              "VM_PrepareInterpreter: pc > header->codeLength");
+                    return -1;
+                }
+
+                op = (int)code[byte_pc];
+
+                if (op == (int)opcode_t.OP_ENTER || instruction == 0) {
+                    functionStarts.Add(instruction);
+                    functionOffsets.Add(byte_pc);
+                }
+
+                module.instructionPointers[instruction] = code_pc;
+                instruction++;
+
+                byte_pc++;
+                code_pc++;
+
+                if (VM_HasOperand((opcode_t)op)) {
+                    n = op == (int)opcode_t.OP_ARG ? 1 : 4;
+                    if (byte_pc + n > header->codeLength) {
+                        Com_Error(vmErrorCode_t.VM_PC_OUT_OF_RANGE,
+                                  "VM_PrepareInterpreter: pc > header->codeLength");
+                        return -1;
+                    }
+
+                    code_pc += 1 << VM_OperandWidth((opcode_t)op, VM_RawOperand(code, op, byte_pc));
+                    byte_pc += n;
+                } else if (op < 0 || op >= (int)opcode_t.OP_MAX) {
+                    Com_Error(vmErrorCode_t.VM_BAD_INSTRUCTION, "Bad VM instruction");
+                    return -1;
+                }
+            }
+
+            module.codeSize = code_pc;
+            module.codeBase = (byte*)Com_malloc((uint)module.codeSize, vmMallocType_t.VM_ALLOC_CODE_SEC);
+
+            if (module.codeBase == null) {
                 Com_Error(vmErrorCode_t.VM_MALLOC_FAILED,
                           "Data pointer malloc failed: out of memory?");
                 return -1;
             }
 
-            memcpy(vm.codeBase, (byte*)header + header->codeOffset, (uint)vm.codeLength);
+            module.functionStarts = functionStarts.ToArray();
+            module.functionOffsets = functionOffsets.ToArray();
 
-            int_pc = byte_pc = 0;
-            instruction = 0;
-            code = (byte*)header + header->codeOffset;
-            codeBase = (int*)vm.codeBase;
+            if (vm_lazyDecode)
+                return VM_PrepareLazy(module, code);
 
-            while (instruction < header->instructionCount) {
-                vm.instructionPointers[instruction] = (IntPtr)int_pc;
-                instruction++;
+            for (int function = 0; function < module.functionStarts.Length; function++) {
+                if (VM_DecodeFunctionBody(module, code, function, null) != 0)
+                    return -1;
+            }
 
+            return 0;
+        }
+
+        // Operand of the instruction at code[byte_pc - 1] in the file
+        static int VM_RawOperand(byte* code, int op, int byte_pc) {
+            return op == (int)opcode_t.OP_ARG ? (int)code[byte_pc] : LittleEndianToHost(&code[byte_pc]);
+        }
+
+        // Decoded code has a byte per opcode, the top two bits of it give the
+        // width of the operand that follows: a signed byte, a short or an int.
+        // Branch targets are codeBase offsets and always an int, so the layout
+        // does not depend on where branches go
+        const int VM_OPCODE_MASK = 0x3f;
+        const int VM_OPERAND_SHIFT = 6;
+
+        static int VM_OperandWidth(opcode_t op, int value) {
+            if (VM_IsBranch(op))
+                return 2;
+            if (value == (sbyte)value)
+                return 0;
+            if (value == (short)value)
+                return 1;
+            return 2;
+        }
+
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        static int VM_ReadOperand(byte* code, int opcode, ref int pc) {
+            int value;
+
+            switch (opcode >> VM_OPERAND_SHIFT) {
+                case 0:
+                    value = (sbyte)code[pc];
+                    pc += 1;
+                    break;
+                case 1:
+                    value = *(short*)&code[pc];
+                    pc += 2;
+                    break;
+                default:
+                    value = *(int*)&code[pc];
+                    pc += 4;
+                    break;
+            }
+
+            return value;
+        }
+
+        // Decodes one function from code into codeBase. Branches into functions
+        // not decoded yet queue them on pending
+        static int VM_DecodeFunctionBody(vmModule_t module, byte* code, int function, Stack<int> pending) {
+            byte* codeBase = module.codeBase;
+            int instruction = module.functionStarts[function];
+            int end = function + 1 < module.functionStarts.Length ? module.functionStarts[function + 1] : module.instructionCount;
+            int byte_pc = module.functionOffsets[function];
+            int code_pc = module.instructionPointers[instruction];
+            int op;
+            int value;
+            int width;
+
+            for (; instruction < end; instruction++) {
                 op = (int)code[byte_pc];
-                codeBase[int_pc] = op;
-                if (byte_pc > header->codeLength) {
-                    Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE,
-                              "VM_PrepareInterpreter: pc > header->codeLength");
-                    return -1;
+                byte_pc++;
+
+                if (!VM_HasOperand((opcode_t)op)) {
+                    codeBase[code_pc++] = (byte)op;
+                    continue;
                 }
 
-                byte_pc++;
-                int_pc++;
+                value = VM_RawOperand(code, op, byte_pc);
+                byte_pc += op == (int)opcode_t.OP_ARG ? 1 : 4;
 
-                switch ((opcode_t)op) {
-                    case opcode_t.OP_ENTER:
-                    case opcode_t.OP_CONST:
-                    case opcode_t.OP_LOCAL:
-                    case opcode_t.OP_LEAVE:
-                    case opcode_t.OP_EQ:
-                    case opcode_t.OP_NE:
-                    case opcode_t.OP_LTI:
-                    case opcode_t.OP_LEI:
-                    case opcode_t.OP_GTI:
-                    case opcode_t.OP_GEI:
-                    case opcode_t.OP_LTU:
-                    case opcode_t.OP_LEU:
-                    case opcode_t.OP_GTU:
-                    case opcode_t.OP_GEU:
-                    case opcode_t.OP_EQF:
-                    case opcode_t.OP_NEF:
-                    case opcode_t.OP_LTF:
-                    case opcode_t.OP_LEF:
-                    case opcode_t.OP_GTF:
-                    case opcode_t.OP_GEF:
-                    case opcode_t.OP_BLOCK_COPY:
-                        codeBase[int_pc] = LittleEndianToHost(&code[byte_pc]);
-                        byte_pc += 4;
-                        int_pc++;
+                if (VM_IsBranch((opcode_t)op)) {
+                    if (value < 0 || value >= module.instructionCount) {
+                        Com_Error(vmErrorCode_t.VM_JUMP_TO_INVALID_INSTRUCTION,
+                                  "VM_PrepareInterpreter: Jump to invalid instruction number");
+                        return -1;
+                    }
+
+                    if (pending != null)
+                        pending.Push(VM_FunctionAt(module, value));
+
+                    value = module.instructionPointers[value];
+                }
+
+                width = VM_OperandWidth((opcode_t)op, value);
+                codeBase[code_pc++] = (byte)(op | width << VM_OPERAND_SHIFT);
+
+                switch (width) {
+                    case 0:
+                        codeBase[code_pc] = (byte)value;
                         break;
-                    case opcode_t.OP_ARG:
-                        codeBase[int_pc] = (int)code[byte_pc];
-                        byte_pc++;
-                        int_pc++;
+                    case 1:
+                        *(short*)&codeBase[code_pc] = (short)value;
                         break;
                     default:
-                        if (op < 0 || op >= (int)opcode_t.OP_MAX) {
-                            vm.lastError = vmErrorCode_t.VM_BAD_INSTRUCTION;
-                            Com_Error(vm.lastError, "Bad VM instruction");
-                            return -1;
-                        }
+                        *(int*)&codeBase[code_pc] = value;
                         break;
                 }
+
+                code_pc += 1 << width;
             }
-            int_pc = 0;
-            instruction = 0;
 
-            while (instruction < header->instructionCount) {
-                op = codeBase[int_pc];
-                instruction++;
-                int_pc++;
+            return 0;
+        }
 
-                switch ((opcode_t)op) {
+        static int VM_SystemCall(ref VirtMachine vm, byte* image, int programStack, int programCounter) {
+            int* args = (int*)&image[programStack + 4];
+            int index = -1 - programCounter;
 
-                    case opcode_t.OP_EQ:
-                    case opcode_t.OP_NE:
-                    case opcode_t.OP_LTI:
-                    case opcode_t.OP_LEI:
-                    case opcode_t.OP_GTI:
-                    case opcode_t.OP_GEI:
-                    case opcode_t.OP_LTU:
-                    case opcode_t.OP_LEU:
-                    case opcode_t.OP_GTU:
-                    case opcode_t.OP_GEU:
-                    case opcode_t.OP_EQF:
-                    case opcode_t.OP_NEF:
-                    case opcode_t.OP_LTF:
-                    case opcode_t.OP_LEF:
-                    case opcode_t.OP_GTF:
-                    case opcode_t.OP_GEF:
-                        if (codeBase[int_pc] < 0 || codeBase[int_pc] > vm.instructionCount) {
-                            Com_Error(vm.lastError = vmErrorCode_t.VM_JUMP_TO_INVALID_INSTRUCTION,
-                                      "VM_PrepareInterpreter: Jump to invalid instruction number");
-                            return -1;
-                        }
+            vm.programStack = programStack - 4;
 
-                        codeBase[int_pc] = (int)vm.instructionPointers[codeBase[int_pc]];
-                        int_pc++;
-                        break;
+            args[0] = index;
 
-                    case opcode_t.OP_ENTER:
-                    case opcode_t.OP_CONST:
-                    case opcode_t.OP_LOCAL:
-                    case opcode_t.OP_LEAVE:
-                    case opcode_t.OP_BLOCK_COPY:
-                    case opcode_t.OP_ARG:
-                        int_pc++;
-                        break;
+            // Syscalls of nested calls are part of the outer syscall
+            if (vm.replication != null && vm.callLevel == 1)
+                return VM_ReplicateSystemCall(ref vm, args);
 
-                    default:
-                        break;
+            return VM_DispatchSystemCall(ref vm, args);
+        }
+
+        static int VM_DispatchSystemCall(ref VirtMachine vm, int* args) {
+            int index = args[0];
+            vmSyscallFunc_t[] syscalls = vm.syscalls;
+
+            if (syscalls != null && (uint)index < (uint)syscalls.Length && syscalls[index] != null) {
+                try {
+                    return syscalls[index](ref vm, args);
+                } catch (Exception E) when (VM_GuardHostException(E)) {
+                    throw;
                 }
             }
-            return 0;
-        }
 
-        static int VM_CallInterpreted(ref VirtMachine vm, int* args) {
-            //byte stack[1024 + 15];
-            byte* stack = stackalloc byte[1024 + 15];
+            if (vm.systemCall == null) {
+                vm.lastError = vmErrorCode_t.VM_NO_SYSCALL_CALLBACK;
+                Com_Error(vm.lastError, "Unbound system call");
+                return -1;
+            }
+
+            // Old delegate, the guest ints are widened into a fresh array
+            IntPtr[] arguments = new IntPtr[16];
 
+            for (int i = 0; i < 16; ++i) {
+                arguments[i] = (IntPtr)args[i];
+            }
+
+            try {
+                return (int)vm.systemCall(ref vm, arguments);
+            } catch (Exception E) when (VM_GuardHostException(E)) {
+                throw;
+            }
+        }
+
+        // The op stack is VM_OPSTACK_SIZE bytes
+        static int VM_CallInterpreted(ref VirtMachine vm, int function, int* args, byte* stack) {
             int* opStack;
             byte opStackOfs;
             int programCounter;
             int programStack;
             int stackOnEntry;
             byte* image;
-            int* codeImage;
+            byte* codeImage;
+            byte* dirty;
             int v1;
             int dataMask;
+            int stackBottom;
             int arg;
+            vmModule_t lazy;
+            vmContinuation_t resume;
 
             vm.currentlyInterpreting = 1;
 
-            programStack = stackOnEntry = vm.programStack;
-
             image = vm.dataBase;
-            codeImage = (int*)vm.codeBase;
-            dataMask = vm.dataMask;
-            programCounter = 0;
-            programStack -= (8 + 4 * 13);
+            codeImage = vm.codeBase;
+            dirty = vm.dirtyPages;
+            dataMask = VM_AccessMask(ref vm);
+            stackBottom = vm.stackBottom;
+            opStack = (int*)stack;
 
-            for (arg = 0; arg < 13; arg++) {
-                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
-            }
+            lazy = vm.module.decodedFunctions != null ? vm.module : null;
 
-            *(int*)&image[programStack + 4] = 0;
-            *(int*)&image[programStack] = -1;
+            // Calls are refused while suspended, so a suspended call at the top
+            // level is VM_Resume
+            resume = vm.callLevel == 1 && VM_Suspended(ref vm) ? vm.continuation : null;
 
-            // Pad the stack to 16 bit alignment?
-            //opStack = (int*)(((int)stack + 15) & ~(15));
-            //int DIST = (int)(stack - (byte*)opStack);
+            if (resume != null) {
+                vm.continuation = null;
 
-            opStack = (int*)stack;
-            *opStack = 0x0000BEEF;
-            opStackOfs = 0;
+                programCounter = resume.programCounter;
+                programStack = resume.programStack;
+                stackOnEntry = resume.stackOnEntry;
+                opStackOfs = resume.opStackOfs;
+                for (arg = 0; arg <= opStackOfs; arg++)
+                    opStack[arg] = resume.opStack[arg];
+
+                opStackOfs++;
+                opStack[opStackOfs] = resume.result;
+            } else {
+                programStack = stackOnEntry = vm.programStack;
+                programStack -= (8 + 4 * 13);
+
+                if (lazy != null)
+                    VM_DecodeAt(lazy, function);
+
+                programCounter = vm.instructionPointers[function];
+
+                for (arg = 0; arg < 13; arg++) {
+                    *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+                }
+
+                *(int*)&image[programStack + 4] = 0;
+                *(int*)&image[programStack] = -1;
+
+                // Pad the stack to 16 bit alignment?
+                //opStack = (int*)(((int)stack + 15) & ~(15));
+                //int DIST = (int)(stack - (byte*)opStack);
+
+                *opStack = 0x0000BEEF;
+                opStackOfs = 0;
+            }
 
             int opcode, r0, r1;
 
@@ -687,7 +1105,7 @@ namespace Q3VM2 {
                 r1 = opStack[(byte)(opStackOfs - 1)];
             nextInstruction2:
                 opcode = codeImage[programCounter++];
-                opcode_t opcode_type = (opcode_t)opcode;
+                opcode_t opcode_type = (opcode_t)(opcode & VM_OPCODE_MASK);
 
                 switch (opcode_type) {
                     case opcode_t.OP_UNDEF:
@@ -701,16 +1119,12 @@ namespace Q3VM2 {
                     case opcode_t.OP_CONST:
                         opStackOfs++;
                         r1 = r0;
-                        r0 = opStack[opStackOfs] = codeImage[programCounter];
-
-                        programCounter += 1;
+                        r0 = opStack[opStackOfs] = VM_ReadOperand(codeImage, opcode, ref programCounter);
                         goto nextInstruction2;
                     case opcode_t.OP_LOCAL:
                         opStackOfs++;
                         r1 = r0;
-                        r0 = opStack[opStackOfs] = codeImage[programCounter] + programStack;
-
-                        programCounter += 1;
+                        r0 = opStack[opStackOfs] = VM_ReadOperand(codeImage, opcode, ref programCounter) + programStack;
                         goto nextInstruction2;
                     case opcode_t.OP_LOAD4:
 
@@ -725,26 +1139,29 @@ namespace Q3VM2 {
 
                     case opcode_t.OP_STORE4:
                         *(int*)&image[r1 & dataMask] = r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                        dirty[((r1 & dataMask) + 3) >> VM_DIRTY_SHIFT] = 1;
                         opStackOfs -= 2;
                         goto nextInstruction;
                     case opcode_t.OP_STORE2:
                         *(short*)&image[r1 & dataMask] = (short)r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                        dirty[((r1 & dataMask) + 1) >> VM_DIRTY_SHIFT] = 1;
                         opStackOfs -= 2;
                         goto nextInstruction;
                     case opcode_t.OP_STORE1:
                         image[r1 & dataMask] = (byte)r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
                         opStackOfs -= 2;
                         goto nextInstruction;
                     case opcode_t.OP_ARG:
 
-                        *(int*)&image[(codeImage[programCounter] + programStack) &
+                        *(int*)&image[(VM_ReadOperand(codeImage, opcode, ref programCounter) + programStack) &
                                       dataMask] = r0;
                         opStackOfs--;
-                        programCounter += 1;
                         goto nextInstruction;
                     case opcode_t.OP_BLOCK_COPY:
-                        VM_BlockCopy((uint)r1, (uint)r0, (uint)codeImage[programCounter], ref vm);
-                        programCounter += 1;
+                        VM_BlockCopy((uint)r1, (uint)r0, (uint)VM_ReadOperand(codeImage, opcode, ref programCounter), ref vm);
                         opStackOfs -= 2;
                         goto nextInstruction;
                     case opcode_t.OP_CALL:
@@ -754,43 +1171,29 @@ namespace Q3VM2 {
                         programCounter = r0;
                         opStackOfs--;
                         if (programCounter < 0) {
-                            int r = -1;
-
-                            vm.programStack = programStack - 4;
-
-                            *(int*)&image[programStack + 4] = -1 - programCounter;
-
-                            if (IntPtr.Size != sizeof(int)) {
-                                //IntPtr* argarr = stackalloc IntPtr[16]; // 16 bytes always and fixed
-
-                                // Todo: use span
-                                IntPtr[] arguments = new IntPtr[16];
-
-                                int* imagePtr = (int*)&image[programStack];
-
+                            int r = VM_SystemCall(ref vm, image, programStack, programCounter);
 
-                                for (int i = 0; i < 16; ++i) {
-                                    // argarr[i] = (IntPtr)(*(++imagePtr));
-                                    arguments[i] = (IntPtr)(*(++imagePtr));
-                                }
+                            programCounter = *(int*)&image[programStack];
 
-                                r = (int)vm.systemCall(ref vm, arguments);
-                            } else {
-                                throw new NotImplementedException();
-                                // todo: Line below
-                                //r = (int)vm.systemCall(ref vm, (IntPtr*)&image[programStack + 4]);
+                            if (vm.continuation != null && vm.callLevel == 1) {
+                                VM_SaveContinuation(ref vm, programCounter, programStack, stackOnEntry, opStack, opStackOfs);
+                                vm.currentlyInterpreting = 0;
+                                vm.programStack = stackOnEntry;
+                                return 0;
                             }
 
                             opStackOfs++;
                             opStack[opStackOfs] = r;
-                            programCounter = *(int*)&image[programStack];
                         } else if ((uint)programCounter >= (uint)vm.instructionCount) {
                             vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE;
 
                             Com_Error(vm.lastError, "VM program counter out of range in OP_CALL");
                             return -1;
                         } else {
-                            programCounter = (int)vm.instructionPointers[programCounter];
+                            if (lazy != null)
+                                VM_DecodeAt(lazy, programCounter);
+
+                            programCounter = vm.instructionPointers[programCounter];
                         }
                         goto nextInstruction;
 
@@ -802,15 +1205,21 @@ namespace Q3VM2 {
                         goto nextInstruction;
                     case opcode_t.OP_ENTER:
 
-                        v1 = codeImage[programCounter];
+                        v1 = VM_ReadOperand(codeImage, opcode, ref programCounter);
 
-                        programCounter += 1;
                         programStack -= v1;
 
+                        // Frames are not marked dirty, they have to stay on the
+                        // stack pages
+                        if (programStack < stackBottom) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "VM stack overflow");
+                            return -1;
+                        }
+
                         goto nextInstruction;
                     case opcode_t.OP_LEAVE:
 
-                        v1 = codeImage[programCounter];
+                        v1 = VM_ReadOperand(codeImage, opcode, ref programCounter);
 
                         programStack += v1;
 
@@ -818,7 +1227,7 @@ namespace Q3VM2 {
 
                         if (programCounter == -1) {
                             goto done;
-                        } else if ((uint)programCounter >= (uint)vm.codeLength) {
+                        } else if ((uint)programCounter >= (uint)vm.codeSize) {
                             Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_LEAVE");
                             return -1;
                         }
@@ -830,138 +1239,141 @@ namespace Q3VM2 {
                             return -1;
                         }
 
-                        programCounter = (int)vm.instructionPointers[r0];
+                        if (lazy != null)
+                            VM_DecodeAt(lazy, r0);
+
+                        programCounter = vm.instructionPointers[r0];
 
                         opStackOfs--;
                         goto nextInstruction;
                     case opcode_t.OP_EQ:
                         opStackOfs -= 2;
                         if (r1 == r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_NE:
                         opStackOfs -= 2;
                         if (r1 != r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LTI:
                         opStackOfs -= 2;
                         if (r1 < r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LEI:
                         opStackOfs -= 2;
                         if (r1 <= r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GTI:
                         opStackOfs -= 2;
                         if (r1 > r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GEI:
                         opStackOfs -= 2;
                         if (r1 >= r0) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LTU:
                         opStackOfs -= 2;
                         if (((uint)r1) < ((uint)r0)) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LEU:
                         opStackOfs -= 2;
                         if (((uint)r1) <= ((uint)r0)) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GTU:
                         opStackOfs -= 2;
                         if (((uint)r1) > ((uint)r0)) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GEU:
                         opStackOfs -= 2;
                         if (((uint)r1) >= ((uint)r0)) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_EQF:
                         opStackOfs -= 2;
 
                         if (((float*)opStack)[(byte)(opStackOfs + 1)] == ((float*)opStack)[(byte)(opStackOfs + 2)]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_NEF:
                         opStackOfs -= 2;
 
                         if (((float*)opStack)[(byte)(opStackOfs + 1)] != ((float*)opStack)[(byte)(opStackOfs + 2)]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LTF:
                         opStackOfs -= 2;
 
                         if (((float*)opStack)[(byte)(opStackOfs + 1)] < ((float*)opStack)[(byte)(opStackOfs + 2)]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_LEF:
                         opStackOfs -= 2;
 
                         if (((float*)opStack)[(byte)((byte)(opStackOfs + 1))] <= ((float*)opStack)[(byte)((byte)(opStackOfs + 2))]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GTF:
@@ -969,10 +1381,10 @@ namespace Q3VM2 {
 
                         if (((float*)opStack)[(byte)(opStackOfs + 1)] >
                             ((float*)opStack)[(byte)(opStackOfs + 2)]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
                     case opcode_t.OP_GEF:
@@ -980,10 +1392,10 @@ namespace Q3VM2 {
 
                         if (((float*)opStack)[(byte)(opStackOfs + 1)] >=
                             ((float*)opStack)[(byte)(opStackOfs + 2)]) {
-                            programCounter = codeImage[programCounter];
+                            programCounter = *(int*)&codeImage[programCounter];
                             goto nextInstruction;
                         } else {
-                            programCounter += 1;
+                            programCounter += 4;
                             goto nextInstruction;
                         }
 
@@ -1116,11 +1528,14 @@ namespace Q3VM2 {
         }
 
         public static IntPtr VM_VMMalloc(int size, ref VirtMachine vm, out IntPtr GlobalAddr) {
-            IntPtr Addr = (IntPtr)vm.dataMallocStart;
-            vm.dataMallocStart += size;
+            IntPtr Addr = (IntPtr)VM_HeapAlloc(ref vm, size);
 
-            GlobalAddr = (IntPtr)VM_ArgPtr(Addr, ref vm);
+            GlobalAddr = Addr != IntPtr.Zero ? (IntPtr)VM_ArgPtr(Addr, ref vm) : IntPtr.Zero;
             return Addr;
         }
+
+        public static int VM_VMFree(IntPtr Addr, ref VirtMachine vm) {
+            return VM_HeapFree(ref vm, (int)Addr);
+        }
     }
 }
\ No newline at end of file
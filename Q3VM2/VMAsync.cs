@@ -0,0 +1,105 @@
+﻿using System;
+using System.Threading.Tasks;
+
+// Suspendable syscalls. A syscall handler that starts something slow calls
+// VM_Suspend with the task that completes it and returns. The interpreter
+// then saves where it is, the program counter, program stack and op stack,
+// into vm.continuation and VM_Call returns without the call having finished.
+// Once the task is done the host hands its result to VM_Resume, which pushes
+// it as the return value of the syscall and carries on. A call can suspend any
+// number of times, it has finished when VM_Suspended is false again:
+//
+//     VM.VM_Call(ref vm, command);
+//     while (VM.VM_Suspended(ref vm))
+//         VM.VM_Resume(ref vm, await vm.continuation.pending);
+//
+// Between the two no thread is tied to the vm, so a few threads can serve many
+// vms that wait on I/O. Only VMI_BYTECODE keeps its whole state where it can be
+// saved, the other engines have host frames in the way. For the same reason a
+// call made from a syscall cannot suspend, and neither can a replicated vm,
+// whose log has no room for a call that returns twice.
+//
+// A suspended vm takes no other calls. VM_CallBatch stops at the call that
+// suspends. VM_Free drops the continuation.
+
+namespace Q3VM2 {
+    class vmContinuation_t {
+        // What the suspended syscall waits for, null when the host knows
+        // otherwise when to resume
+        public Task<int> pending;
+
+        // Set once the interpreter has saved its state below
+        public bool suspended;
+
+        public int programCounter;
+        public int programStack;
+        public int stackOnEntry;
+        public byte opStackOfs;
+        public int[] opStack;
+
+        // What VM_Resume pushes for the syscall
+        public int result;
+    }
+
+    unsafe static partial class VM {
+
+        // Called from a syscall handler, the vm suspends when the handler
+        // returns and the value it returns is ignored
+        public static void VM_Suspend(ref VirtMachine vm, Task<int> pending) {
+            if (vm.interpret != vmInterpret_t.VMI_BYTECODE) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_CALL_SUSPENDED, "VM_Suspend needs the bytecode interpreter");
+                return;
+            }
+
+            if (vm.callLevel != 1 || vm.replication != null) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_CALL_SUSPENDED, "VM_Suspend in a nested or replicated call");
+                return;
+            }
+
+            vm.continuation = new vmContinuation_t();
+            vm.continuation.pending = pending;
+        }
+
+        public static bool VM_Suspended(ref VirtMachine vm) {
+            return vm.continuation != null && vm.continuation.suspended;
+        }
+
+        // Continues the suspended call with result as what its syscall
+        // returned. The result of the call, unless it suspends again
+        public static IntPtr VM_Resume(ref VirtMachine vm, int result) {
+            byte* opStack = stackalloc byte[VM_OPSTACK_SIZE];
+            int* args = stackalloc int[13];
+            IntPtr r;
+
+            if (!VM_Suspended(ref vm)) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_CALL_SUSPENDED, "VM_Resume on a vm that is not suspended");
+                return (IntPtr)(-1);
+            }
+
+            vm.continuation.result = result;
+
+            ++vm.callLevel;
+            r = vm.dataGuarded ? VM_CallGuarded(ref vm, 0, args, opStack) : VM_CallEngine(ref vm, 0, args, opStack);
+            --vm.callLevel;
+
+            return r;
+        }
+
+        // Saves the interpreter state at a syscall that asked to suspend
+        static void VM_SaveContinuation(ref VirtMachine vm, int programCounter, int programStack, int stackOnEntry,
+            int* opStack, byte opStackOfs) {
+            vmContinuation_t continuation = vm.continuation;
+
+            continuation.programCounter = programCounter;
+            continuation.programStack = programStack;
+            continuation.stackOnEntry = stackOnEntry;
+            continuation.opStackOfs = opStackOfs;
+            continuation.opStack = new int[opStackOfs + 1];
+
+            for (int i = 0; i <= opStackOfs; i++)
+                continuation.opStack[i] = opStack[i];
+
+            continuation.suspended = true;
+        }
+    }
+}
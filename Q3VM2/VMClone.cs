@@ -0,0 +1,204 @@
+﻿using System;
+using System.Threading;
+
+// Copy-on-write cloning of a warmed up VM. VM_CloneSource captures the data
+// segment of a VM once into a memfd, VM_Clone maps that memfd MAP_PRIVATE as
+// the data segment of a new instance. The pages stay shared until an instance
+// writes to one, so a clone costs a mapping and a copy of the heap bookkeeping
+// and only the pages it touches get duplicated. The source VM keeps running on
+// its own memory, later changes to it do not show up in clones.
+//
+// The code comes from the module. The interpreter, threaded and IL compiled
+// engines are shared, the others are built again for every clone. Where there
+// is no memfd clones copy the captured segment instead.
+
+namespace Q3VM2 {
+    unsafe class vmCloneSource_t {
+        public vmModule_t module;
+        public string Name;
+        public systemCallFunc systemCall;
+        public vmSyscallFunc_t[] syscalls;
+        public vmInterpret_t interpret;
+
+        public int programStack;
+        public int stackBottom;
+        public int dataMask;
+        public int dataMallocStart;
+        public int dataMallocLen;
+        public vmHeap_t heap;
+
+        // memfd or image file holding the data segment at dataOffset, -1 when
+        // clones copy data instead
+        public int fd;
+        public long dataOffset;
+        public byte* data;
+
+        // Data segment size rounded up to whole pages
+        public int dataAlloc;
+    }
+
+    unsafe static partial class VM {
+
+        public static vmCloneSource_t VM_CloneSource(ref VirtMachine vm) {
+            vmCloneSource_t source = new vmCloneSource_t();
+            int pageSize = Environment.SystemPageSize;
+
+            if (vm.callLevel != 0) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_CLONE_FAILED, "VM_CloneSource on running vm");
+                return null;
+            }
+
+            if (vm.module == null || vm.dataBase == null) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_NOT_LOADED, "VM not loaded");
+                return null;
+            }
+
+            source.Name = vm.Name;
+            source.systemCall = vm.systemCall;
+            source.syscalls = vm.syscalls;
+            source.interpret = vm.interpret;
+            source.programStack = vm.programStack;
+            source.stackBottom = vm.stackBottom;
+            source.dataMask = vm.dataMask;
+            source.dataMallocStart = vm.dataMallocStart;
+            source.dataMallocLen = vm.dataMallocLen;
+            source.heap = VM_HeapClone(vm.heap);
+            source.dataAlloc = (vm.dataAlloc + pageSize - 1) & ~(pageSize - 1);
+            source.fd = Posix.IsLinuxX64 ? VM_CloneMemfd(vm.Name, vm.dataBase, vm.dataAlloc, source.dataAlloc) : -1;
+
+            if (source.fd < 0) {
+                source.data = (byte*)Com_malloc((uint)source.dataAlloc, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                if (source.data == null) {
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_MALLOC_FAILED, "Clone data malloc failed: out of memory?");
+                    return null;
+                }
+
+                memset(source.data + vm.dataAlloc, 0, (uint)(source.dataAlloc - vm.dataAlloc));
+                Buffer.MemoryCopy(vm.dataBase, source.data, source.dataAlloc, vm.dataAlloc);
+            }
+
+            source.module = vm.module;
+            Interlocked.Increment(ref source.module.refCount);
+
+            return source;
+        }
+
+        // A memfd of size bytes starting with the length bytes at data
+        static int VM_CloneMemfd(string name, byte* data, int length, int size) {
+            int fd = Posix.memfd_create(name ?? "qvm", 0);
+            IntPtr map;
+
+            if (fd < 0)
+                return -1;
+
+            if (Posix.ftruncate(fd, size) != 0) {
+                Posix.close(fd);
+                return -1;
+            }
+
+            map = Posix.mmap(IntPtr.Zero, (UIntPtr)(uint)size, Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_SHARED, fd, IntPtr.Zero);
+            if (map == Posix.MAP_FAILED) {
+                Warn("VM_CloneSource: mapping the memfd failed\n");
+                Posix.close(fd);
+                return -1;
+            }
+
+            Buffer.MemoryCopy(data, (void*)map, size, length);
+            Posix.munmap(map, (UIntPtr)(uint)size);
+
+            return fd;
+        }
+
+        // Clones share the source data segment until they write to it. Clones
+        // stay valid after the source is freed
+        public static bool VM_Clone(ref VirtMachine clone, vmCloneSource_t source) {
+            if (source == null || source.module == null) {
+                Com_Error(clone.lastError = vmErrorCode_t.VM_NOT_LOADED, "Clone source not loaded");
+                return false;
+            }
+
+            clone.Name = source.Name;
+            clone.systemCall = source.systemCall;
+            clone.syscalls = source.syscalls;
+
+            VM_AttachModule(ref clone, source.module);
+
+            if (VM_CloneData(ref clone, source) != 0 || VM_PrepareEngine(ref clone, source.interpret) != 0) {
+                VM_Free(ref clone);
+                return false;
+            }
+
+            clone.programStack = source.programStack;
+            clone.stackBottom = source.stackBottom;
+
+            return true;
+        }
+
+        static int VM_CloneData(ref VirtMachine clone, vmCloneSource_t source) {
+            clone.dataMask = source.dataMask;
+            clone.dataMallocStart = source.dataMallocStart;
+            clone.dataMallocLen = source.dataMallocLen;
+            clone.dataAlloc = source.dataAlloc;
+
+            if (source.module.guardPages) {
+                clone.dataBase = VM_GuardMap(ref clone, source.fd, source.dataOffset);
+                if (clone.dataBase == null) {
+                    Com_Error(clone.lastError = vmErrorCode_t.VM_CLONE_FAILED, "Clone data mapping failed");
+                    return -1;
+                }
+
+                if (source.fd >= 0)
+                    clone.dataMapped = true;
+                else
+                    Buffer.MemoryCopy(source.data, clone.dataBase, clone.dataAlloc, source.dataAlloc);
+            } else if (source.fd >= 0) {
+                IntPtr map = Posix.mmap(IntPtr.Zero, (UIntPtr)(uint)source.dataAlloc, Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_PRIVATE, source.fd, (IntPtr)source.dataOffset);
+
+                if (map == Posix.MAP_FAILED) {
+                    Com_Error(clone.lastError = vmErrorCode_t.VM_CLONE_FAILED, "Clone data mapping failed");
+                    return -1;
+                }
+
+                clone.dataBase = (byte*)map;
+                clone.dataMapped = true;
+            } else {
+                clone.dataBase = (byte*)Com_malloc((uint)clone.dataAlloc, ref clone, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                if (clone.dataBase == null) {
+                    Com_Error(clone.lastError = vmErrorCode_t.VM_MALLOC_FAILED, "Data malloc failed: out of memory?\n");
+                    return -1;
+                }
+
+                Buffer.MemoryCopy(source.data, clone.dataBase, clone.dataAlloc, source.dataAlloc);
+            }
+
+            VM_AdviseData(ref clone);
+            clone.dirtyPages = VM_AllocDirty(ref clone);
+            if (clone.dirtyPages == null) {
+                Com_Error(clone.lastError = vmErrorCode_t.VM_MALLOC_FAILED, "Dirty page table malloc failed: out of memory?\n");
+                return -1;
+            }
+            clone.heap = VM_HeapClone(source.heap);
+
+            return 0;
+        }
+
+        public static void VM_FreeCloneSource(vmCloneSource_t source) {
+            if (source == null || source.module == null)
+                return;
+
+            if (source.fd >= 0) {
+                Posix.close(source.fd);
+                source.fd = -1;
+            }
+
+            if (source.data != null) {
+                Com_free(source.data, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                source.data = null;
+            }
+
+            VM_FreeModule(source.module);
+            source.module = null;
+            source.heap = null;
+        }
+    }
+}
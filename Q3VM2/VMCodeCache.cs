@@ -0,0 +1,206 @@
+﻿using System;
+using System.IO;
+
+// On disk cache of the decoded code. When vm_codeCache names a directory,
+// VM_LoadModule keys the code section by its SHA-256 and looks for
+// <hash>.code there. On a hit codeBase and instructionPointers point into a
+// read only mapping of that file and VM_PrepareInterpreter does not run, on a
+// miss the code is decoded as usual and written to the cache.
+//
+// A cache file is a small header followed by codeBase and the instruction
+// offsets as they are in memory. The payload is walked like the decoder wrote
+// it before it is used, files that do not match are decoded again and
+// replaced.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        // Cache directory, null disables the cache
+        public static string vm_codeCache = null;
+
+        const int VM_CODE_CACHE_MAGIC = 0x43563351; // "Q3VC"
+        const int VM_CODE_CACHE_VERSION = 2;
+
+        // magic, version, codeSize, codeLength, instructionCount, padded to
+        // keep the instruction offsets aligned
+        const int VM_CODE_CACHE_HEADER = 32;
+
+        static string VM_CodeCachePath(string key) {
+            return Path.Combine(vm_codeCache, key + ".code");
+        }
+
+        static int VM_CodeCachePointers(int codeSize) {
+            return VM_CODE_CACHE_HEADER + ((codeSize + 3) & ~3);
+        }
+
+        // Fills codeBase and instructionPointers from the cache, false on a miss
+        static bool VM_LoadCodeCache(vmModule_t module, string key) {
+            string path = VM_CodeCachePath(key);
+            long length;
+            byte* cache;
+
+            try {
+                if (!File.Exists(path))
+                    return false;
+
+                length = new FileInfo(path).Length;
+                if (length < VM_CODE_CACHE_HEADER || length > int.MaxValue)
+                    return false;
+            } catch (IOException) {
+                return false;
+            }
+
+            if (Posix.IsLinuxX64) {
+                int fd = Posix.open(path, Posix.O_RDONLY);
+                IntPtr map = Posix.MAP_FAILED;
+
+                if (fd < 0)
+                    return false;
+
+                map = Posix.mmap(IntPtr.Zero, (UIntPtr)(ulong)length, Posix.PROT_READ, Posix.MAP_PRIVATE, fd, IntPtr.Zero);
+                Posix.close(fd);
+
+                if (map == Posix.MAP_FAILED)
+                    return false;
+
+                cache = (byte*)map;
+                if (!VM_CodeCacheMatches(module, cache, length)) {
+                    Posix.munmap(map, (UIntPtr)(ulong)length);
+                    return false;
+                }
+
+                module.mapping = cache;
+                module.mappingLength = length;
+                module.codeSize = ((int*)cache)[2];
+                module.codeBase = cache + VM_CODE_CACHE_HEADER;
+                module.instructionPointers = (int*)(cache + VM_CodeCachePointers(module.codeSize));
+
+                return true;
+            }
+
+            cache = (byte*)Com_malloc((uint)length, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            if (cache == null)
+                return false;
+
+            try {
+                using (FileStream file = File.OpenRead(path)) {
+                    if (!VM_ImageRead(file, 0, cache, (int)length) || !VM_CodeCacheMatches(module, cache, length)) {
+                        Com_free(cache, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                        return false;
+                    }
+                }
+            } catch (IOException) {
+                Com_free(cache, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                return false;
+            }
+
+            module.codeSize = ((int*)cache)[2];
+            module.codeBase = (byte*)Com_malloc((uint)module.codeSize, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            module.instructionPointers = (int*)Com_malloc((uint)(module.instructionCount * sizeof(int)), vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
+            memcpy(module.codeBase, cache + VM_CODE_CACHE_HEADER, (uint)module.codeSize);
+            memcpy(module.instructionPointers, cache + VM_CodeCachePointers(module.codeSize), (uint)(module.instructionCount * sizeof(int)));
+            Com_free(cache, vmMallocType_t.VM_ALLOC_CODE_SEC);
+
+            return true;
+        }
+
+        static bool VM_CodeCacheMatches(vmModule_t module, byte* cache, long length) {
+            int* header = (int*)cache;
+
+            return header[0] == VM_CODE_CACHE_MAGIC && header[1] == VM_CODE_CACHE_VERSION && header[2] >= 0 &&
+                header[3] == module.codeLength && header[4] == module.instructionCount &&
+                length == VM_CodeCachePointers(header[2]) + (long)module.instructionCount * sizeof(int) &&
+                VM_CodeCacheValid(cache + VM_CODE_CACHE_HEADER, (int*)(cache + VM_CodeCachePointers(header[2])),
+                    header[2], module.instructionCount);
+        }
+
+        // Every instruction starts where the one before it ends, has an opcode
+        // and operand width the decoder writes, and branches to the start of
+        // an instruction
+        static bool VM_CodeCacheValid(byte* codeBase, int* instructionPointers, int codeSize, int instructionCount) {
+            bool[] starts = new bool[codeSize + 1];
+            int pc = 0;
+
+            for (int i = 0; i < instructionCount; i++) {
+                if (instructionPointers[i] != pc || pc >= codeSize)
+                    return false;
+
+                starts[pc] = true;
+                pc += VM_CodeCacheInstructionSize(codeBase[pc]);
+
+                if (pc == 0 || pc > codeSize)
+                    return false;
+            }
+
+            if (pc != codeSize)
+                return false;
+
+            for (int i = 0; i < instructionCount; i++) {
+                pc = instructionPointers[i];
+
+                if (VM_IsBranch((opcode_t)(codeBase[pc] & VM_OPCODE_MASK))) {
+                    int target = *(int*)&codeBase[pc + 1];
+
+                    if (target < 0 || target >= codeSize || !starts[target])
+                        return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Bytes taken by the instruction with this opcode byte, 0 when the
+        // decoder never writes it
+        static int VM_CodeCacheInstructionSize(byte opcode) {
+            opcode_t op = (opcode_t)(opcode & VM_OPCODE_MASK);
+            int width = opcode >> VM_OPERAND_SHIFT;
+
+            if (op >= opcode_t.OP_MAX)
+                return 0;
+
+            if (!VM_HasOperand(op))
+                return width == 0 ? 1 : 0;
+
+            if (width > 2 || (VM_IsBranch(op) && width != 2))
+                return 0;
+
+            return 1 + (1 << width);
+        }
+
+        // Written under a temporary name and moved into place, so a concurrent
+        // load never sees half a file. Failing to write only costs the next load
+        static void VM_SaveCodeCache(vmModule_t module, string key) {
+            string path = VM_CodeCachePath(key);
+            string temp = path + "." + Guid.NewGuid().ToString("N");
+            int* header = stackalloc int[VM_CODE_CACHE_HEADER / 4];
+
+            header[0] = VM_CODE_CACHE_MAGIC;
+            header[1] = VM_CODE_CACHE_VERSION;
+            header[2] = module.codeSize;
+            header[3] = module.codeLength;
+            header[4] = module.instructionCount;
+
+            try {
+                Directory.CreateDirectory(vm_codeCache);
+
+                using (FileStream file = new FileStream(temp, FileMode.CreateNew, FileAccess.Write)) {
+                    VM_ImageWrite(file, 0, (byte*)header, VM_CODE_CACHE_HEADER);
+                    VM_ImageWrite(file, VM_CODE_CACHE_HEADER, module.codeBase, module.codeSize);
+                    VM_ImageWrite(file, VM_CodeCachePointers(module.codeSize), (byte*)module.instructionPointers, module.instructionCount * sizeof(int));
+                }
+
+                if (File.Exists(path))
+                    File.Delete(path);
+
+                File.Move(temp, path);
+            } catch (IOException e) {
+                Warn("VM_SaveCodeCache: {0}\n", e.Message);
+            } catch (UnauthorizedAccessException e) {
+                Warn("VM_SaveCodeCache: {0}\n", e.Message);
+            }
+
+            if (File.Exists(temp))
+                File.Delete(temp);
+        }
+    }
+}
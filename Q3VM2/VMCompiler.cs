@@ -0,0 +1,717 @@
+﻿using System;
+using System.Reflection;
+using System.Reflection.Emit;
+using System.Runtime.CompilerServices;
+
+// Translates every QVM function (OP_ENTER up to the next OP_ENTER) into a
+// DynamicMethod. Op stack slots are mapped to IL locals, so the CLR JIT sees
+// plain register code instead of the interpreter's dispatch loop.
+
+namespace Q3VM2 {
+    unsafe delegate int vmCompiledFunc_t(ref VirtMachine vm, byte* image, int programStack);
+
+    struct vmInstruction_t {
+        public opcode_t op;
+        public int value;
+    }
+
+    unsafe static partial class VM {
+
+        static bool VM_HasOperand(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_ENTER:
+                case opcode_t.OP_CONST:
+                case opcode_t.OP_LOCAL:
+                case opcode_t.OP_LEAVE:
+                case opcode_t.OP_BLOCK_COPY:
+                case opcode_t.OP_ARG:
+                    return true;
+                default:
+                    return VM_IsBranch(op);
+            }
+        }
+
+        static bool VM_IsBranch(opcode_t op) {
+            return op >= opcode_t.OP_EQ && op <= opcode_t.OP_GEF;
+        }
+
+        // Decoded once per module and shared, the records must not be modified
+        static vmInstruction_t[] VM_DecodeInstructions(ref VirtMachine vm) {
+            if (vm.module.instructions == null)
+                VM_DecodeModule(vm.module);
+
+            return vm.module.instructions;
+        }
+
+        // Reads the decoded codeBase back into one record per instruction, with
+        // branch targets turned from codeBase offsets back into instruction numbers
+        static vmInstruction_t[] VM_DecodeInstructions(vmModule_t module) {
+            byte* codeBase = module.codeBase;
+            vmInstruction_t[] instructions = new vmInstruction_t[module.instructionCount];
+            int[] pcToInstruction = new int[module.codeSize + 1];
+
+            for (int i = 0; i < module.instructionCount; i++)
+                pcToInstruction[module.instructionPointers[i]] = i;
+
+            for (int i = 0; i < module.instructionCount; i++) {
+                int pc = module.instructionPointers[i];
+                int opcode = codeBase[pc++];
+
+                instructions[i].op = (opcode_t)(opcode & VM_OPCODE_MASK);
+
+                if (VM_HasOperand(instructions[i].op)) {
+                    instructions[i].value = VM_ReadOperand(codeBase, opcode, ref pc);
+
+                    if (VM_IsBranch(instructions[i].op))
+                        instructions[i].value = pcToInstruction[instructions[i].value];
+                }
+            }
+
+            return instructions;
+        }
+
+        // Op stack depth before every instruction of the function [start, end),
+        // relative to the function entry. Returns the deepest slot used, or -1 when
+        // the function does not keep a consistent stack shape
+        static int VM_FunctionStackDepths(vmInstruction_t[] code, int start, int end, int[] depth) {
+            int d = 0;
+            int maxDepth = 0;
+
+            for (int i = start; i < end; i++)
+                depth[i] = -1;
+
+            for (int i = start; i < end; i++) {
+                if (depth[i] >= 0) {
+                    if (d >= 0 && d != depth[i])
+                        return -1;
+                    d = depth[i];
+                } else if (d < 0) {
+                    // Only reachable through a computed jump, which lcc emits on an empty stack
+                    d = 0;
+                }
+
+                depth[i] = d;
+
+                switch (code[i].op) {
+                    case opcode_t.OP_CONST:
+                    case opcode_t.OP_LOCAL:
+                    case opcode_t.OP_PUSH:
+                        d++;
+                        break;
+
+                    case opcode_t.OP_POP:
+                    case opcode_t.OP_ARG:
+                    case opcode_t.OP_ADD:
+                    case opcode_t.OP_SUB:
+                    case opcode_t.OP_DIVI:
+                    case opcode_t.OP_DIVU:
+                    case opcode_t.OP_MODI:
+                    case opcode_t.OP_MODU:
+                    case opcode_t.OP_MULI:
+                    case opcode_t.OP_MULU:
+                    case opcode_t.OP_BAND:
+                    case opcode_t.OP_BOR:
+                    case opcode_t.OP_BXOR:
+                    case opcode_t.OP_LSH:
+                    case opcode_t.OP_RSHI:
+                    case opcode_t.OP_RSHU:
+                    case opcode_t.OP_ADDF:
+                    case opcode_t.OP_SUBF:
+                    case opcode_t.OP_DIVF:
+                    case opcode_t.OP_MULF:
+                        if (d < (code[i].op == opcode_t.OP_POP || code[i].op == opcode_t.OP_ARG ? 1 : 2))
+                            return -1;
+                        d--;
+                        break;
+
+                    case opcode_t.OP_STORE1:
+                    case opcode_t.OP_STORE2:
+                    case opcode_t.OP_STORE4:
+                    case opcode_t.OP_BLOCK_COPY:
+                        if (d < 2)
+                            return -1;
+                        d -= 2;
+                        break;
+
+                    case opcode_t.OP_LOAD1:
+                    case opcode_t.OP_LOAD2:
+                    case opcode_t.OP_LOAD4:
+                    case opcode_t.OP_CALL:
+                    case opcode_t.OP_NEGI:
+                    case opcode_t.OP_BCOM:
+                    case opcode_t.OP_NEGF:
+                    case opcode_t.OP_CVIF:
+                    case opcode_t.OP_CVFI:
+                    case opcode_t.OP_SEX8:
+                    case opcode_t.OP_SEX16:
+                        if (d < 1)
+                            return -1;
+                        break;
+
+                    case opcode_t.OP_ENTER:
+                        if (i != start)
+                            return -1;
+                        break;
+
+                    case opcode_t.OP_LEAVE:
+                        // lcc always leaves exactly the return value behind
+                        if (d != 1)
+                            return -1;
+                        d = -1;
+                        break;
+
+                    case opcode_t.OP_JUMP:
+                        if (d < 1)
+                            return -1;
+                        d = -1;
+                        break;
+
+                    case opcode_t.OP_UNDEF:
+                        d = -1;
+                        break;
+
+                    default:
+                        if (VM_IsBranch(code[i].op)) {
+                            int target = code[i].value;
+
+                            if (d < 2 || target < start || target >= end)
+                                return -1;
+
+                            d -= 2;
+
+                            if (target <= i) {
+                                if (depth[target] != d)
+                                    return -1;
+                            } else if (depth[target] < 0) {
+                                depth[target] = d;
+                            } else if (depth[target] != d) {
+                                return -1;
+                            }
+                        }
+                        break;
+                }
+
+                if (d > 255)
+                    return -1;
+
+                if (d > maxDepth)
+                    maxDepth = d;
+            }
+
+            return maxDepth;
+        }
+
+        static int VM_Compile(ref VirtMachine vm, vmInterpret_t interpret) {
+            switch (interpret) {
+                case vmInterpret_t.VMI_COMPILED:
+                    return VM_ShareCompiled(ref vm);
+                case vmInterpret_t.VMI_COMPILED_NATIVE:
+                    return VM_CompileNative(ref vm);
+                case vmInterpret_t.VMI_REGISTER:
+                    return VM_CompileRegister(ref vm);
+                default:
+                    return -1;
+            }
+        }
+
+        static int VM_CompileIL(ref VirtMachine vm) {
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+            DynamicMethod[] methods = new DynamicMethod[vm.instructionCount];
+            int[] depth = new int[vm.instructionCount];
+            Type[] parameters = new Type[] { typeof(VirtMachine).MakeByRefType(), typeof(byte*), typeof(int) };
+
+            if (code.Length == 0 || code[0].op != opcode_t.OP_ENTER)
+                return -1;
+
+            // All methods have to exist before any body can emit a direct call to them
+            for (int i = 0; i < code.Length; i++) {
+                if (code[i].op == opcode_t.OP_ENTER)
+                    methods[i] = new DynamicMethod(string.Format("{0}_{1}", vm.Name, i), typeof(int), parameters, typeof(VM), true);
+            }
+
+            try {
+                for (int start = 0; start < code.Length;) {
+                    int end = start + 1;
+
+                    while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                        end++;
+
+                    int maxDepth = VM_FunctionStackDepths(code, start, end, depth);
+
+                    if (maxDepth < 0) {
+                        Warn("VM_Compile: inconsistent op stack in function at {0}\n", start);
+                        return -1;
+                    }
+
+                    if (VM_CompileFunction(ref vm, code, methods, depth, maxDepth, start, end) != 0)
+                        return -1;
+
+                    start = end;
+                }
+
+                vm.compiledFunctions = new vmCompiledFunc_t[code.Length];
+
+                for (int i = 0; i < code.Length; i++) {
+                    if (methods[i] != null)
+                        vm.compiledFunctions[i] = (vmCompiledFunc_t)methods[i].CreateDelegate(typeof(vmCompiledFunc_t));
+                }
+            } catch (Exception E) {
+                Warn("VM_Compile: {0}\n", E.Message);
+                vm.compiledFunctions = null;
+                return -1;
+            }
+
+            return 0;
+        }
+
+        // Guarded data segments take the address as is, see VMGuard.cs
+        static void VM_EmitMask(ILGenerator il, int accessMask) {
+            if (accessMask != -1) {
+                il.Emit(OpCodes.Ldc_I4, accessMask);
+                il.Emit(OpCodes.And);
+            }
+        }
+
+        static void VM_EmitAddress(ILGenerator il, LocalBuilder addr, int accessMask) {
+            il.Emit(OpCodes.Ldarg_1);
+            il.Emit(OpCodes.Ldloc, addr);
+            VM_EmitMask(il, accessMask);
+            il.Emit(OpCodes.Add);
+        }
+
+        // Marks the pages of the first and the last byte of a size byte store at
+        // addr, an unaligned one can straddle two
+        static void VM_EmitMarkDirty(ILGenerator il, LocalBuilder addr, LocalBuilder dirty, int accessMask, int size) {
+            VM_EmitMarkPage(il, addr, dirty, accessMask, 0);
+            if (size > 1)
+                VM_EmitMarkPage(il, addr, dirty, accessMask, size - 1);
+        }
+
+        // dirtyPages[((addr & dataMask) + offset) >> VM_DIRTY_SHIFT] = 1, with
+        // dirtyPages loaded into dirty when the function is entered
+        static void VM_EmitMarkPage(ILGenerator il, LocalBuilder addr, LocalBuilder dirty, int accessMask, int offset) {
+            il.Emit(OpCodes.Ldloc, dirty);
+            il.Emit(OpCodes.Ldloc, addr);
+            VM_EmitMask(il, accessMask);
+            if (offset != 0) {
+                il.Emit(OpCodes.Ldc_I4, offset);
+                il.Emit(OpCodes.Add);
+            }
+            il.Emit(OpCodes.Ldc_I4, VM_DIRTY_SHIFT);
+            il.Emit(OpCodes.Shr_Un);
+            il.Emit(OpCodes.Add);
+            il.Emit(OpCodes.Ldc_I4_1);
+            il.Emit(OpCodes.Stind_I1);
+        }
+
+        static void VM_EmitLoadFloat(ILGenerator il, LocalBuilder slot) {
+            il.Emit(OpCodes.Ldloca, slot);
+            il.Emit(OpCodes.Ldind_R4);
+        }
+
+        static void VM_EmitError(ILGenerator il, vmErrorCode_t error) {
+            il.Emit(OpCodes.Ldarg_0);
+            il.Emit(OpCodes.Ldc_I4, (int)error);
+            il.Emit(OpCodes.Call, typeof(VM).GetMethod("VM_CompiledError", BindingFlags.NonPublic | BindingFlags.Static));
+        }
+
+        static int VM_CompileFunction(ref VirtMachine vm, vmInstruction_t[] code, DynamicMethod[] methods, int[] depth, int maxDepth, int start, int end) {
+            ILGenerator il = methods[start].GetILGenerator();
+            LocalBuilder[] slots = new LocalBuilder[maxDepth + 1];
+            LocalBuilder dirty = il.DeclareLocal(typeof(byte*));
+            Label[] labels = new Label[end - start];
+            bool[] jumpTarget = VM_FunctionJumpTargets(code, start, end);
+            Label badJump = il.DefineLabel();
+            Label overflow = il.DefineLabel();
+            MethodInfo blockCopy = typeof(VM).GetMethod("VM_BlockCopy", BindingFlags.NonPublic | BindingFlags.Static);
+            MethodInfo systemCall = typeof(VM).GetMethod("VM_SystemCall", BindingFlags.NonPublic | BindingFlags.Static);
+            MethodInfo dynamicCall = typeof(VM).GetMethod("VM_CompiledCall", BindingFlags.NonPublic | BindingFlags.Static);
+            MethodInfo stackCheck = typeof(VM).GetMethod("VM_CompiledStackCheck", BindingFlags.NonPublic | BindingFlags.Static);
+            int accessMask = VM_AccessMask(ref vm);
+            int stackBottom = vm.dataMask + 1 - vm.module.stackSize;
+
+            for (int i = 0; i < slots.Length; i++)
+                slots[i] = il.DeclareLocal(typeof(int));
+
+            for (int i = 0; i < labels.Length; i++)
+                labels[i] = il.DefineLabel();
+
+            il.Emit(OpCodes.Ldarg_0);
+            il.Emit(OpCodes.Ldfld, typeof(VirtMachine).GetField("dirtyPages"));
+            il.Emit(OpCodes.Stloc, dirty);
+
+            for (int i = start; i < end; i++) {
+                int d = depth[i];
+                int v = code[i].value;
+                LocalBuilder r0 = d >= 1 ? slots[d - 1] : null;
+                LocalBuilder r1 = d >= 2 ? slots[d - 2] : null;
+
+                // The operand of a preceding OP_CONST, when control can only come from there
+                bool constTarget = i > start && code[i - 1].op == opcode_t.OP_CONST && !jumpTarget[i - start];
+                int target = constTarget ? code[i - 1].value : 0;
+
+                il.MarkLabel(labels[i - start]);
+
+                switch (code[i].op) {
+                    case opcode_t.OP_UNDEF:
+                        VM_EmitError(il, vmErrorCode_t.VM_BAD_INSTRUCTION);
+                        break;
+
+                    case opcode_t.OP_IGNORE:
+                    case opcode_t.OP_PUSH:
+                    case opcode_t.OP_POP:
+                        break;
+
+                    case opcode_t.OP_BREAK:
+                        il.Emit(OpCodes.Ldarg_0);
+                        il.Emit(OpCodes.Ldarg_0);
+                        il.Emit(OpCodes.Ldfld, typeof(VirtMachine).GetField("breakCount"));
+                        il.Emit(OpCodes.Ldc_I4_1);
+                        il.Emit(OpCodes.Add);
+                        il.Emit(OpCodes.Stfld, typeof(VirtMachine).GetField("breakCount"));
+                        break;
+
+                    case opcode_t.OP_ENTER:
+                        il.Emit(OpCodes.Ldarg_2);
+                        il.Emit(OpCodes.Ldc_I4, v);
+                        il.Emit(OpCodes.Sub);
+                        il.Emit(OpCodes.Starg_S, (byte)2);
+
+                        // Guest recursion maps onto CLR recursion, so it has to stop
+                        // at the bottom of the guest stack or of the host stack,
+                        // whichever comes first
+                        il.Emit(OpCodes.Ldarg_2);
+                        il.Emit(OpCodes.Ldc_I4, stackBottom);
+                        il.Emit(OpCodes.Blt, overflow);
+                        il.Emit(OpCodes.Ldarg_0);
+                        il.Emit(OpCodes.Call, stackCheck);
+                        break;
+
+                    case opcode_t.OP_LEAVE:
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(OpCodes.Ret);
+                        break;
+
+                    case opcode_t.OP_CONST:
+                        il.Emit(OpCodes.Ldc_I4, v);
+                        il.Emit(OpCodes.Stloc, slots[d]);
+                        break;
+
+                    case opcode_t.OP_LOCAL:
+                        il.Emit(OpCodes.Ldarg_2);
+                        il.Emit(OpCodes.Ldc_I4, v);
+                        il.Emit(OpCodes.Add);
+                        il.Emit(OpCodes.Stloc, slots[d]);
+                        break;
+
+                    case opcode_t.OP_LOAD1:
+                    case opcode_t.OP_LOAD2:
+                    case opcode_t.OP_LOAD4:
+                        VM_EmitAddress(il, r0, accessMask);
+                        il.Emit(code[i].op == opcode_t.OP_LOAD4 ? OpCodes.Ldind_I4 : code[i].op == opcode_t.OP_LOAD2 ? OpCodes.Ldind_U2 : OpCodes.Ldind_U1);
+                        il.Emit(OpCodes.Stloc, r0);
+                        break;
+
+                    case opcode_t.OP_STORE1:
+                    case opcode_t.OP_STORE2:
+                    case opcode_t.OP_STORE4:
+                        VM_EmitAddress(il, r1, accessMask);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(code[i].op == opcode_t.OP_STORE4 ? OpCodes.Stind_I4 : code[i].op == opcode_t.OP_STORE2 ? OpCodes.Stind_I2 : OpCodes.Stind_I1);
+                        VM_EmitMarkDirty(il, r1, dirty, accessMask, code[i].op == opcode_t.OP_STORE4 ? 4 : code[i].op == opcode_t.OP_STORE2 ? 2 : 1);
+                        break;
+
+                    case opcode_t.OP_ARG:
+                        il.Emit(OpCodes.Ldarg_1);
+                        il.Emit(OpCodes.Ldarg_2);
+                        il.Emit(OpCodes.Ldc_I4, v);
+                        il.Emit(OpCodes.Add);
+                        VM_EmitMask(il, accessMask);
+                        il.Emit(OpCodes.Add);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(OpCodes.Stind_I4);
+                        break;
+
+                    case opcode_t.OP_BLOCK_COPY:
+                        il.Emit(OpCodes.Ldloc, r1);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(OpCodes.Ldc_I4, v);
+                        il.Emit(OpCodes.Ldarg_0);
+                        il.Emit(OpCodes.Call, blockCopy);
+                        break;
+
+                    case opcode_t.OP_CALL:
+                        il.Emit(OpCodes.Ldarg_0);
+                        il.Emit(OpCodes.Ldarg_1);
+                        il.Emit(OpCodes.Ldarg_2);
+
+                        if (constTarget && target < 0) {
+                            il.Emit(OpCodes.Ldc_I4, target);
+                            il.Emit(OpCodes.Call, systemCall);
+                        } else if (constTarget && target < code.Length && methods[target] != null) {
+                            il.Emit(OpCodes.Call, methods[target]);
+                        } else {
+                            il.Emit(OpCodes.Ldloc, r0);
+                            il.Emit(OpCodes.Call, dynamicCall);
+                        }
+
+                        il.Emit(OpCodes.Stloc, r0);
+                        break;
+
+                    case opcode_t.OP_JUMP:
+                        if (constTarget && target >= start && target < end && depth[target] == d - 1) {
+                            il.Emit(OpCodes.Br, labels[target - start]);
+                        } else {
+                            // Computed jump (switch tables), every instruction on the same
+                            // stack depth inside this function is a valid destination
+                            Label[] table = new Label[end - start];
+
+                            for (int t = start; t < end; t++)
+                                table[t - start] = depth[t] == d - 1 ? labels[t - start] : badJump;
+
+                            il.Emit(OpCodes.Ldloc, r0);
+                            il.Emit(OpCodes.Ldc_I4, start);
+                            il.Emit(OpCodes.Sub);
+                            il.Emit(OpCodes.Switch, table);
+                            il.Emit(OpCodes.Br, badJump);
+                        }
+                        break;
+
+                    case opcode_t.OP_EQ:
+                    case opcode_t.OP_NE:
+                    case opcode_t.OP_LTI:
+                    case opcode_t.OP_LEI:
+                    case opcode_t.OP_GTI:
+                    case opcode_t.OP_GEI:
+                    case opcode_t.OP_LTU:
+                    case opcode_t.OP_LEU:
+                    case opcode_t.OP_GTU:
+                    case opcode_t.OP_GEU:
+                        il.Emit(OpCodes.Ldloc, r1);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(VM_BranchOpCode(code[i].op), labels[v - start]);
+                        break;
+
+                    case opcode_t.OP_EQF:
+                    case opcode_t.OP_NEF:
+                    case opcode_t.OP_LTF:
+                    case opcode_t.OP_LEF:
+                    case opcode_t.OP_GTF:
+                    case opcode_t.OP_GEF:
+                        VM_EmitLoadFloat(il, r1);
+                        VM_EmitLoadFloat(il, r0);
+                        il.Emit(VM_BranchOpCode(code[i].op), labels[v - start]);
+                        break;
+
+                    case opcode_t.OP_NEGI:
+                    case opcode_t.OP_BCOM:
+                    case opcode_t.OP_SEX8:
+                    case opcode_t.OP_SEX16:
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(code[i].op == opcode_t.OP_NEGI ? OpCodes.Neg : code[i].op == opcode_t.OP_BCOM ? OpCodes.Not : code[i].op == opcode_t.OP_SEX8 ? OpCodes.Conv_I1 : OpCodes.Conv_I2);
+                        il.Emit(OpCodes.Stloc, r0);
+                        break;
+
+                    case opcode_t.OP_ADD:
+                    case opcode_t.OP_SUB:
+                    case opcode_t.OP_DIVI:
+                    case opcode_t.OP_DIVU:
+                    case opcode_t.OP_MODI:
+                    case opcode_t.OP_MODU:
+                    case opcode_t.OP_MULI:
+                    case opcode_t.OP_MULU:
+                    case opcode_t.OP_BAND:
+                    case opcode_t.OP_BOR:
+                    case opcode_t.OP_BXOR:
+                        il.Emit(OpCodes.Ldloc, r1);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(VM_ArithmeticOpCode(code[i].op));
+                        il.Emit(OpCodes.Stloc, r1);
+                        break;
+
+                    case opcode_t.OP_LSH:
+                    case opcode_t.OP_RSHI:
+                    case opcode_t.OP_RSHU:
+                        // IL leaves shifts by 32 or more undefined, C# masks the count
+                        il.Emit(OpCodes.Ldloc, r1);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(OpCodes.Ldc_I4, 31);
+                        il.Emit(OpCodes.And);
+                        il.Emit(code[i].op == opcode_t.OP_LSH ? OpCodes.Shl : code[i].op == opcode_t.OP_RSHI ? OpCodes.Shr : OpCodes.Shr_Un);
+                        il.Emit(OpCodes.Stloc, r1);
+                        break;
+
+                    case opcode_t.OP_NEGF:
+                        il.Emit(OpCodes.Ldloca, r0);
+                        VM_EmitLoadFloat(il, r0);
+                        il.Emit(OpCodes.Neg);
+                        il.Emit(OpCodes.Stind_R4);
+                        break;
+
+                    case opcode_t.OP_ADDF:
+                    case opcode_t.OP_SUBF:
+                    case opcode_t.OP_DIVF:
+                    case opcode_t.OP_MULF:
+                        il.Emit(OpCodes.Ldloca, r1);
+                        VM_EmitLoadFloat(il, r1);
+                        VM_EmitLoadFloat(il, r0);
+                        il.Emit(VM_ArithmeticOpCode(code[i].op));
+                        il.Emit(OpCodes.Stind_R4);
+                        break;
+
+                    case opcode_t.OP_CVIF:
+                        il.Emit(OpCodes.Ldloca, r0);
+                        il.Emit(OpCodes.Ldloc, r0);
+                        il.Emit(OpCodes.Conv_R4);
+                        il.Emit(OpCodes.Stind_R4);
+                        break;
+
+                    case opcode_t.OP_CVFI:
+                        VM_EmitLoadFloat(il, r0);
+                        il.Emit(OpCodes.Conv_I8);
+                        il.Emit(OpCodes.Conv_I4);
+                        il.Emit(OpCodes.Stloc, r0);
+                        break;
+
+                    default:
+                        Warn("VM_Compile: bad instruction {0} at {1}\n", code[i].op, i);
+                        return -1;
+                }
+            }
+
+            // Running off the end of a function is as bad as a wild jump
+            il.MarkLabel(badJump);
+            VM_EmitError(il, vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+            il.Emit(OpCodes.Ldc_I4_M1);
+            il.Emit(OpCodes.Ret);
+
+            il.MarkLabel(overflow);
+            VM_EmitError(il, vmErrorCode_t.VM_STACK_OVERFLOW);
+            il.Emit(OpCodes.Ldc_I4_M1);
+            il.Emit(OpCodes.Ret);
+
+            return 0;
+        }
+
+        // Instructions of [start, end) that control can reach other than by falling
+        // through. A computed jump in the function makes every instruction a target
+        static bool[] VM_FunctionJumpTargets(vmInstruction_t[] code, int start, int end) {
+            bool[] targets = new bool[end - start];
+
+            for (int i = start; i < end; i++) {
+                if (VM_IsBranch(code[i].op) && code[i].value >= start && code[i].value < end)
+                    targets[code[i].value - start] = true;
+
+                if (code[i].op == opcode_t.OP_JUMP) {
+                    if (i > start && code[i - 1].op == opcode_t.OP_CONST) {
+                        if (code[i - 1].value >= start && code[i - 1].value < end)
+                            targets[code[i - 1].value - start] = true;
+                    } else {
+                        for (int t = 0; t < targets.Length; t++)
+                            targets[t] = true;
+                    }
+                }
+            }
+
+            return targets;
+        }
+
+        static OpCode VM_BranchOpCode(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_EQ: return OpCodes.Beq;
+                case opcode_t.OP_NE: return OpCodes.Bne_Un;
+                case opcode_t.OP_LTI: return OpCodes.Blt;
+                case opcode_t.OP_LEI: return OpCodes.Ble;
+                case opcode_t.OP_GTI: return OpCodes.Bgt;
+                case opcode_t.OP_GEI: return OpCodes.Bge;
+                case opcode_t.OP_LTU: return OpCodes.Blt_Un;
+                case opcode_t.OP_LEU: return OpCodes.Ble_Un;
+                case opcode_t.OP_GTU: return OpCodes.Bgt_Un;
+                case opcode_t.OP_GEU: return OpCodes.Bge_Un;
+                case opcode_t.OP_EQF: return OpCodes.Beq;
+                case opcode_t.OP_NEF: return OpCodes.Bne_Un;
+                case opcode_t.OP_LTF: return OpCodes.Blt;
+                case opcode_t.OP_LEF: return OpCodes.Ble;
+                case opcode_t.OP_GTF: return OpCodes.Bgt;
+                default: return OpCodes.Bge;
+            }
+        }
+
+        static OpCode VM_ArithmeticOpCode(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_ADD: return OpCodes.Add;
+                case opcode_t.OP_SUB: return OpCodes.Sub;
+                case opcode_t.OP_DIVI: return OpCodes.Div;
+                case opcode_t.OP_DIVU: return OpCodes.Div_Un;
+                case opcode_t.OP_MODI: return OpCodes.Rem;
+                case opcode_t.OP_MODU: return OpCodes.Rem_Un;
+                case opcode_t.OP_MULI: return OpCodes.Mul;
+                case opcode_t.OP_MULU: return OpCodes.Mul;
+                case opcode_t.OP_BAND: return OpCodes.And;
+                case opcode_t.OP_BOR: return OpCodes.Or;
+                case opcode_t.OP_BXOR: return OpCodes.Xor;
+                case opcode_t.OP_ADDF: return OpCodes.Add;
+                case opcode_t.OP_SUBF: return OpCodes.Sub;
+                case opcode_t.OP_DIVF: return OpCodes.Div;
+                default: return OpCodes.Mul;
+            }
+        }
+
+        static void VM_CompiledError(ref VirtMachine vm, vmErrorCode_t error) {
+            Com_Error(vm.lastError = error, "Compiled code error");
+        }
+
+        // The guest stack can hold more frames than the host stack when they are
+        // small or vm_stackSize is big, and running out of host stack ends the
+        // process
+        static void VM_CompiledStackCheck(ref VirtMachine vm) {
+            try {
+                RuntimeHelpers.EnsureSufficientExecutionStack();
+            } catch (InsufficientExecutionStackException) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "VM host stack overflow");
+            }
+        }
+
+        // OP_CALL through a computed address
+        static int VM_CompiledCall(ref VirtMachine vm, byte* image, int programStack, int target) {
+            if (target < 0)
+                return VM_SystemCall(ref vm, image, programStack, target);
+
+            if (target >= vm.instructionCount || vm.compiledFunctions[target] == null) {
+                // Under tiered execution the functions not compiled yet are interpreted
+                if (vm.tieredCode != null && target < vm.instructionCount && vm.tieredCode.state[target] != TIER_NONE)
+                    return VM_ThreadedExecute(ref vm, target, programStack);
+
+                Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_CALL");
+                return -1;
+            }
+
+            return vm.compiledFunctions[target](ref vm, image, programStack);
+        }
+
+        static int VM_CallCompiled(ref VirtMachine vm, int function, int* args) {
+            int programStack;
+            int stackOnEntry;
+            byte* image;
+            int r;
+
+            programStack = stackOnEntry = vm.programStack;
+            image = vm.dataBase;
+
+            programStack -= (8 + 4 * 13);
+
+            for (int arg = 0; arg < 13; arg++) {
+                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+            }
+
+            *(int*)&image[programStack + 4] = 0;
+            *(int*)&image[programStack] = -1;
+
+            r = vm.compiledFunctions[function](ref vm, image, programStack);
+
+            vm.programStack = stackOnEntry;
+
+            return r;
+        }
+    }
+}
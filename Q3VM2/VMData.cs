@@ -0,0 +1,64 @@
+﻿using System;
+
+// Data segment allocation and limits. On Linux x64 data segments are anonymous
+// mappings, so the bss, heap and stack cost nothing until they are touched and
+// creating an instance only copies the data and lit segments. With
+// vm_hugePages segments of VM_HUGE_PAGE or more are advised to use transparent
+// huge pages. Elsewhere they are allocated and cleared as before.
+//
+// The limits and sizes are read when a module is loaded. Every instance of a
+// module shares its data layout, since the compiled engines, clones and images
+// depend on it.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        // Largest .qvm file and bss segment VM_LoadQVM accepts
+        public static int vm_maxFileSize = 0x400000;
+        public static int vm_maxBssSize = 10485760;
+
+        // Program stack at the top of the data segment, the heap is vm_heapSize
+        public static int vm_stackSize = 0x10000;
+
+        public static bool vm_hugePages = false;
+
+        const int VM_HUGE_PAGE = 0x200000;
+
+        // The data segment rounds up to a power of two and has to stay clear of
+        // the sign bit
+        const int VM_MAX_DATA_LENGTH = 0x40000000;
+
+        // dataAlloc zeroed bytes for dataBase
+        static byte* VM_AllocData(ref VirtMachine vm) {
+            IntPtr map;
+
+            if (vm.module.guardPages)
+                return VM_GuardMap(ref vm, -1, 0);
+
+            if (!Posix.IsLinuxX64) {
+                byte* data = (byte*)Com_malloc((uint)vm.dataAlloc, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+
+                if (data != null)
+                    memset(data, 0, (uint)vm.dataAlloc);
+
+                return data;
+            }
+
+            map = Posix.mmap(IntPtr.Zero, (UIntPtr)(uint)vm.dataAlloc, Posix.PROT_READ | Posix.PROT_WRITE,
+                Posix.MAP_PRIVATE | Posix.MAP_ANONYMOUS, -1, IntPtr.Zero);
+
+            if (map == Posix.MAP_FAILED)
+                return null;
+
+            vm.dataMapped = true;
+
+            return (byte*)map;
+        }
+
+        // Only a hint, the kernel may not have transparent huge pages enabled
+        static void VM_AdviseData(ref VirtMachine vm) {
+            if (vm_hugePages && (vm.dataMapped || vm.dataGuarded) && vm.dataAlloc >= VM_HUGE_PAGE)
+                Posix.madvise((IntPtr)vm.dataBase, (UIntPtr)(uint)vm.dataAlloc, Posix.MADV_HUGEPAGE);
+        }
+    }
+}
@@ -0,0 +1,104 @@
+﻿using System;
+
+// Guard page sandboxing. With vm_guardPages set, modules loaded on Linux x64
+// give every instance a data segment in the middle of a reservation that is
+// PROT_NONE everywhere else: VM_GUARD_BELOW bytes in front of dataBase and
+// VM_GUARD_ABOVE bytes from it. Every sign extended 32 bit guest address plus
+// the widest access lands in the reservation, so the engines index the image
+// without masking and an address past the segment faults instead of wrapping
+// around. VM_Call turns the fault into VM_DATA_OUT_OF_RANGE.
+//
+// Only the pages up to dataAlloc are mapped, the rest costs address space but
+// no memory. Addresses between the segment and the end of its last page are
+// reachable, that is slack for unaligned loads and nothing else. The dirty page
+// table is allocated apart, see VMSnapshot.cs.
+//
+// This relies on the runtime raising the SIGSEGV as an exception in the
+// faulting managed code, which Mono does with a NullReferenceException. .NET
+// Core and later end the process on an access violation, so modules loaded
+// there ignore vm_guardPages and keep masking. Exceptions thrown by syscall
+// handlers are tagged on their way out and passed on as they are. Native code
+// is not managed code, so VMI_COMPILED_NATIVE keeps masking.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        public static bool vm_guardPages = false;
+
+        // Whether a fault in managed code arrives as an exception
+        static bool vm_guardFaultsCaught = Type.GetType("Mono.Runtime") != null;
+
+        const string VM_GUARD_HOST_EXCEPTION = "Q3VM2.HostException";
+
+        const long VM_GUARD_BELOW = 0x80000000L;
+        const long VM_GUARD_ABOVE = 0x80000000L + 0x10000;
+
+        // What modules loaded now get for guardPages
+        static bool VM_GuardPagesUsable() {
+            return vm_guardPages && IntPtr.Size == 8 && Posix.IsLinuxX64 && vm_guardFaultsCaught;
+        }
+
+        // Size of the whole reservation. Only called in 64 bit processes
+        static UIntPtr VM_GuardSize() {
+            return new UIntPtr((ulong)(VM_GUARD_BELOW + VM_GUARD_ABOVE));
+        }
+
+        // Mask the engines apply to guest addresses, all ones when the guard
+        // pages catch what the mask would
+        static int VM_AccessMask(ref VirtMachine vm) {
+            return vm.dataGuarded ? -1 : vm.dataMask;
+        }
+
+        // Reserves the guard region and maps dataAlloc bytes at dataBase, from
+        // fd at offset when there is one and zero filled otherwise
+        static byte* VM_GuardMap(ref VirtMachine vm, int fd, long offset) {
+            IntPtr reserve = Posix.mmap(IntPtr.Zero, VM_GuardSize(), Posix.PROT_NONE,
+                Posix.MAP_PRIVATE | Posix.MAP_ANONYMOUS | Posix.MAP_NORESERVE, -1, IntPtr.Zero);
+            byte* dataBase;
+            IntPtr map;
+
+            if (reserve == Posix.MAP_FAILED)
+                return null;
+
+            dataBase = (byte*)reserve + VM_GUARD_BELOW;
+
+            if (fd >= 0)
+                map = Posix.mmap((IntPtr)dataBase, (UIntPtr)(uint)vm.dataAlloc, Posix.PROT_READ | Posix.PROT_WRITE,
+                    Posix.MAP_PRIVATE | Posix.MAP_FIXED, fd, (IntPtr)offset);
+            else
+                map = Posix.mmap((IntPtr)dataBase, (UIntPtr)(uint)vm.dataAlloc, Posix.PROT_READ | Posix.PROT_WRITE,
+                    Posix.MAP_PRIVATE | Posix.MAP_ANONYMOUS | Posix.MAP_FIXED, -1, IntPtr.Zero);
+
+            if (map == Posix.MAP_FAILED) {
+                Posix.munmap(reserve, VM_GuardSize());
+                return null;
+            }
+
+            vm.dataGuarded = true;
+
+            return dataBase;
+        }
+
+        static void VM_GuardUnmap(byte* dataBase) {
+            Posix.munmap((IntPtr)(dataBase - VM_GUARD_BELOW), VM_GuardSize());
+        }
+
+        // An exception filter, so it runs before anything unwinds. Always false
+        static bool VM_GuardHostException(Exception E) {
+            E.Data[VM_GUARD_HOST_EXCEPTION] = true;
+            return false;
+        }
+
+        // A fault in a nested call is reported there, the outer calls only see
+        // the error it raised
+        static IntPtr VM_CallGuarded(ref VirtMachine vm, int function, int* args, byte* opStack) {
+            try {
+                return VM_CallEngine(ref vm, function, args, opStack);
+            } catch (NullReferenceException E) when (!E.Data.Contains(VM_GUARD_HOST_EXCEPTION)) {
+            }
+
+            Com_Error(vm.lastError = vmErrorCode_t.VM_DATA_OUT_OF_RANGE, "Memory access out of range");
+            return (IntPtr)(-1);
+        }
+    }
+}
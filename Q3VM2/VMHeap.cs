@@ -0,0 +1,518 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+// Guest heap inside the data segment, between the end of bss and the program
+// stack. All bookkeeping lives on the host side so the guest cannot corrupt it
+// by scribbling over its own memory.
+//
+// Requests up to VM_HEAP_SMALL_MAX bytes are rounded up to a power of two size
+// class and served from per class free lists. The lists are refilled by
+// carving VM_HEAP_PAGE sized runs out of the large region and freed small
+// blocks go back on their list. A page whose blocks are all free again goes
+// back to the large region, unless it is the last one its size class has free
+// blocks in, and those are released too once the large region runs out.
+// Larger requests come from the large region: free
+// ranges are binned by the log2 of their size, taken best fit from the first
+// bin that can hold the request, split, and coalesced with their neighbours
+// again on free.
+
+namespace Q3VM2 {
+    class vmHeap_t {
+        public int start;
+        public int length;
+
+        // Free small blocks per size class, used as stacks
+        public List<int>[] small;
+
+        // Pages carved for small blocks, sorted, with the size class and the
+        // number of live blocks of every page by its start
+        public List<int> pages;
+        public Dictionary<int, int> pageClass;
+        public Dictionary<int, int> pageLive;
+
+        // Free large ranges: binned by log2 of the size, with the size and bin
+        // slot of every free range by its start and its start by its end
+        public List<int>[] bins;
+        public Dictionary<int, int> freeSize;
+        public Dictionary<int, int> freeSlot;
+        public Dictionary<int, int> freeEnd;
+
+        // Block size of every live allocation
+        public Dictionary<int, int> used;
+
+        public int liveBytes;
+        public int peakBytes;
+        public int smallFreeBytes;
+        public int largeFreeBytes;
+        public int allocations;
+        public int frees;
+        public int failures;
+    }
+
+    struct vmHeapStats_t {
+        public int heapSize;
+        public int liveBytes;
+        public int peakBytes;
+        public int freeBytes;
+        public int largestFree;
+        public int allocations;
+        public int frees;
+        public int failures;
+
+        // 1 - largest free range / free bytes in the large region
+        public float fragmentation;
+    }
+
+    unsafe static partial class VM {
+
+        public static int vm_heapSize = 1024 * 150;
+
+        const int VM_HEAP_ALIGN = 16;
+        const int VM_HEAP_SMALL_CLASSES = 8;
+        const int VM_HEAP_SMALL_MAX = VM_HEAP_ALIGN << (VM_HEAP_SMALL_CLASSES - 1);
+        const int VM_HEAP_PAGE = 4096;
+
+        static vmHeap_t VM_HeapCreate(int start, int length) {
+            vmHeap_t heap = VM_HeapEmpty();
+            int end = (start + length) & ~(VM_HEAP_ALIGN - 1);
+
+            start = (start + VM_HEAP_ALIGN - 1) & ~(VM_HEAP_ALIGN - 1);
+
+            heap.start = start;
+            heap.length = end > start ? end - start : 0;
+
+            if (heap.length > 0)
+                VM_HeapInsert(heap, heap.start, heap.length);
+
+            return heap;
+        }
+
+        static vmHeap_t VM_HeapEmpty() {
+            vmHeap_t heap = new vmHeap_t();
+
+            heap.small = new List<int>[VM_HEAP_SMALL_CLASSES];
+            heap.pages = new List<int>();
+            heap.pageClass = new Dictionary<int, int>();
+            heap.pageLive = new Dictionary<int, int>();
+            heap.bins = new List<int>[32];
+            heap.freeSize = new Dictionary<int, int>();
+            heap.freeSlot = new Dictionary<int, int>();
+            heap.freeEnd = new Dictionary<int, int>();
+            heap.used = new Dictionary<int, int>();
+
+            for (int i = 0; i < heap.small.Length; i++)
+                heap.small[i] = new List<int>();
+
+            for (int i = 0; i < heap.bins.Length; i++)
+                heap.bins[i] = new List<int>();
+
+            return heap;
+        }
+
+        // Deep copy, for an instance that starts out with the same data segment
+        static vmHeap_t VM_HeapClone(vmHeap_t heap) {
+            vmHeap_t copy = VM_HeapEmpty();
+
+            VM_HeapCopy(copy, heap);
+
+            return copy;
+        }
+
+        // Overwrites dest with the state of src, reusing the containers of dest
+        static void VM_HeapCopy(vmHeap_t dest, vmHeap_t src) {
+            dest.start = src.start;
+            dest.length = src.length;
+
+            for (int i = 0; i < src.small.Length; i++) {
+                dest.small[i].Clear();
+                dest.small[i].AddRange(src.small[i]);
+            }
+
+            dest.pages.Clear();
+            dest.pages.AddRange(src.pages);
+            VM_HeapCopyMap(dest.pageClass, src.pageClass);
+            VM_HeapCopyMap(dest.pageLive, src.pageLive);
+
+            for (int i = 0; i < src.bins.Length; i++) {
+                dest.bins[i].Clear();
+                dest.bins[i].AddRange(src.bins[i]);
+            }
+
+            VM_HeapCopyMap(dest.freeSize, src.freeSize);
+            VM_HeapCopyMap(dest.freeSlot, src.freeSlot);
+            VM_HeapCopyMap(dest.freeEnd, src.freeEnd);
+            VM_HeapCopyMap(dest.used, src.used);
+
+            dest.liveBytes = src.liveBytes;
+            dest.peakBytes = src.peakBytes;
+            dest.smallFreeBytes = src.smallFreeBytes;
+            dest.largeFreeBytes = src.largeFreeBytes;
+            dest.allocations = src.allocations;
+            dest.frees = src.frees;
+            dest.failures = src.failures;
+        }
+
+        static void VM_HeapCopyMap(Dictionary<int, int> dest, Dictionary<int, int> src) {
+            dest.Clear();
+
+            foreach (KeyValuePair<int, int> entry in src)
+                dest.Add(entry.Key, entry.Value);
+        }
+
+        // Serialized form of the bookkeeping, for replication
+        static void VM_HeapWrite(BinaryWriter writer, vmHeap_t heap) {
+            writer.Write(heap.start);
+            writer.Write(heap.length);
+
+            foreach (List<int> list in heap.small)
+                VM_HeapWriteList(writer, list);
+
+            VM_HeapWriteList(writer, heap.pages);
+            VM_HeapWriteMap(writer, heap.pageClass);
+            VM_HeapWriteMap(writer, heap.pageLive);
+
+            foreach (List<int> list in heap.bins)
+                VM_HeapWriteList(writer, list);
+
+            VM_HeapWriteMap(writer, heap.freeSize);
+            VM_HeapWriteMap(writer, heap.freeSlot);
+            VM_HeapWriteMap(writer, heap.freeEnd);
+            VM_HeapWriteMap(writer, heap.used);
+
+            writer.Write(heap.liveBytes);
+            writer.Write(heap.peakBytes);
+            writer.Write(heap.smallFreeBytes);
+            writer.Write(heap.largeFreeBytes);
+            writer.Write(heap.allocations);
+            writer.Write(heap.frees);
+            writer.Write(heap.failures);
+        }
+
+        // Overwrites heap with what VM_HeapWrite wrote
+        static void VM_HeapRead(BinaryReader reader, vmHeap_t heap) {
+            heap.start = reader.ReadInt32();
+            heap.length = reader.ReadInt32();
+
+            foreach (List<int> list in heap.small)
+                VM_HeapReadList(reader, list);
+
+            VM_HeapReadList(reader, heap.pages);
+            VM_HeapReadMap(reader, heap.pageClass);
+            VM_HeapReadMap(reader, heap.pageLive);
+
+            foreach (List<int> list in heap.bins)
+                VM_HeapReadList(reader, list);
+
+            VM_HeapReadMap(reader, heap.freeSize);
+            VM_HeapReadMap(reader, heap.freeSlot);
+            VM_HeapReadMap(reader, heap.freeEnd);
+            VM_HeapReadMap(reader, heap.used);
+
+            heap.liveBytes = reader.ReadInt32();
+            heap.peakBytes = reader.ReadInt32();
+            heap.smallFreeBytes = reader.ReadInt32();
+            heap.largeFreeBytes = reader.ReadInt32();
+            heap.allocations = reader.ReadInt32();
+            heap.frees = reader.ReadInt32();
+            heap.failures = reader.ReadInt32();
+        }
+
+        static void VM_HeapWriteList(BinaryWriter writer, List<int> list) {
+            writer.Write(list.Count);
+
+            foreach (int value in list)
+                writer.Write(value);
+        }
+
+        static void VM_HeapReadList(BinaryReader reader, List<int> list) {
+            int count = reader.ReadInt32();
+
+            list.Clear();
+            for (int i = 0; i < count; i++)
+                list.Add(reader.ReadInt32());
+        }
+
+        static void VM_HeapWriteMap(BinaryWriter writer, Dictionary<int, int> map) {
+            writer.Write(map.Count);
+
+            foreach (KeyValuePair<int, int> entry in map) {
+                writer.Write(entry.Key);
+                writer.Write(entry.Value);
+            }
+        }
+
+        static void VM_HeapReadMap(BinaryReader reader, Dictionary<int, int> map) {
+            int count = reader.ReadInt32();
+
+            map.Clear();
+            for (int i = 0; i < count; i++) {
+                int key = reader.ReadInt32();
+
+                map.Add(key, reader.ReadInt32());
+            }
+        }
+
+        static int VM_HeapBin(int size) {
+            int bin = 0;
+
+            while ((size >> (bin + 1)) != 0)
+                bin++;
+
+            return bin;
+        }
+
+        // Adds a free range to the large region, merging it with free neighbours
+        static void VM_HeapInsert(vmHeap_t heap, int addr, int size) {
+            int bin;
+
+            if (heap.freeEnd.TryGetValue(addr, out int before)) {
+                size += heap.freeSize[before];
+                VM_HeapRemove(heap, before);
+                addr = before;
+            }
+
+            if (heap.freeSize.TryGetValue(addr + size, out int after)) {
+                VM_HeapRemove(heap, addr + size);
+                size += after;
+            }
+
+            bin = VM_HeapBin(size);
+
+            heap.freeSize[addr] = size;
+            heap.freeSlot[addr] = heap.bins[bin].Count;
+            heap.freeEnd[addr + size] = addr;
+            heap.bins[bin].Add(addr);
+            heap.largeFreeBytes += size;
+        }
+
+        static void VM_HeapRemove(vmHeap_t heap, int addr) {
+            int size = heap.freeSize[addr];
+            List<int> bin = heap.bins[VM_HeapBin(size)];
+            int slot = heap.freeSlot[addr];
+            int last = bin[bin.Count - 1];
+
+            // Swap the last range of the bin into the hole
+            bin[slot] = last;
+            heap.freeSlot[last] = slot;
+            bin.RemoveAt(bin.Count - 1);
+
+            heap.freeSize.Remove(addr);
+            heap.freeSlot.Remove(addr);
+            heap.freeEnd.Remove(addr + size);
+            heap.largeFreeBytes -= size;
+        }
+
+        // Best fit from the large region, 0 when nothing is big enough
+        static int VM_HeapTake(vmHeap_t heap, int size) {
+            int best = VM_HeapFit(heap, size);
+            int bestSize;
+
+            if (best == 0 && VM_HeapReleaseEmptyPages(heap))
+                best = VM_HeapFit(heap, size);
+
+            if (best == 0)
+                return 0;
+
+            bestSize = heap.freeSize[best];
+            VM_HeapRemove(heap, best);
+
+            if (bestSize > size)
+                VM_HeapInsert(heap, best + size, bestSize - size);
+
+            return best;
+        }
+
+        static int VM_HeapFit(vmHeap_t heap, int size) {
+            int best = 0;
+            int bestSize = int.MaxValue;
+
+            for (int bin = VM_HeapBin(size); bin < heap.bins.Length && best == 0; bin++) {
+                List<int> ranges = heap.bins[bin];
+
+                for (int i = 0; i < ranges.Count; i++) {
+                    int rangeSize = heap.freeSize[ranges[i]];
+
+                    if (rangeSize >= size && rangeSize < bestSize) {
+                        best = ranges[i];
+                        bestSize = rangeSize;
+                    }
+                }
+            }
+
+            return best;
+        }
+
+        static int VM_HeapTakeSmall(vmHeap_t heap, int sizeClass) {
+            List<int> blocks = heap.small[sizeClass];
+            int size = VM_HEAP_ALIGN << sizeClass;
+            int page;
+            int addr;
+
+            if (blocks.Count != 0) {
+                addr = blocks[blocks.Count - 1];
+                blocks.RemoveAt(blocks.Count - 1);
+                heap.smallFreeBytes -= size;
+                heap.pageLive[VM_HeapPage(heap, addr)]++;
+                return addr;
+            }
+
+            // Refill with a page, or with the one block when memory is tight
+            page = VM_HeapTake(heap, VM_HEAP_PAGE);
+
+            if (page == 0)
+                return VM_HeapTake(heap, size);
+
+            for (addr = page + VM_HEAP_PAGE - size; addr > page; addr -= size) {
+                blocks.Add(addr);
+                heap.smallFreeBytes += size;
+            }
+
+            heap.pages.Insert(~heap.pages.BinarySearch(page), page);
+            heap.pageClass[page] = sizeClass;
+            heap.pageLive[page] = 1;
+
+            return page;
+        }
+
+        // The small page addr is in, 0 for a block taken on its own
+        static int VM_HeapPage(vmHeap_t heap, int addr) {
+            int i = heap.pages.BinarySearch(addr);
+
+            if (i < 0)
+                i = ~i - 1;
+
+            return i >= 0 && addr < heap.pages[i] + VM_HEAP_PAGE ? heap.pages[i] : 0;
+        }
+
+        // Hands a page with no live blocks back to the large region
+        static void VM_HeapReleasePage(vmHeap_t heap, int page) {
+            int sizeClass = heap.pageClass[page];
+
+            heap.small[sizeClass].RemoveAll(addr => addr >= page && addr < page + VM_HEAP_PAGE);
+            heap.smallFreeBytes -= VM_HEAP_PAGE;
+
+            heap.pages.RemoveAt(heap.pages.BinarySearch(page));
+            heap.pageClass.Remove(page);
+            heap.pageLive.Remove(page);
+
+            VM_HeapInsert(heap, page, VM_HEAP_PAGE);
+        }
+
+        // Whether there was an empty page to release
+        static bool VM_HeapReleaseEmptyPages(vmHeap_t heap) {
+            bool released = false;
+
+            for (int i = heap.pages.Count - 1; i >= 0; i--) {
+                if (heap.pageLive[heap.pages[i]] == 0) {
+                    VM_HeapReleasePage(heap, heap.pages[i]);
+                    released = true;
+                }
+            }
+
+            return released;
+        }
+
+        // Returns the guest address of a zeroed block, 0 when the heap is exhausted
+        static int VM_HeapAlloc(ref VirtMachine vm, int size) {
+            vmHeap_t heap = vm.heap;
+            int addr;
+
+            if (heap == null || size < 0 || size > heap.length) {
+                if (heap != null)
+                    heap.failures++;
+                return 0;
+            }
+
+            if (size <= VM_HEAP_SMALL_MAX) {
+                int sizeClass = 0;
+
+                while ((VM_HEAP_ALIGN << sizeClass) < size)
+                    sizeClass++;
+
+                size = VM_HEAP_ALIGN << sizeClass;
+                addr = VM_HeapTakeSmall(heap, sizeClass);
+            } else {
+                size = (size + VM_HEAP_ALIGN - 1) & ~(VM_HEAP_ALIGN - 1);
+                addr = VM_HeapTake(heap, size);
+            }
+
+            if (addr == 0) {
+                heap.failures++;
+                return 0;
+            }
+
+            heap.used[addr] = size;
+            heap.allocations++;
+            heap.liveBytes += size;
+
+            if (heap.liveBytes > heap.peakBytes)
+                heap.peakBytes = heap.liveBytes;
+
+            memset(vm.dataBase + addr, 0, (uint)size);
+            VM_MarkDirty(ref vm, addr, size);
+
+            return addr;
+        }
+
+        static int VM_HeapFree(ref VirtMachine vm, int addr) {
+            vmHeap_t heap = vm.heap;
+            int page;
+
+            if (addr == 0)
+                return 0;
+
+            if (heap == null || !heap.used.TryGetValue(addr, out int size)) {
+                Warn("VM_HeapFree: {0} freed a block it does not own at 0x{1:X}\n", vm.Name, addr);
+                return -1;
+            }
+
+            heap.used.Remove(addr);
+            heap.frees++;
+            heap.liveBytes -= size;
+
+            if (size <= VM_HEAP_SMALL_MAX && (page = VM_HeapPage(heap, addr)) != 0) {
+                List<int> blocks = heap.small[VM_HeapBin(size / VM_HEAP_ALIGN)];
+
+                blocks.Add(addr);
+                heap.smallFreeBytes += size;
+
+                // Keep the page while the size class has no other free blocks,
+                // so a class that allocates and frees one block does not carve
+                // and release a page every time
+                if (--heap.pageLive[page] == 0 && blocks.Count > VM_HEAP_PAGE / size)
+                    VM_HeapReleasePage(heap, page);
+            } else {
+                VM_HeapInsert(heap, addr, size);
+            }
+
+            return 0;
+        }
+
+        public static vmHeapStats_t VM_HeapStats(ref VirtMachine vm) {
+            vmHeapStats_t stats = new vmHeapStats_t();
+            vmHeap_t heap = vm.heap;
+
+            if (heap == null)
+                return stats;
+
+            stats.heapSize = heap.length;
+            stats.liveBytes = heap.liveBytes;
+            stats.peakBytes = heap.peakBytes;
+            stats.freeBytes = heap.smallFreeBytes + heap.largeFreeBytes;
+            stats.allocations = heap.allocations;
+            stats.frees = heap.frees;
+            stats.failures = heap.failures;
+
+            for (int bin = heap.bins.Length - 1; bin >= 0 && stats.largestFree == 0; bin--) {
+                foreach (int addr in heap.bins[bin])
+                    stats.largestFree = Math.Max(stats.largestFree, heap.freeSize[addr]);
+            }
+
+            if (heap.largeFreeBytes != 0)
+                stats.fragmentation = 1.0f - (float)stats.largestFree / heap.largeFreeBytes;
+
+            return stats;
+        }
+    }
+}
@@ -0,0 +1,307 @@
+﻿using System;
+using System.IO;
+using System.Text;
+
+// Images of an initialized VM for fast startup. VM_SaveImage writes the decoded
+// code, the instruction pointers, the verifier results and the module data
+// image, followed by the data segment, heap and stack of an idle VM, typically
+// right after its init call. VM_LoadImage maps that file back as a clone
+// source, so neither the .qvm nor the init call have to run again: the code
+// sections become the module, read only, and every VM_Clone maps the data
+// segment MAP_PRIVATE straight from the file.
+//
+// Sections are VM_IMAGE_ALIGN aligned so they can be mapped on any page size.
+// The image is in host byte order and only loads on a host with the same
+// pointer size. Where there is no mmap the sections are read into memory.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        const int VM_IMAGE_MAGIC = 0x49563351; // "Q3VI"
+        const int VM_IMAGE_VERSION = 4;
+        const int VM_IMAGE_ALIGN = 0x10000;
+
+        static long VM_ImageAlign(long offset) {
+            return (offset + VM_IMAGE_ALIGN - 1) & ~(long)(VM_IMAGE_ALIGN - 1);
+        }
+
+        public static bool VM_SaveImage(ref VirtMachine vm, string path) {
+            vmModule_t module = vm.module;
+            MemoryStream meta = new MemoryStream();
+            BinaryWriter writer = new BinaryWriter(meta, Encoding.UTF8);
+            int codeSize;
+            int pointersSize;
+            long codeOffset;
+            long pointersOffset;
+            long dataImageOffset;
+            long dataOffset;
+            int dataAlloc;
+
+            if (vm.callLevel != 0) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_IMAGE, "VM_SaveImage on running vm");
+                return false;
+            }
+
+            if (module == null || vm.dataBase == null) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_NOT_LOADED, "VM not loaded");
+                return false;
+            }
+
+            if (VM_DecodeModule(module) != 0)
+                return false;
+
+            codeSize = module.codeSize;
+            pointersSize = module.instructionCount * sizeof(int);
+            dataAlloc = (int)VM_ImageAlign(vm.dataAlloc);
+
+            writer.Write(module.Name ?? "");
+            writer.Write(VM_ModuleHash(module));
+            writer.Write(module.codeLength);
+            writer.Write(module.codeSize);
+            writer.Write(module.instructionCount);
+            writer.Write(module.dataImageLength);
+            writer.Write(module.dataLength);
+            writer.Write(module.dataMallocStart);
+            writer.Write(module.dataMallocLen);
+            writer.Write(module.stackSize);
+
+            writer.Write(module.verifiedFunctions != null ? module.verifiedFunctions.Length : -1);
+            if (module.verifiedFunctions != null) {
+                foreach (bool verified in module.verifiedFunctions)
+                    writer.Write(verified);
+            }
+
+            writer.Write(vm.dataMask);
+            writer.Write(vm.dataMallocStart);
+            writer.Write(vm.dataMallocLen);
+            writer.Write(vm.programStack);
+            writer.Write(vm.stackBottom);
+            VM_HeapWrite(writer, vm.heap);
+            writer.Flush();
+
+            // magic, version, pointer size, meta length, 4 offsets, dataAlloc
+            codeOffset = VM_ImageAlign(4 * sizeof(int) + 4 * sizeof(long) + sizeof(int) + meta.Length);
+            pointersOffset = VM_ImageAlign(codeOffset + codeSize);
+            dataImageOffset = VM_ImageAlign(pointersOffset + pointersSize);
+            dataOffset = VM_ImageAlign(dataImageOffset + module.dataImageLength);
+
+            try {
+                using (FileStream file = new FileStream(path, FileMode.Create, FileAccess.Write)) {
+                    BinaryWriter header = new BinaryWriter(file, Encoding.UTF8);
+
+                    header.Write(VM_IMAGE_MAGIC);
+                    header.Write(VM_IMAGE_VERSION);
+                    header.Write(IntPtr.Size);
+                    header.Write((int)meta.Length);
+                    header.Write(codeOffset);
+                    header.Write(pointersOffset);
+                    header.Write(dataImageOffset);
+                    header.Write(dataOffset);
+                    header.Write(dataAlloc);
+                    header.Write(meta.GetBuffer(), 0, (int)meta.Length);
+                    header.Flush();
+
+                    VM_ImageWrite(file, codeOffset, module.codeBase, codeSize);
+                    VM_ImageWrite(file, pointersOffset, (byte*)module.instructionPointers, pointersSize);
+                    VM_ImageWrite(file, dataImageOffset, module.dataImage, module.dataImageLength);
+
+                    VM_ImageWrite(file, dataOffset, vm.dataBase, VM_DataExtent(vm.dataMask));
+                    file.SetLength(dataOffset + dataAlloc);
+                }
+            } catch (IOException e) {
+                Warn("VM_SaveImage: {0}\n", e.Message);
+                return false;
+            }
+
+            return true;
+        }
+
+        static void VM_ImageWrite(FileStream file, long offset, byte* data, int length) {
+            file.Position = offset;
+
+            using (UnmanagedMemoryStream src = new UnmanagedMemoryStream(data, length))
+                src.CopyTo(file);
+        }
+
+        static bool VM_ImageRead(FileStream file, long offset, byte* data, int length) {
+            byte[] buffer = new byte[Math.Min(length, VM_IMAGE_ALIGN)];
+
+            file.Position = offset;
+
+            while (length > 0) {
+                int n = file.Read(buffer, 0, Math.Min(length, buffer.Length));
+
+                if (n <= 0)
+                    return false;
+
+                for (int i = 0; i < n; i++)
+                    data[i] = buffer[i];
+
+                data += n;
+                length -= n;
+            }
+
+            return true;
+        }
+
+        public static vmCloneSource_t VM_LoadImage(string path, systemCallFunc systemCalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_LoadImage(path, systemCalls, null, interpret);
+        }
+
+        public static vmCloneSource_t VM_LoadImage(string path, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            return VM_LoadImage(path, null, syscalls, interpret);
+        }
+
+        // The result is a clone source, VM_Clone creates instances from it and
+        // VM_FreeCloneSource closes the file again
+        static vmCloneSource_t VM_LoadImage(string path, systemCallFunc systemCalls, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret) {
+            vmCloneSource_t source = new vmCloneSource_t();
+            vmModule_t module = new vmModule_t();
+            long codeOffset;
+            long pointersOffset;
+            long dataImageOffset;
+            long dataOffset;
+            int verifiedCount;
+            bool loaded;
+
+            module.refCount = 1;
+            module.guardPages = VM_GuardPagesUsable();
+            source.module = module;
+            source.fd = -1;
+            source.systemCall = systemCalls;
+            source.syscalls = syscalls;
+            source.interpret = interpret;
+
+            using (FileStream file = File.OpenRead(path)) {
+                BinaryReader reader = new BinaryReader(file, Encoding.UTF8);
+
+                if (file.Length < 4 * sizeof(int) || reader.ReadInt32() != VM_IMAGE_MAGIC ||
+                    reader.ReadInt32() != VM_IMAGE_VERSION || reader.ReadInt32() != IntPtr.Size) {
+                    Com_Error(vmErrorCode_t.VM_BAD_IMAGE, "Not a vm image for this host");
+                    return null;
+                }
+
+                reader.ReadInt32();
+                codeOffset = reader.ReadInt64();
+                pointersOffset = reader.ReadInt64();
+                dataImageOffset = reader.ReadInt64();
+                dataOffset = reader.ReadInt64();
+                source.dataAlloc = reader.ReadInt32();
+
+                module.Name = reader.ReadString();
+                module.hash = reader.ReadString();
+                module.codeLength = reader.ReadInt32();
+                module.codeSize = reader.ReadInt32();
+                module.instructionCount = reader.ReadInt32();
+                module.dataImageLength = reader.ReadInt32();
+                module.dataLength = reader.ReadInt32();
+                module.dataMallocStart = reader.ReadInt32();
+                module.dataMallocLen = reader.ReadInt32();
+                module.stackSize = reader.ReadInt32();
+
+                verifiedCount = reader.ReadInt32();
+                if (verifiedCount >= 0) {
+                    module.verifiedFunctions = new bool[verifiedCount];
+                    for (int i = 0; i < verifiedCount; i++)
+                        module.verifiedFunctions[i] = reader.ReadBoolean();
+                }
+
+                source.Name = module.Name;
+                source.dataMask = reader.ReadInt32();
+                source.dataMallocStart = reader.ReadInt32();
+                source.dataMallocLen = reader.ReadInt32();
+                source.programStack = reader.ReadInt32();
+                source.stackBottom = reader.ReadInt32();
+                source.heap = VM_HeapEmpty();
+                VM_HeapRead(reader, source.heap);
+
+                if (file.Length < dataOffset + source.dataAlloc) {
+                    Com_Error(vmErrorCode_t.VM_BAD_IMAGE, "Truncated vm image");
+                    return null;
+                }
+
+                if (Posix.IsLinuxX64)
+                    loaded = VM_MapImage(source, path, codeOffset, pointersOffset, dataImageOffset, dataOffset);
+                else
+                    loaded = false;
+
+                if (!loaded)
+                    loaded = VM_ReadImage(source, file, codeOffset, pointersOffset, dataImageOffset, dataOffset);
+
+                if (!loaded) {
+                    VM_FreeCloneSource(source);
+                    Com_Error(vmErrorCode_t.VM_BAD_IMAGE, "Reading the vm image failed");
+                    return null;
+                }
+            }
+
+            module.instructions = VM_DecodeInstructions(module);
+
+            return source;
+        }
+
+        // Maps everything in front of the data segment read only for the module,
+        // the file stays open for VM_Clone to map the data segment from
+        static bool VM_MapImage(vmCloneSource_t source, string path, long codeOffset, long pointersOffset, long dataImageOffset, long dataOffset) {
+            vmModule_t module = source.module;
+            int fd = Posix.open(path, Posix.O_RDONLY);
+            IntPtr map;
+
+            if (fd < 0)
+                return false;
+
+            map = Posix.mmap(IntPtr.Zero, (UIntPtr)(ulong)dataOffset, Posix.PROT_READ, Posix.MAP_PRIVATE, fd, IntPtr.Zero);
+            if (map == Posix.MAP_FAILED) {
+                Posix.close(fd);
+                return false;
+            }
+
+            module.mapping = (byte*)map;
+            module.mappingLength = dataOffset;
+            module.codeBase = module.mapping + codeOffset;
+            module.instructionPointers = (int*)(module.mapping + pointersOffset);
+            module.dataImage = module.mapping + dataImageOffset;
+
+            source.fd = fd;
+            source.dataOffset = dataOffset;
+
+            return true;
+        }
+
+        static bool VM_ReadImage(vmCloneSource_t source, FileStream file, long codeOffset, long pointersOffset, long dataImageOffset, long dataOffset) {
+            vmModule_t module = source.module;
+            int codeSize = module.codeSize;
+            int pointersSize = module.instructionCount * sizeof(int);
+
+            module.codeBase = (byte*)Com_malloc((uint)codeSize, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            module.instructionPointers = (int*)Com_malloc((uint)pointersSize, vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
+            module.dataImage = (byte*)Com_malloc((uint)module.dataImageLength, vmMallocType_t.VM_ALLOC_DATA_SEC);
+            source.data = (byte*)Com_malloc((uint)source.dataAlloc, vmMallocType_t.VM_ALLOC_DATA_SEC);
+
+            if (module.codeBase == null || module.instructionPointers == null || module.dataImage == null || source.data == null)
+                return false;
+
+            return VM_ImageRead(file, codeOffset, module.codeBase, codeSize) &&
+                VM_ImageRead(file, pointersOffset, (byte*)module.instructionPointers, pointersSize) &&
+                VM_ImageRead(file, dataImageOffset, module.dataImage, module.dataImageLength) &&
+                VM_ImageRead(file, dataOffset, source.data, source.dataAlloc);
+        }
+
+        // Single instance shortcut, use VM_LoadImage and VM_Clone for more
+        public static bool VM_CreateFromImage(ref VirtMachine vm, string Name, string path, vmSyscallFunc_t[] syscalls, vmInterpret_t interpret = vmInterpret_t.VMI_BYTECODE) {
+            vmCloneSource_t source = VM_LoadImage(path, null, syscalls, interpret);
+            bool created;
+
+            if (source == null) {
+                vm.lastError = vmErrorCode_t.VM_BAD_IMAGE;
+                return false;
+            }
+
+            source.Name = Name;
+            created = VM_Clone(ref vm, source);
+            VM_FreeCloneSource(source);
+
+            return created;
+        }
+    }
+}
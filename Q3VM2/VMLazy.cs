@@ -0,0 +1,110 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+
+// Lazy decoding. With vm_lazyDecode set VM_LoadModule only finds where the
+// instructions and functions start and keeps a copy of the code section. A
+// function is decoded into codeBase the first time the interpreter enters it,
+// through VM_Call or OP_CALL, along with every function its branches reach.
+// codeBase is still allocated in full and starts out as OP_UNDEF, so a wild
+// jump or return into code not decoded yet fails with VM_BAD_INSTRUCTION
+// instead of running whatever the allocation held. Bad code only shows up when
+// its function is first called.
+//
+// Only the interpreter runs from partially decoded code. The other engines,
+// the verifier, images and the code cache need the whole module and decode the
+// rest first.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        public static bool vm_lazyDecode = false;
+
+        static int VM_PrepareLazy(vmModule_t module, byte* code) {
+            module.rawCode = (byte*)Com_malloc((uint)module.codeLength, vmMallocType_t.VM_ALLOC_CODE_SEC);
+
+            if (module.rawCode == null) {
+                Com_Error(vmErrorCode_t.VM_MALLOC_FAILED, "Code malloc failed: out of memory?");
+                return -1;
+            }
+
+            memcpy(module.rawCode, code, (uint)module.codeLength);
+
+            // OP_UNDEF is 0 with any operand width
+            memset(module.codeBase, 0, (uint)module.codeSize);
+
+            module.decodedFunctions = new bool[module.functionStarts.Length];
+            module.undecodedFunctions = module.functionStarts.Length;
+
+            return 0;
+        }
+
+        // The function holding instruction
+        static int VM_FunctionAt(vmModule_t module, int instruction) {
+            int function = Array.BinarySearch(module.functionStarts, instruction);
+
+            return function >= 0 ? function : ~function - 1;
+        }
+
+        // Called by the interpreter before it enters instruction
+        static void VM_DecodeAt(vmModule_t module, int instruction) {
+            bool[] decoded = module.decodedFunctions;
+            int function;
+
+            if (decoded == null)
+                return;
+
+            function = VM_FunctionAt(module, instruction);
+
+            if (!Volatile.Read(ref decoded[function]))
+                VM_DecodeFunction(module, function);
+        }
+
+        static int VM_DecodeFunction(vmModule_t module, int function) {
+            Stack<int> pending = new Stack<int>();
+
+            lock (module) {
+                pending.Push(function);
+
+                while (pending.Count != 0 && module.decodedFunctions != null) {
+                    function = pending.Pop();
+
+                    if (module.decodedFunctions[function])
+                        continue;
+
+                    if (VM_DecodeFunctionBody(module, module.rawCode, function, pending) != 0)
+                        return -1;
+
+                    Volatile.Write(ref module.decodedFunctions[function], true);
+
+                    // Everything is there, the code section is not needed anymore
+                    if (--module.undecodedFunctions == 0) {
+                        Com_free(module.rawCode, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                        module.rawCode = null;
+                        module.decodedFunctions = null;
+                    }
+                }
+            }
+
+            return 0;
+        }
+
+        // Decodes whatever is left and builds the instruction records and
+        // verifier results the other engines work from
+        static int VM_DecodeModule(vmModule_t module) {
+            lock (module) {
+                for (int function = 0; module.decodedFunctions != null && function < module.decodedFunctions.Length; function++) {
+                    if (!module.decodedFunctions[function] && VM_DecodeFunction(module, function) != 0)
+                        return -1;
+                }
+
+                if (module.instructions == null) {
+                    module.instructions = VM_DecodeInstructions(module);
+                    VM_Verify(module);
+                }
+            }
+
+            return 0;
+        }
+    }
+}
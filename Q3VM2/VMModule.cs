@@ -0,0 +1,311 @@
+﻿using System;
+using System.IO;
+using System.Threading;
+
+// A QVM loaded once and shared by every VirtMachine created from it. The module
+// owns what does not change after load: the decoded code, the instruction
+// pointers, the instruction records, the verifier results and the data and lit
+// segments as they were in the file. An instance only owns its data segment,
+// heap and stack, plus the engine state that is tied to it.
+//
+// Engine state that only depends on the code is built by the first instance
+// that needs it and reused by the rest: the threaded code, unless tiered
+// execution patches it, and the IL compiled functions. Native, register and
+// precompiled code keep per instance state and are still built per instance.
+//
+// Modules are reference counted. VM_LoadModule hands out one reference, every
+// VM_Create takes one and VM_Free drops it again, the last VM_FreeModule
+// releases the code.
+
+namespace Q3VM2 {
+    unsafe class vmModule_t {
+        public string Name;
+
+        // Names the precompiled assembly, images and replication streams,
+        // null until VM_ModuleHash first needs it
+        public string hash;
+
+        public int refCount;
+
+        // codeBase holds codeSize bytes of decoded code, codeLength is the size
+        // of the code section in the file
+        public byte* codeBase;
+        public int codeLength;
+        public int codeSize;
+        public int* instructionPointers;
+        public int instructionCount;
+        public vmInstruction_t[] instructions;
+        public bool[] verifiedFunctions;
+
+        // Where every function starts, in instructions and in bytes of the
+        // code section
+        public int[] functionStarts;
+        public int[] functionOffsets;
+
+        // Lazy decoding, see VMLazy.cs: the code section and which functions
+        // codeBase holds so far, both null once everything is decoded
+        public byte* rawCode;
+        public bool[] decodedFunctions;
+        public int undecodedFunctions;
+
+        // Data and lit segments in host byte order, the rest of the data
+        // segment starts out zeroed
+        public byte* dataImage;
+        public int dataImageLength;
+
+        // Size of the data segment, a power of two
+        public int dataLength;
+
+        // Instances get guard page protected data segments, see VMGuard.cs
+        public bool guardPages;
+        public int dataMallocStart;
+        public int dataMallocLen;
+        public int stackSize;
+
+        // Code symbols from the .map file, see VMSymbols.cs
+        public int numSymbols;
+        public vmSymbol_t* symbols;
+
+        // Read only mapping of an image or code cache file some of the sections
+        // point into, see VMImage.cs and VMCodeCache.cs
+        public byte* mapping;
+        public long mappingLength;
+
+        public vmThreadedInstruction_t* threadedCode;
+        public int fusedInstructions;
+        public vmCompiledFunc_t[] compiledFunctions;
+    }
+
+    unsafe static partial class VM {
+
+        public static vmModule_t VM_LoadModule(string Name, byte[] Bytecode) {
+            fixed (byte* bytecode = Bytecode) {
+                return VM_LoadModule(Name, bytecode, Bytecode.Length);
+            }
+        }
+
+        // The symbols of a .map file next to the .qvm are loaded along
+        public static vmModule_t VM_LoadModule(string Name, string path) {
+            vmModule_t module = VM_LoadModuleFile(Name, path);
+            string map = Path.ChangeExtension(path, ".map");
+
+            if (module != null && File.Exists(map))
+                VM_LoadSymbols(module, map);
+
+            return module;
+        }
+
+        // Maps the file read only and decodes from the mapping
+        static vmModule_t VM_LoadModuleFile(string Name, string path) {
+            if (Posix.IsLinuxX64) {
+                long length = new FileInfo(path).Length;
+                int fd = Posix.open(path, Posix.O_RDONLY);
+                IntPtr map = Posix.MAP_FAILED;
+
+                if (fd >= 0) {
+                    if (length > 0 && length <= int.MaxValue)
+                        map = Posix.mmap(IntPtr.Zero, (UIntPtr)(ulong)length, Posix.PROT_READ, Posix.MAP_PRIVATE, fd, IntPtr.Zero);
+
+                    Posix.close(fd);
+                }
+
+                if (map != Posix.MAP_FAILED) {
+                    try {
+                        return VM_LoadModule(Name, (byte*)map, (int)length);
+                    } finally {
+                        Posix.munmap(map, (UIntPtr)(ulong)length);
+                    }
+                }
+            }
+
+            return VM_LoadModule(Name, File.ReadAllBytes(path));
+        }
+
+        // Streams that are in memory or backed by a file are used in place, the
+        // rest is read once
+        public static vmModule_t VM_LoadModule(string Name, Stream stream) {
+            UnmanagedMemoryStream unmanaged = stream as UnmanagedMemoryStream;
+            MemoryStream memory = stream as MemoryStream;
+            FileStream file = stream as FileStream;
+            ArraySegment<byte> buffer;
+
+            if (unmanaged != null)
+                return VM_LoadModule(Name, unmanaged.PositionPointer, (int)(unmanaged.Length - unmanaged.Position));
+
+            if (file != null && file.Position == 0)
+                return VM_LoadModule(Name, file.Name);
+
+            if (memory == null || !memory.TryGetBuffer(out buffer)) {
+                memory = new MemoryStream();
+                stream.CopyTo(memory);
+                memory.Position = 0;
+                memory.TryGetBuffer(out buffer);
+            }
+
+            fixed (byte* data = buffer.Array) {
+                return VM_LoadModule(Name, data + buffer.Offset + memory.Position, (int)(memory.Length - memory.Position));
+            }
+        }
+
+        // bytecode is only read
+        static vmModule_t VM_LoadModule(string Name, byte* bytecode, int length) {
+            vmModule_t module = new vmModule_t();
+            vmHeader_t header;
+            string cacheKey = null;
+
+            module.Name = Name;
+            module.refCount = 1;
+            module.guardPages = VM_GuardPagesUsable();
+
+            if (VM_LoadQVM(module, bytecode, length, &header) != 0) {
+                VM_FreeModule(module);
+                return null;
+            }
+
+            module.codeLength = header.codeLength;
+            module.instructionCount = header.instructionCount;
+
+            if (vm_codeCache != null)
+                cacheKey = VM_BytecodeHash(bytecode + header.codeOffset, header.codeLength);
+
+            if (cacheKey == null || !VM_LoadCodeCache(module, cacheKey)) {
+                module.instructionPointers = (int*)Com_malloc((uint)(module.instructionCount * sizeof(int)), vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
+                if (module.instructionPointers == null) {
+                    Com_Error(vmErrorCode_t.VM_MALLOC_FAILED,
+                              "Instr. pointer malloc failed: out of memory?");
+                    VM_FreeModule(module);
+                    return null;
+                }
+
+                if (VM_PrepareInterpreter(module, bytecode, &header) != 0) {
+                    VM_FreeModule(module);
+                    return null;
+                }
+
+                if (cacheKey != null && module.rawCode == null)
+                    VM_SaveCodeCache(module, cacheKey);
+            }
+
+            // Lazily decoded modules get these once an engine needs them
+            if (module.rawCode == null) {
+                module.instructions = VM_DecodeInstructions(module);
+                VM_Verify(module);
+            }
+
+            return module;
+        }
+
+        // SHA-256 of the decoded code and the initial data, taken on first use
+        // so loading does not pay for it. A lazily decoded module is decoded
+        // completely first
+        public static string VM_ModuleHash(vmModule_t module) {
+            lock (module) {
+                if (module.hash == null && VM_DecodeModule(module) == 0) {
+                    byte[] buffer = new byte[4 * sizeof(int) + module.codeSize + module.dataImageLength];
+
+                    fixed (byte* p = buffer) {
+                        ((int*)p)[0] = module.instructionCount;
+                        ((int*)p)[1] = module.codeSize;
+                        ((int*)p)[2] = module.dataImageLength;
+                        ((int*)p)[3] = module.dataMallocStart;
+                        memcpy(p + 4 * sizeof(int), module.codeBase, (uint)module.codeSize);
+                        memcpy(p + 4 * sizeof(int) + module.codeSize, module.dataImage, (uint)module.dataImageLength);
+
+                        module.hash = VM_BytecodeHash(p, buffer.Length);
+                    }
+                }
+
+                return module.hash;
+            }
+        }
+
+        // Drops one reference, the last one frees the module
+        public static void VM_FreeModule(vmModule_t module) {
+            if (module == null || Interlocked.Decrement(ref module.refCount) != 0)
+                return;
+
+            if (module.codeBase != null) {
+                if (!VM_ModuleMapped(module, module.codeBase))
+                    Com_free(module.codeBase, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                module.codeBase = null;
+            }
+
+            VM_FreeSymbols(module);
+
+            if (module.instructionPointers != null) {
+                if (!VM_ModuleMapped(module, module.instructionPointers))
+                    Com_free(module.instructionPointers, vmMallocType_t.VM_ALLOC_INSTRUCTION_POINTERS);
+                module.instructionPointers = null;
+            }
+
+            if (module.dataImage != null) {
+                if (!VM_ModuleMapped(module, module.dataImage))
+                    Com_free(module.dataImage, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                module.dataImage = null;
+            }
+
+            if (module.rawCode != null) {
+                Com_free(module.rawCode, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                module.rawCode = null;
+            }
+
+            if (module.mapping != null) {
+                Posix.munmap((IntPtr)module.mapping, (UIntPtr)(ulong)module.mappingLength);
+                module.mapping = null;
+            }
+
+            if (module.threadedCode != null) {
+                Com_free(module.threadedCode, vmMallocType_t.VM_ALLOC_CODE_SEC);
+                module.threadedCode = null;
+            }
+
+            module.instructions = null;
+            module.verifiedFunctions = null;
+            module.decodedFunctions = null;
+            module.compiledFunctions = null;
+        }
+
+        // Whether p points into the mapping rather than its own allocation
+        static bool VM_ModuleMapped(vmModule_t module, void* p) {
+            return module.mapping != null && (byte*)p >= module.mapping && (byte*)p < module.mapping + module.mappingLength;
+        }
+
+        static int VM_ShareThreaded(ref VirtMachine vm) {
+            vmModule_t module = vm.module;
+
+            lock (module) {
+                if (module.threadedCode == null) {
+                    if (VM_PrepareThreaded(ref vm) != 0)
+                        return -1;
+
+                    module.threadedCode = vm.threadedCode;
+                    module.fusedInstructions = vm.fusedInstructions;
+                }
+            }
+
+            vm.threadedCode = module.threadedCode;
+            vm.fusedInstructions = module.fusedInstructions;
+
+            return 0;
+        }
+
+        // The compiled functions get the vm and its image as arguments and the
+        // data mask is the same for every instance, so they can be shared as is
+        static int VM_ShareCompiled(ref VirtMachine vm) {
+            vmModule_t module = vm.module;
+
+            lock (module) {
+                if (module.compiledFunctions == null) {
+                    if (VM_CompileIL(ref vm) != 0)
+                        return -1;
+
+                    module.compiledFunctions = vm.compiledFunctions;
+                }
+            }
+
+            vm.compiledFunctions = module.compiledFunctions;
+
+            return 0;
+        }
+    }
+}
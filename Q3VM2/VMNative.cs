@@ -0,0 +1,848 @@
+﻿using System;
+using System.Runtime.ExceptionServices;
+using System.Runtime.InteropServices;
+
+// x86-64 code generator in the spirit of ioquake3's vm_x86.c, Linux only.
+//
+// Register usage inside generated code:
+//   r12 image (dataBase), r13d programStack, r14 vmNativeContext_t*,
+//   r15 native address of every QVM instruction, rbx top of the op stack.
+// All of them are callee saved in the System V ABI, so they survive calls
+// back into managed code. eax, ecx, edx and xmm0/xmm1 are scratch.
+
+namespace Q3VM2 {
+    [StructLayout(LayoutKind.Sequential)]
+    unsafe struct vmNativeContext_t {
+        public IntPtr savedStack;   // rsp of the entry trampoline, for aborting
+        public int error;           // < 0 vmErrorCode_t, 1 managed exception
+        public int pad;
+        public IntPtr handle;       // GCHandle of the owning vmNativeCode_t
+        public IntPtr callback;     // vmNativeCallback_t
+        public int* opStackTop;
+        public int* opStackLimit;
+        public IntPtr stackLimit;   // rsp OP_ENTER must stay above
+        public byte* dirtyPages;    // vm.dirtyPages
+        public int* targets;        // function start << 8 | op stack depth of every instruction
+    }
+
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    unsafe delegate int vmNativeEntry_t(byte* image, int programStack, vmNativeContext_t* context, IntPtr* instructionTable, int* opStack, IntPtr target);
+
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    unsafe delegate int vmNativeCallback_t(vmNativeContext_t* context, int programStack, int kind, int a, int b, int c);
+
+    unsafe class vmNativeCode_t {
+        public IntPtr code;
+        public int codeSize;
+        public IntPtr* instructionTable;
+        public vmNativeContext_t* context;
+        public int* opStack;
+        public int* targets;
+        public GCHandle handle;
+        public vmNativeEntry_t entry;
+
+        // The VM lives here while native code runs, syscalls get a ref to it
+        public VirtMachine vm;
+        public Exception exception;
+        public int active;
+    }
+
+    // Growable byte buffer with rel32 fixups
+    class vmNativeAssembler_t {
+        public byte[] buffer = new byte[4096];
+        public int length;
+
+        public int[] fixupPos = new int[256];
+        public int[] fixupTarget = new int[256];
+        public int fixupCount;
+
+        public void Emit(params byte[] bytes) {
+            foreach (byte b in bytes)
+                Emit1(b);
+        }
+
+        public void Emit1(byte b) {
+            if (length == buffer.Length)
+                Array.Resize(ref buffer, buffer.Length * 2);
+
+            buffer[length++] = b;
+        }
+
+        public void Emit4(int v) {
+            Emit1((byte)v);
+            Emit1((byte)(v >> 8));
+            Emit1((byte)(v >> 16));
+            Emit1((byte)(v >> 24));
+        }
+
+        // rel32 to be patched by VM_CompileNative once all code is emitted
+        public void EmitRel(int target) {
+            if (fixupCount == fixupPos.Length) {
+                Array.Resize(ref fixupPos, fixupCount * 2);
+                Array.Resize(ref fixupTarget, fixupCount * 2);
+            }
+
+            fixupPos[fixupCount] = length;
+            fixupTarget[fixupCount] = target;
+            fixupCount++;
+            Emit4(0);
+        }
+
+        public void Patch4(int pos, int v) {
+            buffer[pos] = (byte)v;
+            buffer[pos + 1] = (byte)(v >> 8);
+            buffer[pos + 2] = (byte)(v >> 16);
+            buffer[pos + 3] = (byte)(v >> 24);
+        }
+    }
+
+    unsafe static partial class VM {
+
+        // Fixup targets that are not instruction numbers
+        const int VM_NATIVE_ABORT = -1000;
+        const int VM_NATIVE_DIVIDE_BY_ZERO = -1001;
+        const int VM_NATIVE_DIVIDE_OVERFLOW = -1002;
+
+        // Callback kinds
+        const int VM_NATIVE_SYSCALL = 0;
+        const int VM_NATIVE_BLOCK_COPY = 1;
+        const int VM_NATIVE_BREAK = 2;
+        const int VM_NATIVE_DIVIDE = 3;
+        const int VM_NATIVE_OVERFLOW = 4;
+
+        const int VM_NATIVE_OPSTACK_SIZE = 0x4000;
+
+        // Host stack left for the syscalls made from the deepest guest frame
+        const int VM_NATIVE_STACK_RESERVE = 0x20000;
+
+        [ThreadStatic]
+        static IntPtr nativeStackLimit;
+
+        static readonly vmNativeCallback_t nativeCallback = VM_NativeCallback;
+
+        static readonly vmErrorCode_t[] nativeErrorStubs = {
+            vmErrorCode_t.VM_PC_OUT_OF_RANGE,
+            vmErrorCode_t.VM_STACK_OVERFLOW,
+            vmErrorCode_t.VM_BAD_INSTRUCTION,
+        };
+
+        static int VM_CompileNative(ref VirtMachine vm) {
+            if (!Posix.IsLinuxX64) {
+                Warn("VM_CompileNative: only supported on Linux x86-64\n");
+                return -1;
+            }
+
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+            vmNativeAssembler_t asm = new vmNativeAssembler_t();
+            int[] instructionOffsets = new int[code.Length + 1];
+            int[] stubOffsets = new int[nativeErrorStubs.Length];
+            int[] depth = new int[code.Length];
+            int[] targets = new int[code.Length];
+            int divideOffset;
+            int overflowOffset;
+            int abortOffset;
+
+            // targets keeps 24 bits for the function start
+            if (code.Length == 0 || code.Length >= 1 << 24 || code[0].op != opcode_t.OP_ENTER)
+                return -1;
+
+            abortOffset = VM_EmitNativeTrampoline(asm);
+
+            // rbx is a real pointer, so every function has to keep the op stack
+            // shape the IL compiler relies on. Computed jumps and calls are
+            // checked against targets at run time
+            for (int start = 0; start < code.Length;) {
+                int end = start + 1;
+
+                while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                    end++;
+
+                if (VM_FunctionStackDepths(code, start, end, depth) < 0) {
+                    Warn("VM_CompileNative: inconsistent op stack in function at {0}\n", start);
+                    return -1;
+                }
+
+                bool[] jumpTarget = VM_FunctionJumpTargets(code, start, end);
+
+                for (int i = start; i < end; i++) {
+                    instructionOffsets[i] = asm.length;
+                    targets[i] = start << 8 | depth[i];
+
+                    if (VM_EmitNativeInstruction(ref vm, asm, code, depth, jumpTarget, start, end, i) != 0)
+                        return -1;
+                }
+
+                start = end;
+            }
+
+            // Falling off the end of the code
+            instructionOffsets[code.Length] = asm.length;
+            asm.Emit(0xE9);
+            asm.EmitRel((int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+
+            for (int i = 0; i < nativeErrorStubs.Length; i++) {
+                stubOffsets[i] = asm.length;
+                asm.Emit(0x41, 0xC7, 0x46, 0x08);         // mov dword [r14+8], error
+                asm.Emit4((int)nativeErrorStubs[i]);
+                asm.Emit(0xE9);                           // jmp abort
+                asm.EmitRel(VM_NATIVE_ABORT);
+            }
+
+            divideOffset = asm.length;
+            asm.Emit(0xBA);                               // mov edx, VM_NATIVE_DIVIDE
+            asm.Emit4(VM_NATIVE_DIVIDE);
+            VM_EmitNativeCallback(asm);
+            asm.Emit(0xE9);
+            asm.EmitRel(VM_NATIVE_ABORT);
+
+            overflowOffset = asm.length;
+            asm.Emit(0xBA);                               // mov edx, VM_NATIVE_OVERFLOW
+            asm.Emit4(VM_NATIVE_OVERFLOW);
+            VM_EmitNativeCallback(asm);
+            asm.Emit(0xE9);
+            asm.EmitRel(VM_NATIVE_ABORT);
+
+            for (int i = 0; i < asm.fixupCount; i++) {
+                int target = asm.fixupTarget[i];
+                int offset;
+
+                if (target >= 0) {
+                    offset = instructionOffsets[target];
+                } else if (target == VM_NATIVE_ABORT) {
+                    offset = abortOffset;
+                } else if (target == VM_NATIVE_DIVIDE_BY_ZERO) {
+                    offset = divideOffset;
+                } else if (target == VM_NATIVE_DIVIDE_OVERFLOW) {
+                    offset = overflowOffset;
+                } else {
+                    offset = stubOffsets[Array.IndexOf(nativeErrorStubs, (vmErrorCode_t)target)];
+                }
+
+                asm.Patch4(asm.fixupPos[i], offset - (asm.fixupPos[i] + 4));
+            }
+
+            return VM_LoadNativeCode(ref vm, asm, instructionOffsets, targets);
+        }
+
+        // Copies the code into fresh pages and flips them from writable to executable
+        static int VM_LoadNativeCode(ref VirtMachine vm, vmNativeAssembler_t asm, int[] instructionOffsets, int[] targets) {
+            vmNativeCode_t native = new vmNativeCode_t();
+            UIntPtr size = (UIntPtr)(uint)asm.length;
+
+            native.code = Posix.mmap(IntPtr.Zero, size, Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_PRIVATE | Posix.MAP_ANONYMOUS, -1, IntPtr.Zero);
+            if (native.code == Posix.MAP_FAILED) {
+                Warn("VM_CompileNative: mmap failed\n");
+                return -1;
+            }
+
+            native.codeSize = asm.length;
+            Marshal.Copy(asm.buffer, 0, native.code, asm.length);
+
+            if (Posix.mprotect(native.code, size, Posix.PROT_READ | Posix.PROT_EXEC) != 0) {
+                Warn("VM_CompileNative: mprotect failed\n");
+                Posix.munmap(native.code, size);
+                return -1;
+            }
+
+            native.instructionTable = (IntPtr*)Com_malloc((uint)(vm.instructionCount * IntPtr.Size), ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            for (int i = 0; i < vm.instructionCount; i++)
+                native.instructionTable[i] = native.code + instructionOffsets[i];
+
+            native.targets = (int*)Com_malloc((uint)(targets.Length * sizeof(int)), ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            Marshal.Copy(targets, 0, (IntPtr)native.targets, targets.Length);
+
+            native.opStack = (int*)Com_malloc(VM_NATIVE_OPSTACK_SIZE * sizeof(int), ref vm, vmMallocType_t.VM_ALLOC_DEBUG);
+
+            native.context = (vmNativeContext_t*)Com_malloc((uint)sizeof(vmNativeContext_t), ref vm, vmMallocType_t.VM_ALLOC_DEBUG);
+            memset(native.context, 0, (uint)sizeof(vmNativeContext_t));
+            native.context->handle = GCHandle.ToIntPtr(native.handle = GCHandle.Alloc(native));
+            native.context->callback = Marshal.GetFunctionPointerForDelegate(nativeCallback);
+            native.context->opStackLimit = native.opStack + VM_NATIVE_OPSTACK_SIZE - 256;
+            native.context->targets = native.targets;
+
+            native.entry = (vmNativeEntry_t)Marshal.GetDelegateForFunctionPointer(native.code, typeof(vmNativeEntry_t));
+
+            vm.nativeCode = native;
+            return 0;
+        }
+
+        static void VM_FreeNativeCode(ref VirtMachine vm) {
+            vmNativeCode_t native = vm.nativeCode;
+
+            if (native == null)
+                return;
+
+            Posix.munmap(native.code, (UIntPtr)(uint)native.codeSize);
+            Com_free(native.instructionTable, ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            Com_free(native.targets, ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            Com_free(native.opStack, ref vm, vmMallocType_t.VM_ALLOC_DEBUG);
+            Com_free(native.context, ref vm, vmMallocType_t.VM_ALLOC_DEBUG);
+            native.handle.Free();
+
+            vm.nativeCode = null;
+        }
+
+        // int entry(image, programStack, context, instructionTable, opStack, target)
+        // Returns the offset of the abort label
+        static int VM_EmitNativeTrampoline(vmNativeAssembler_t asm) {
+            int exit;
+            int abort;
+
+            asm.Emit(0x53);                   // push rbx
+            asm.Emit(0x55);                   // push rbp
+            asm.Emit(0x41, 0x54);             // push r12
+            asm.Emit(0x41, 0x55);             // push r13
+            asm.Emit(0x41, 0x56);             // push r14
+            asm.Emit(0x41, 0x57);             // push r15
+            asm.Emit(0x48, 0x83, 0xEC, 0x08); // sub rsp, 8
+            asm.Emit(0x49, 0x89, 0xFC);       // mov r12, rdi
+            asm.Emit(0x41, 0x89, 0xF5);       // mov r13d, esi
+            asm.Emit(0x49, 0x89, 0xD6);       // mov r14, rdx
+            asm.Emit(0x49, 0x89, 0xCF);       // mov r15, rcx
+            asm.Emit(0x4C, 0x89, 0xC3);       // mov rbx, r8
+            asm.Emit(0x49, 0x89, 0x26);       // mov [r14], rsp
+            asm.Emit(0x41, 0xFF, 0xD1);       // call r9
+            asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+
+            exit = asm.length;
+            asm.Emit(0x49, 0x89, 0x5E, 0x20); // mov [r14+32], rbx
+            asm.Emit(0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+            asm.Emit(0x41, 0x5F);             // pop r15
+            asm.Emit(0x41, 0x5E);             // pop r14
+            asm.Emit(0x41, 0x5D);             // pop r13
+            asm.Emit(0x41, 0x5C);             // pop r12
+            asm.Emit(0x5D);                   // pop rbp
+            asm.Emit(0x5B);                   // pop rbx
+            asm.Emit(0xC3);                   // ret
+
+            abort = asm.length;
+            asm.Emit(0x49, 0x8B, 0x26);       // mov rsp, [r14]
+            asm.Emit(0xB8);                   // mov eax, -1
+            asm.Emit4(-1);
+            asm.Emit(0xEB, (byte)(exit - (asm.length + 2))); // jmp exit
+
+            return abort;
+        }
+
+        // Calls vmNativeCallback_t with edx, ecx, r8d, r9d already loaded and
+        // leaves its result in eax. The stack is realigned through rbp
+        static void VM_EmitNativeCallback(vmNativeAssembler_t asm) {
+            asm.Emit(0x49, 0x89, 0x5E, 0x20); // mov [r14+32], rbx
+            asm.Emit(0x4C, 0x89, 0xF7);       // mov rdi, r14
+            asm.Emit(0x44, 0x89, 0xEE);       // mov esi, r13d
+            asm.Emit(0x48, 0x89, 0xE5);       // mov rbp, rsp
+            asm.Emit(0x48, 0x83, 0xE4, 0xF0); // and rsp, -16
+            asm.Emit(0x41, 0xFF, 0x56, 0x18); // call [r14+24]
+            asm.Emit(0x48, 0x89, 0xEC);       // mov rsp, rbp
+            asm.Emit(0x41, 0x83, 0x7E, 0x08, 0x00); // cmp dword [r14+8], 0
+            asm.Emit(0x0F, 0x85);             // jne abort
+            asm.EmitRel(VM_NATIVE_ABORT);
+        }
+
+        static void VM_EmitNativeDataMask(vmNativeAssembler_t asm, byte modrm, int dataMask) {
+            if (modrm == 0xE0) {
+                asm.Emit(0x25);               // and eax, dataMask
+            } else {
+                asm.Emit(0x81, modrm);        // and ecx, dataMask
+            }
+            asm.Emit4(dataMask);
+        }
+
+        static int VM_EmitNativeInstruction(ref VirtMachine vm, vmNativeAssembler_t asm, vmInstruction_t[] code, int[] depth, bool[] jumpTarget, int start, int end, int i) {
+            int v = code[i].value;
+            int d = depth[i];
+            int dataMask = vm.dataMask;
+
+            // The operand of a preceding OP_CONST, when control can only come from there
+            bool constTarget = i > start && code[i - 1].op == opcode_t.OP_CONST && !jumpTarget[i - start];
+            int target = constTarget ? code[i - 1].value : 0;
+
+            switch (code[i].op) {
+                case opcode_t.OP_UNDEF:
+                    asm.Emit(0xE9);
+                    asm.EmitRel((int)vmErrorCode_t.VM_BAD_INSTRUCTION);
+                    break;
+
+                case opcode_t.OP_IGNORE:
+                    break;
+
+                case opcode_t.OP_BREAK:
+                    asm.Emit(0xBA);
+                    asm.Emit4(VM_NATIVE_BREAK);
+                    VM_EmitNativeCallback(asm);
+                    break;
+
+                case opcode_t.OP_ENTER:
+                    asm.Emit(0x41, 0x81, 0xED);       // sub r13d, v
+                    asm.Emit4(v);
+                    asm.Emit(0x41, 0x81, 0xFD);       // cmp r13d, stackBottom
+                    asm.Emit4(vm.dataMask + 1 - vm.module.stackSize);
+                    asm.Emit(0x0F, 0x8C);             // jl overflow
+                    asm.EmitRel((int)vmErrorCode_t.VM_STACK_OVERFLOW);
+                    asm.Emit(0x49, 0x3B, 0x5E, 0x28); // cmp rbx, [r14+40]
+                    asm.Emit(0x0F, 0x83);             // jae overflow
+                    asm.EmitRel((int)vmErrorCode_t.VM_STACK_OVERFLOW);
+
+                    // Guest calls are machine calls, small frames or a big
+                    // vm_stackSize run out of host stack first
+                    asm.Emit(0x49, 0x3B, 0x66, 0x30); // cmp rsp, [r14+48]
+                    asm.Emit(0x0F, 0x82);             // jb overflow
+                    asm.EmitRel((int)vmErrorCode_t.VM_STACK_OVERFLOW);
+                    break;
+
+                case opcode_t.OP_LEAVE:
+                    asm.Emit(0x41, 0x81, 0xC5);       // add r13d, v
+                    asm.Emit4(v);
+                    asm.Emit(0xC3);                   // ret
+                    break;
+
+                case opcode_t.OP_CONST:
+                    asm.Emit(0x48, 0x83, 0xC3, 0x04); // add rbx, 4
+                    asm.Emit(0xC7, 0x03);             // mov dword [rbx], v
+                    asm.Emit4(v);
+                    break;
+
+                case opcode_t.OP_LOCAL:
+                    asm.Emit(0x48, 0x83, 0xC3, 0x04); // add rbx, 4
+                    asm.Emit(0x41, 0x8D, 0x85);       // lea eax, [r13+v]
+                    asm.Emit4(v);
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_LOAD4:
+                case opcode_t.OP_LOAD2:
+                case opcode_t.OP_LOAD1:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    VM_EmitNativeDataMask(asm, 0xE0, dataMask);
+                    if (code[i].op == opcode_t.OP_LOAD4)
+                        asm.Emit(0x41, 0x8B, 0x04, 0x04);       // mov eax, [r12+rax]
+                    else if (code[i].op == opcode_t.OP_LOAD2)
+                        asm.Emit(0x41, 0x0F, 0xB7, 0x04, 0x04); // movzx eax, word [r12+rax]
+                    else
+                        asm.Emit(0x41, 0x0F, 0xB6, 0x04, 0x04); // movzx eax, byte [r12+rax]
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_STORE4:
+                case opcode_t.OP_STORE2:
+                case opcode_t.OP_STORE1:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x8B, 0x4B, 0xFC);       // mov ecx, [rbx-4]
+                    VM_EmitNativeDataMask(asm, 0xE1, dataMask);
+                    if (code[i].op == opcode_t.OP_STORE4)
+                        asm.Emit(0x41, 0x89, 0x04, 0x0C);       // mov [r12+rcx], eax
+                    else if (code[i].op == opcode_t.OP_STORE2)
+                        asm.Emit(0x66, 0x41, 0x89, 0x04, 0x0C); // mov [r12+rcx], ax
+                    else
+                        asm.Emit(0x41, 0x88, 0x04, 0x0C);       // mov [r12+rcx], al
+
+                    // The page of the last byte too, an unaligned store can
+                    // straddle two
+                    asm.Emit(0x8D, 0x51, code[i].op == opcode_t.OP_STORE4 ? (byte)3 : code[i].op == opcode_t.OP_STORE2 ? (byte)1 : (byte)0); // lea edx, [rcx+size-1]
+                    asm.Emit(0xC1, 0xE9, VM_DIRTY_SHIFT);       // shr ecx, VM_DIRTY_SHIFT
+                    asm.Emit(0xC1, 0xEA, VM_DIRTY_SHIFT);       // shr edx, VM_DIRTY_SHIFT
+                    asm.Emit(0x49, 0x8B, 0x46, 0x38);           // mov rax, [r14+56]
+                    asm.Emit(0xC6, 0x04, 0x08, 0x01);           // mov byte [rax+rcx], 1
+                    asm.Emit(0xC6, 0x04, 0x10, 0x01);           // mov byte [rax+rdx], 1
+                    asm.Emit(0x48, 0x83, 0xEB, 0x08); // sub rbx, 8
+                    break;
+
+                case opcode_t.OP_ARG:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x41, 0x8D, 0x8D);       // lea ecx, [r13+v]
+                    asm.Emit4(v);
+                    VM_EmitNativeDataMask(asm, 0xE1, dataMask);
+                    asm.Emit(0x41, 0x89, 0x04, 0x0C); // mov [r12+rcx], eax
+                    break;
+
+                case opcode_t.OP_BLOCK_COPY:
+                    asm.Emit(0x8B, 0x4B, 0xFC);       // mov ecx, [rbx-4]
+                    asm.Emit(0x44, 0x8B, 0x03);       // mov r8d, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x08); // sub rbx, 8
+                    asm.Emit(0x41, 0xB9);             // mov r9d, v
+                    asm.Emit4(v);
+                    asm.Emit(0xBA);                   // mov edx, VM_NATIVE_BLOCK_COPY
+                    asm.Emit4(VM_NATIVE_BLOCK_COPY);
+                    VM_EmitNativeCallback(asm);
+                    break;
+
+                case opcode_t.OP_CALL:
+                    if (constTarget && target >= 0 && target < code.Length && code[target].op == opcode_t.OP_ENTER) {
+                        asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                        asm.Emit(0xE8);                   // call target
+                        asm.EmitRel(target);
+                        break;
+                    }
+
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x85, 0xC0);             // test eax, eax
+                    asm.Emit(0x7C, 0x26);             // jl syscall
+                    asm.Emit(0x3D);                   // cmp eax, instructionCount
+                    asm.Emit4(code.Length);
+                    asm.Emit(0x0F, 0x83);             // jae bad
+                    asm.EmitRel((int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+
+                    // Only the start of a function, targets[eax] == eax << 8
+                    asm.Emit(0x49, 0x8B, 0x4E, 0x40); // mov rcx, [r14+64]
+                    asm.Emit(0x89, 0xC2);             // mov edx, eax
+                    asm.Emit(0xC1, 0xE2, 0x08);       // shl edx, 8
+                    asm.Emit(0x39, 0x14, 0x81);       // cmp [rcx+rax*4], edx
+                    asm.Emit(0x0F, 0x85);             // jne bad
+                    asm.EmitRel((int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+                    asm.Emit(0x41, 0xFF, 0x14, 0xC7); // call [r15+rax*8]
+                    asm.Emit(0xE9);                   // jmp next
+                    asm.EmitRel(i + 1);
+
+                    // syscall: the callback result is pushed like a return value
+                    asm.Emit(0x89, 0xC1);             // mov ecx, eax
+                    asm.Emit(0xBA);                   // mov edx, VM_NATIVE_SYSCALL
+                    asm.Emit4(VM_NATIVE_SYSCALL);
+                    VM_EmitNativeCallback(asm);
+                    asm.Emit(0x48, 0x83, 0xC3, 0x04); // add rbx, 4
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_PUSH:
+                    asm.Emit(0x48, 0x83, 0xC3, 0x04); // add rbx, 4
+                    break;
+
+                case opcode_t.OP_POP:
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    break;
+
+                case opcode_t.OP_JUMP:
+                    if (constTarget && target >= start && target < end && depth[target] == d - 1) {
+                        asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                        asm.Emit(0xE9);                   // jmp target
+                        asm.EmitRel(target);
+                        break;
+                    }
+
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x3D);                   // cmp eax, instructionCount
+                    asm.Emit4(code.Length);
+                    asm.Emit(0x0F, 0x83);             // jae bad
+                    asm.EmitRel((int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+
+                    // Only inside this function on the same op stack depth
+                    asm.Emit(0x49, 0x8B, 0x4E, 0x40); // mov rcx, [r14+64]
+                    asm.Emit(0x81, 0x3C, 0x81);       // cmp dword [rcx+rax*4], start << 8 | depth
+                    asm.Emit4(start << 8 | (d - 1));
+                    asm.Emit(0x0F, 0x85);             // jne bad
+                    asm.EmitRel((int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+                    asm.Emit(0x41, 0xFF, 0x24, 0xC7); // jmp [r15+rax*8]
+                    break;
+
+                case opcode_t.OP_EQ:
+                case opcode_t.OP_NE:
+                case opcode_t.OP_LTI:
+                case opcode_t.OP_LEI:
+                case opcode_t.OP_GTI:
+                case opcode_t.OP_GEI:
+                case opcode_t.OP_LTU:
+                case opcode_t.OP_LEU:
+                case opcode_t.OP_GTU:
+                case opcode_t.OP_GEU:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x8B, 0x4B, 0xFC);       // mov ecx, [rbx-4]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x08); // sub rbx, 8
+                    asm.Emit(0x39, 0xC1);             // cmp ecx, eax
+                    asm.Emit(0x0F, VM_NativeJcc(code[i].op));
+                    asm.EmitRel(v);
+                    break;
+
+                case opcode_t.OP_EQF:
+                case opcode_t.OP_NEF:
+                case opcode_t.OP_LTF:
+                case opcode_t.OP_LEF:
+                case opcode_t.OP_GTF:
+                case opcode_t.OP_GEF:
+                    asm.Emit(0xF3, 0x0F, 0x10, 0x43, 0xFC); // movss xmm0, [rbx-4]
+                    asm.Emit(0xF3, 0x0F, 0x10, 0x0B);       // movss xmm1, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x08);       // sub rbx, 8
+
+                    // Unordered compares set ZF, PF and CF, so only ja/jae are NaN safe
+                    // and the less-than forms swap their operands
+                    if (code[i].op == opcode_t.OP_LTF || code[i].op == opcode_t.OP_LEF)
+                        asm.Emit(0x0F, 0x2E, 0xC8);         // ucomiss xmm1, xmm0
+                    else
+                        asm.Emit(0x0F, 0x2E, 0xC1);         // ucomiss xmm0, xmm1
+
+                    if (code[i].op == opcode_t.OP_EQF) {
+                        asm.Emit(0x7A, 0x06);               // jp skip
+                        asm.Emit(0x0F, 0x84);               // je target
+                    } else if (code[i].op == opcode_t.OP_NEF) {
+                        asm.Emit(0x0F, 0x8A);               // jp target
+                        asm.EmitRel(v);
+                        asm.Emit(0x0F, 0x85);               // jne target
+                    } else if (code[i].op == opcode_t.OP_LTF || code[i].op == opcode_t.OP_GTF) {
+                        asm.Emit(0x0F, 0x87);               // ja target
+                    } else {
+                        asm.Emit(0x0F, 0x83);               // jae target
+                    }
+                    asm.EmitRel(v);
+                    break;
+
+                case opcode_t.OP_NEGI:
+                    asm.Emit(0xF7, 0x1B);             // neg dword [rbx]
+                    break;
+
+                case opcode_t.OP_BCOM:
+                    asm.Emit(0xF7, 0x13);             // not dword [rbx]
+                    break;
+
+                case opcode_t.OP_ADD:
+                case opcode_t.OP_SUB:
+                case opcode_t.OP_BAND:
+                case opcode_t.OP_BOR:
+                case opcode_t.OP_BXOR:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(VM_NativeAluOp(code[i].op), 0x03); // op [rbx], eax
+                    break;
+
+                case opcode_t.OP_MULI:
+                case opcode_t.OP_MULU:
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x0F, 0xAF, 0x03);       // imul eax, [rbx]
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_DIVI:
+                case opcode_t.OP_MODI:
+                    asm.Emit(0x8B, 0x0B);             // mov ecx, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x85, 0xC9);             // test ecx, ecx
+                    asm.Emit(0x0F, 0x84);             // jz divide by zero
+                    asm.EmitRel(VM_NATIVE_DIVIDE_BY_ZERO);
+
+                    // INT_MIN / -1 faults in idiv, it raises the same overflow
+                    // as in the interpreter
+                    asm.Emit(0x83, 0xF9, 0xFF);       // cmp ecx, -1
+                    asm.Emit(0x75, 0x0B);             // jne divide
+                    asm.Emit(0x3D);                   // cmp eax, INT_MIN
+                    asm.Emit4(int.MinValue);
+                    asm.Emit(0x0F, 0x84);             // je overflow
+                    asm.EmitRel(VM_NATIVE_DIVIDE_OVERFLOW);
+                    asm.Emit(0x99);                   // cdq
+                    asm.Emit(0xF7, 0xF9);             // idiv ecx
+                    asm.Emit(0x89, code[i].op == opcode_t.OP_DIVI ? (byte)0x03 : (byte)0x13); // mov [rbx], eax / edx
+                    break;
+
+                case opcode_t.OP_DIVU:
+                case opcode_t.OP_MODU:
+                    asm.Emit(0x8B, 0x0B);             // mov ecx, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    asm.Emit(0x8B, 0x03);             // mov eax, [rbx]
+                    asm.Emit(0x85, 0xC9);             // test ecx, ecx
+                    asm.Emit(0x0F, 0x84);             // jz divide by zero
+                    asm.EmitRel(VM_NATIVE_DIVIDE_BY_ZERO);
+                    asm.Emit(0x31, 0xD2);             // xor edx, edx
+                    asm.Emit(0xF7, 0xF1);             // div ecx
+                    asm.Emit(0x89, code[i].op == opcode_t.OP_DIVU ? (byte)0x03 : (byte)0x13); // mov [rbx], eax / edx
+                    break;
+
+                case opcode_t.OP_LSH:
+                case opcode_t.OP_RSHI:
+                case opcode_t.OP_RSHU:
+                    asm.Emit(0x8B, 0x0B);             // mov ecx, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04); // sub rbx, 4
+                    // shl / sar / shr dword [rbx], cl
+                    asm.Emit(0xD3, code[i].op == opcode_t.OP_LSH ? (byte)0x23 : code[i].op == opcode_t.OP_RSHI ? (byte)0x3B : (byte)0x2B);
+                    break;
+
+                case opcode_t.OP_NEGF:
+                    asm.Emit(0x81, 0x33);             // xor dword [rbx], 0x80000000
+                    asm.Emit4(unchecked((int)0x80000000));
+                    break;
+
+                case opcode_t.OP_ADDF:
+                case opcode_t.OP_SUBF:
+                case opcode_t.OP_DIVF:
+                case opcode_t.OP_MULF:
+                    asm.Emit(0xF3, 0x0F, 0x10, 0x43, 0xFC); // movss xmm0, [rbx-4]
+                    asm.Emit(0xF3, 0x0F, VM_NativeSseOp(code[i].op), 0x03); // op xmm0, [rbx]
+                    asm.Emit(0x48, 0x83, 0xEB, 0x04);       // sub rbx, 4
+                    asm.Emit(0xF3, 0x0F, 0x11, 0x03);       // movss [rbx], xmm0
+                    break;
+
+                case opcode_t.OP_CVIF:
+                    asm.Emit(0xF3, 0x0F, 0x2A, 0x03); // cvtsi2ss xmm0, dword [rbx]
+                    asm.Emit(0xF3, 0x0F, 0x11, 0x03); // movss [rbx], xmm0
+                    break;
+
+                case opcode_t.OP_CVFI:
+                    asm.Emit(0xF3, 0x48, 0x0F, 0x2C, 0x03); // cvttss2si rax, dword [rbx]
+                    asm.Emit(0x89, 0x03);                   // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_SEX8:
+                    asm.Emit(0x0F, 0xBE, 0x03);       // movsx eax, byte [rbx]
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                case opcode_t.OP_SEX16:
+                    asm.Emit(0x0F, 0xBF, 0x03);       // movsx eax, word [rbx]
+                    asm.Emit(0x89, 0x03);             // mov [rbx], eax
+                    break;
+
+                default:
+                    Warn("VM_CompileNative: bad instruction {0} at {1}\n", code[i].op, i);
+                    return -1;
+            }
+
+            return 0;
+        }
+
+        static byte VM_NativeJcc(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_EQ: return 0x84;  // je
+                case opcode_t.OP_NE: return 0x85;  // jne
+                case opcode_t.OP_LTI: return 0x8C; // jl
+                case opcode_t.OP_LEI: return 0x8E; // jle
+                case opcode_t.OP_GTI: return 0x8F; // jg
+                case opcode_t.OP_GEI: return 0x8D; // jge
+                case opcode_t.OP_LTU: return 0x82; // jb
+                case opcode_t.OP_LEU: return 0x86; // jbe
+                case opcode_t.OP_GTU: return 0x87; // ja
+                default: return 0x83;              // jae
+            }
+        }
+
+        static byte VM_NativeAluOp(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_ADD: return 0x01;
+                case opcode_t.OP_SUB: return 0x29;
+                case opcode_t.OP_BAND: return 0x21;
+                case opcode_t.OP_BOR: return 0x09;
+                default: return 0x31;
+            }
+        }
+
+        static byte VM_NativeSseOp(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_ADDF: return 0x58;
+                case opcode_t.OP_SUBF: return 0x5C;
+                case opcode_t.OP_DIVF: return 0x5E;
+                default: return 0x59;
+            }
+        }
+
+        // Exceptions must not unwind through native frames, they are parked in
+        // the vmNativeCode_t and rethrown once the trampoline has returned
+        static int VM_NativeCallback(vmNativeContext_t* context, int programStack, int kind, int a, int b, int c) {
+            vmNativeCode_t native = (vmNativeCode_t)GCHandle.FromIntPtr(context->handle).Target;
+
+            try {
+                switch (kind) {
+                    case VM_NATIVE_SYSCALL:
+                        return VM_SystemCall(ref native.vm, native.vm.dataBase, programStack, a);
+
+                    case VM_NATIVE_BLOCK_COPY:
+                        VM_BlockCopy((uint)a, (uint)b, (uint)c, ref native.vm);
+                        return 0;
+
+                    case VM_NATIVE_BREAK:
+                        native.vm.breakCount++;
+                        return 0;
+
+                    case VM_NATIVE_OVERFLOW:
+                        throw new OverflowException();
+
+                    default:
+                        throw new DivideByZeroException();
+                }
+            } catch (Exception E) {
+                native.exception = E;
+                context->error = 1;
+                return -1;
+            }
+        }
+
+        // The bottom of the stack of the calling thread plus the reserve, 0
+        // when it cannot be found out
+        static IntPtr VM_NativeStackLimit() {
+            if (nativeStackLimit == IntPtr.Zero) {
+                byte* attr = stackalloc byte[Posix.PTHREAD_ATTR_SIZE];
+                IntPtr stackAddr;
+                UIntPtr stackSize;
+
+                if (Posix.pthread_getattr_np(Posix.pthread_self(), attr) != 0)
+                    return IntPtr.Zero;
+
+                if (Posix.pthread_attr_getstack(attr, out stackAddr, out stackSize) == 0)
+                    nativeStackLimit = stackAddr + VM_NATIVE_STACK_RESERVE;
+
+                Posix.pthread_attr_destroy(attr);
+            }
+
+            return nativeStackLimit;
+        }
+
+        static int VM_CallNative(ref VirtMachine vm, int function, int* args) {
+            vmNativeCode_t native = vm.nativeCode;
+            vmNativeContext_t* context = native.context;
+            vmNativeContext_t saved = *context;
+            int programStack;
+            int stackOnEntry;
+            byte* image;
+            int* opStack;
+            int* opStackTop;
+            int error;
+            int r;
+
+            programStack = stackOnEntry = vm.programStack;
+            image = vm.dataBase;
+
+            programStack -= (8 + 4 * 13);
+
+            for (int arg = 0; arg < 13; arg++) {
+                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+            }
+
+            *(int*)&image[programStack + 4] = 0;
+            *(int*)&image[programStack] = -1;
+
+            // Calls made from inside a syscall continue above the caller's op stack
+            opStack = native.active != 0 ? context->opStackTop + 1 : native.opStack;
+            *opStack = 0x0000BEEF;
+
+            native.vm = vm;
+            native.active++;
+            context->error = 0;
+            context->stackLimit = VM_NativeStackLimit();
+            context->dirtyPages = vm.dirtyPages;
+
+            r = native.entry(image, programStack, context, native.instructionTable, opStack, native.instructionTable[function]);
+
+            native.active--;
+            error = context->error;
+            opStackTop = context->opStackTop;
+
+            vm = native.vm;
+            vm.programStack = stackOnEntry;
+
+            context->savedStack = saved.savedStack;
+            context->opStackTop = saved.opStackTop;
+            context->error = saved.error;
+            context->stackLimit = saved.stackLimit;
+
+            if (error == 1) {
+                Exception E = native.exception;
+                native.exception = null;
+                ExceptionDispatchInfo.Capture(E).Throw();
+            } else if (error != 0) {
+                Com_Error(vm.lastError = (vmErrorCode_t)error, "Native code error");
+            } else if (opStackTop != opStack + 1 || *opStack != 0x0000BEEF) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_ERROR, "Interpreter stack error");
+            }
+
+            return r;
+        }
+    }
+}
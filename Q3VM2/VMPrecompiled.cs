@@ -0,0 +1,475 @@
+﻿using System;
+using System.CodeDom.Compiler;
+using System.IO;
+using System.Reflection;
+using System.Security.Cryptography;
+using System.Text;
+using Microsoft.CSharp;
+
+// Ahead-of-time translation of a QVM into C# source, one static method per
+// QVM function, compiled once into an assembly named after VM_ModuleHash, the
+// SHA-256 of the decoded code and the initial data. VM_Create binds to a
+// matching assembly found in vm_precompiledPath, so no code is generated at
+// runtime at all.
+//
+// The generated code only depends on mscorlib. Everything it cannot do on its
+// own goes through a trap delegate: trap(kind, a, b, c)
+
+namespace Q3VM2 {
+    unsafe delegate int vmPrecompiledFunc_t(int target, byte* image, byte* dirty, int programStack, Func<int, int, int, int, int> trap);
+
+    class vmPrecompiledCode_t {
+        public vmPrecompiledFunc_t call;
+        public Func<int, int, int, int, int> trap;
+
+        // The VM lives here while precompiled code runs, traps get a ref to it
+        public VirtMachine vm;
+    }
+
+    unsafe static partial class VM {
+
+        // Directory holding precompiled <hash>.dll files, null disables the lookup
+        public static string vm_precompiledPath = null;
+
+        // Bumped whenever generated code changes, older assemblies are ignored
+        const int VM_PRECOMPILED_VERSION = 4;
+
+        const int VM_TRAP_SYSCALL = 0;
+        const int VM_TRAP_BLOCK_COPY = 1;
+        const int VM_TRAP_ERROR = 2;
+        const int VM_TRAP_BREAK = 3;
+
+        static string VM_BytecodeHash(byte* bytecode, int length) {
+            StringBuilder sb = new StringBuilder();
+
+            using (SHA256 sha = SHA256.Create())
+            using (UnmanagedMemoryStream stream = new UnmanagedMemoryStream(bytecode, length)) {
+                foreach (byte b in sha.ComputeHash(stream))
+                    sb.Append(b.ToString("x2"));
+            }
+
+            return sb.ToString();
+        }
+
+        static string VM_PrecompiledClass(string hash) {
+            return "QVM_" + hash;
+        }
+
+        // Offline tool entry point, writes <hash>.cs and <hash>.dll into path
+        public static bool VM_Precompile(string Name, byte[] Bytecode, string path) {
+            VirtMachine vm = new VirtMachine();
+            string hash;
+            string source;
+
+            if (!VM_Create(ref vm, Name, Bytecode, VM_PrecompileSystemCall))
+                return false;
+
+            hash = VM_ModuleHash(vm.module);
+
+            source = VM_Transpile(ref vm, hash);
+            VM_Free(ref vm);
+
+            if (source == null)
+                return false;
+
+            Directory.CreateDirectory(path);
+            File.WriteAllText(Path.Combine(path, hash + ".cs"), source);
+
+            using (CSharpCodeProvider provider = new CSharpCodeProvider()) {
+                CompilerParameters options = new CompilerParameters();
+                options.GenerateExecutable = false;
+                options.GenerateInMemory = false;
+                options.OutputAssembly = Path.Combine(path, hash + ".dll");
+                options.CompilerOptions = "/unsafe /optimize+";
+
+                CompilerResults results = provider.CompileAssemblyFromSource(options, source);
+
+                if (results.Errors.HasErrors) {
+                    foreach (CompilerError error in results.Errors)
+                        Warn("{0}\n", error);
+
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        static IntPtr VM_PrecompileSystemCall(ref VirtMachine vm, params IntPtr[] args) {
+            throw new InvalidOperationException("Precompiling VMs do not run");
+        }
+
+        static string VM_Transpile(ref VirtMachine vm, string hash) {
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+            int[] depth = new int[code.Length];
+            StringBuilder sb = new StringBuilder();
+            StringBuilder call = new StringBuilder();
+
+            if (code.Length == 0 || code[0].op != opcode_t.OP_ENTER)
+                return null;
+
+            sb.AppendFormat("// Generated by Q3VM2 from {0}, do not edit\n", vm.Name);
+            sb.Append("#pragma warning disable 162, 164, 168, 219\n");
+            sb.Append("using System;\n\n");
+            sb.Append("namespace Q3VM2.Precompiled {\n");
+            sb.AppendFormat("    public static unsafe class {0} {{\n", VM_PrecompiledClass(hash));
+            sb.AppendFormat("        public const string Hash = \"{0}\";\n", hash);
+            sb.AppendFormat("        public const int DataMask = {0};\n", vm.dataMask);
+            sb.AppendFormat("        public const int AccessMask = {0};\n", VM_AccessMask(ref vm));
+            sb.AppendFormat("        public const int StackSize = {0};\n", vm.module.stackSize);
+            sb.AppendFormat("        public const int Version = {0};\n\n", VM_PRECOMPILED_VERSION);
+            sb.Append("        static float F(int i) { return *(float*)&i; }\n");
+            sb.Append("        static int I(float f) { return *(int*)&f; }\n");
+
+            call.Append("\n        public static int Call(int target, byte* image, byte* dirty, int programStack, Func<int, int, int, int, int> trap) {\n");
+            call.Append("            switch (target) {\n");
+
+            for (int start = 0; start < code.Length;) {
+                int end = start + 1;
+
+                while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                    end++;
+
+                int maxDepth = VM_FunctionStackDepths(code, start, end, depth);
+
+                if (maxDepth < 0) {
+                    Warn("VM_Transpile: inconsistent op stack in function at {0}\n", start);
+                    return null;
+                }
+
+                if (VM_TranspileFunction(ref vm, sb, code, depth, maxDepth, start, end) != 0)
+                    return null;
+
+                call.AppendFormat("                case {0}: return F_{0}(image, dirty, programStack, trap);\n", start);
+                start = end;
+            }
+
+            call.Append("            }\n\n");
+            call.AppendFormat("            if (target < 0) return trap({0}, programStack, target, 0);\n", VM_TRAP_SYSCALL);
+            call.AppendFormat("            return trap({0}, {1}, 0, 0);\n", VM_TRAP_ERROR, (int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+            call.Append("        }\n");
+
+            sb.Append(call);
+            sb.Append("    }\n}\n");
+
+            return sb.ToString();
+        }
+
+        // Guarded data segments take the address as is, see VMGuard.cs
+        static string VM_TranspileAddress(string address, int accessMask) {
+            if (accessMask == -1)
+                return address;
+
+            return "(" + address + " & " + accessMask + ")";
+        }
+
+        static int VM_TranspileFunction(ref VirtMachine vm, StringBuilder sb, vmInstruction_t[] code, int[] depth, int maxDepth, int start, int end) {
+            bool[] jumpTarget = VM_FunctionJumpTargets(code, start, end);
+            int accessMask = VM_AccessMask(ref vm);
+            int stackBottom = vm.dataMask + 1 - vm.module.stackSize;
+
+            sb.AppendFormat("\n        static int F_{0}(byte* image, byte* dirty, int programStack, Func<int, int, int, int, int> trap) {{\n", start);
+
+            for (int s = 0; s <= maxDepth; s++)
+                sb.AppendFormat("            int s{0} = 0;\n", s);
+
+            for (int i = start; i < end; i++) {
+                int d = depth[i];
+                int v = code[i].value;
+                string r0 = "s" + (d - 1);
+                string r1 = "s" + (d - 2);
+                bool constTarget = i > start && code[i - 1].op == opcode_t.OP_CONST && !jumpTarget[i - start];
+                int target = constTarget ? code[i - 1].value : 0;
+
+                sb.AppendFormat("        L{0}: ", i);
+
+                switch (code[i].op) {
+                    case opcode_t.OP_UNDEF:
+                        sb.AppendFormat("return trap({0}, {1}, 0, 0);\n", VM_TRAP_ERROR, (int)vmErrorCode_t.VM_BAD_INSTRUCTION);
+                        break;
+
+                    case opcode_t.OP_IGNORE:
+                    case opcode_t.OP_PUSH:
+                    case opcode_t.OP_POP:
+                        sb.Append(";\n");
+                        break;
+
+                    case opcode_t.OP_BREAK:
+                        sb.AppendFormat("trap({0}, 0, 0, 0);\n", VM_TRAP_BREAK);
+                        break;
+
+                    case opcode_t.OP_ENTER:
+                        sb.AppendFormat("programStack -= {0}; if (programStack < {1}) return trap({2}, {3}, 0, 0);\n", v, stackBottom, VM_TRAP_ERROR, (int)vmErrorCode_t.VM_STACK_OVERFLOW);
+                        break;
+
+                    case opcode_t.OP_LEAVE:
+                        sb.AppendFormat("return {0};\n", r0);
+                        break;
+
+                    case opcode_t.OP_CONST:
+                        sb.AppendFormat("s{0} = {1};\n", d, v);
+                        break;
+
+                    case opcode_t.OP_LOCAL:
+                        sb.AppendFormat("s{0} = programStack + {1};\n", d, v);
+                        break;
+
+                    case opcode_t.OP_LOAD4:
+                        sb.AppendFormat("{0} = *(int*)(image + {1});\n", r0, VM_TranspileAddress(r0, accessMask));
+                        break;
+
+                    case opcode_t.OP_LOAD2:
+                        sb.AppendFormat("{0} = *(ushort*)(image + {1});\n", r0, VM_TranspileAddress(r0, accessMask));
+                        break;
+
+                    case opcode_t.OP_LOAD1:
+                        sb.AppendFormat("{0} = image[{1}];\n", r0, VM_TranspileAddress(r0, accessMask));
+                        break;
+
+                    case opcode_t.OP_STORE4:
+                        sb.AppendFormat("*(int*)(image + {0}) = {1}; dirty[{0} >> {2}] = 1; dirty[({0} + 3) >> {2}] = 1;\n", VM_TranspileAddress(r1, accessMask), r0, VM_DIRTY_SHIFT);
+                        break;
+
+                    case opcode_t.OP_STORE2:
+                        sb.AppendFormat("*(short*)(image + {0}) = (short){1}; dirty[{0} >> {2}] = 1; dirty[({0} + 1) >> {2}] = 1;\n", VM_TranspileAddress(r1, accessMask), r0, VM_DIRTY_SHIFT);
+                        break;
+
+                    case opcode_t.OP_STORE1:
+                        sb.AppendFormat("image[{0}] = (byte){1}; dirty[{0} >> {2}] = 1;\n", VM_TranspileAddress(r1, accessMask), r0, VM_DIRTY_SHIFT);
+                        break;
+
+                    case opcode_t.OP_ARG:
+                        sb.AppendFormat("*(int*)(image + {0}) = {1};\n", VM_TranspileAddress("(programStack + " + v + ")", accessMask), r0);
+                        break;
+
+                    case opcode_t.OP_BLOCK_COPY:
+                        sb.AppendFormat("trap({0}, {1}, {2}, {3});\n", VM_TRAP_BLOCK_COPY, r1, r0, v);
+                        break;
+
+                    case opcode_t.OP_CALL:
+                        if (constTarget && target < 0)
+                            sb.AppendFormat("{0} = trap({1}, programStack, {2}, 0);\n", r0, VM_TRAP_SYSCALL, target);
+                        else if (constTarget && target < code.Length && code[target].op == opcode_t.OP_ENTER)
+                            sb.AppendFormat("{0} = F_{1}(image, dirty, programStack, trap);\n", r0, target);
+                        else
+                            sb.AppendFormat("{0} = Call({0}, image, dirty, programStack, trap);\n", r0);
+                        break;
+
+                    case opcode_t.OP_JUMP:
+                        if (constTarget && target >= start && target < end && depth[target] == d - 1) {
+                            sb.AppendFormat("goto L{0};\n", target);
+                        } else {
+                            // Computed jump, any instruction on the same stack depth is fair game
+                            sb.AppendFormat("switch ({0}) {{ ", r0);
+                            for (int t = start; t < end; t++) {
+                                if (depth[t] == d - 1)
+                                    sb.AppendFormat("case {0}: goto L{0}; ", t);
+                            }
+                            sb.AppendFormat("}} return trap({0}, {1}, 0, 0);\n", VM_TRAP_ERROR, (int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+                        }
+                        break;
+
+                    case opcode_t.OP_EQ:
+                    case opcode_t.OP_NE:
+                    case opcode_t.OP_LTI:
+                    case opcode_t.OP_LEI:
+                    case opcode_t.OP_GTI:
+                    case opcode_t.OP_GEI:
+                        sb.AppendFormat("if ({0} {1} {2}) goto L{3};\n", r1, VM_TranspileOperator(code[i].op), r0, v);
+                        break;
+
+                    case opcode_t.OP_LTU:
+                    case opcode_t.OP_LEU:
+                    case opcode_t.OP_GTU:
+                    case opcode_t.OP_GEU:
+                        sb.AppendFormat("if ((uint){0} {1} (uint){2}) goto L{3};\n", r1, VM_TranspileOperator(code[i].op), r0, v);
+                        break;
+
+                    case opcode_t.OP_EQF:
+                    case opcode_t.OP_NEF:
+                    case opcode_t.OP_LTF:
+                    case opcode_t.OP_LEF:
+                    case opcode_t.OP_GTF:
+                    case opcode_t.OP_GEF:
+                        sb.AppendFormat("if (F({0}) {1} F({2})) goto L{3};\n", r1, VM_TranspileOperator(code[i].op), r0, v);
+                        break;
+
+                    case opcode_t.OP_NEGI:
+                        sb.AppendFormat("{0} = -{0};\n", r0);
+                        break;
+
+                    case opcode_t.OP_BCOM:
+                        sb.AppendFormat("{0} = ~{0};\n", r0);
+                        break;
+
+                    case opcode_t.OP_SEX8:
+                        sb.AppendFormat("{0} = (sbyte){0};\n", r0);
+                        break;
+
+                    case opcode_t.OP_SEX16:
+                        sb.AppendFormat("{0} = (short){0};\n", r0);
+                        break;
+
+                    case opcode_t.OP_ADD:
+                    case opcode_t.OP_SUB:
+                    case opcode_t.OP_DIVI:
+                    case opcode_t.OP_MODI:
+                    case opcode_t.OP_MULI:
+                    case opcode_t.OP_BAND:
+                    case opcode_t.OP_BOR:
+                    case opcode_t.OP_BXOR:
+                    case opcode_t.OP_LSH:
+                    case opcode_t.OP_RSHI:
+                        sb.AppendFormat("{0} = {0} {1} {2};\n", r1, VM_TranspileOperator(code[i].op), r0);
+                        break;
+
+                    case opcode_t.OP_DIVU:
+                    case opcode_t.OP_MODU:
+                    case opcode_t.OP_MULU:
+                        sb.AppendFormat("{0} = (int)((uint){0} {1} (uint){2});\n", r1, VM_TranspileOperator(code[i].op), r0);
+                        break;
+
+                    case opcode_t.OP_RSHU:
+                        sb.AppendFormat("{0} = (int)((uint){0} >> {1});\n", r1, r0);
+                        break;
+
+                    case opcode_t.OP_NEGF:
+                        sb.AppendFormat("{0} = I(-F({0}));\n", r0);
+                        break;
+
+                    case opcode_t.OP_ADDF:
+                    case opcode_t.OP_SUBF:
+                    case opcode_t.OP_DIVF:
+                    case opcode_t.OP_MULF:
+                        sb.AppendFormat("{0} = I(F({0}) {1} F({2}));\n", r1, VM_TranspileOperator(code[i].op), r0);
+                        break;
+
+                    case opcode_t.OP_CVIF:
+                        sb.AppendFormat("{0} = I((float){0});\n", r0);
+                        break;
+
+                    case opcode_t.OP_CVFI:
+                        sb.AppendFormat("{0} = (int)(long)F({0});\n", r0);
+                        break;
+
+                    default:
+                        Warn("VM_Transpile: bad instruction {0} at {1}\n", code[i].op, i);
+                        return -1;
+                }
+            }
+
+            sb.AppendFormat("            return trap({0}, {1}, 0, 0);\n", VM_TRAP_ERROR, (int)vmErrorCode_t.VM_PC_OUT_OF_RANGE);
+            sb.Append("        }\n");
+
+            return 0;
+        }
+
+        static string VM_TranspileOperator(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_EQ: case opcode_t.OP_EQF: return "==";
+                case opcode_t.OP_NE: case opcode_t.OP_NEF: return "!=";
+                case opcode_t.OP_LTI: case opcode_t.OP_LTU: case opcode_t.OP_LTF: return "<";
+                case opcode_t.OP_LEI: case opcode_t.OP_LEU: case opcode_t.OP_LEF: return "<=";
+                case opcode_t.OP_GTI: case opcode_t.OP_GTU: case opcode_t.OP_GTF: return ">";
+                case opcode_t.OP_GEI: case opcode_t.OP_GEU: case opcode_t.OP_GEF: return ">=";
+                case opcode_t.OP_ADD: case opcode_t.OP_ADDF: return "+";
+                case opcode_t.OP_SUB: case opcode_t.OP_SUBF: return "-";
+                case opcode_t.OP_DIVI: case opcode_t.OP_DIVU: case opcode_t.OP_DIVF: return "/";
+                case opcode_t.OP_MODI: case opcode_t.OP_MODU: return "%";
+                case opcode_t.OP_MULI: case opcode_t.OP_MULU: case opcode_t.OP_MULF: return "*";
+                case opcode_t.OP_BAND: return "&";
+                case opcode_t.OP_BOR: return "|";
+                case opcode_t.OP_BXOR: return "^";
+                case opcode_t.OP_LSH: return "<<";
+                default: return ">>";
+            }
+        }
+
+        // Binds to <hash>.dll in vm_precompiledPath if it was built for this exact
+        // bytecode and data layout
+        static int VM_LoadPrecompiled(ref VirtMachine vm, string hash) {
+            string file = Path.Combine(vm_precompiledPath, hash + ".dll");
+
+            if (!File.Exists(file))
+                return -1;
+
+            try {
+                Type type = Assembly.LoadFrom(file).GetType("Q3VM2.Precompiled." + VM_PrecompiledClass(hash));
+
+                if (type == null ||
+                    (string)type.GetField("Hash").GetValue(null) != hash ||
+                    (int)type.GetField("DataMask").GetValue(null) != vm.dataMask ||
+                    type.GetField("AccessMask") == null ||
+                    (int)type.GetField("AccessMask").GetValue(null) != VM_AccessMask(ref vm) ||
+                    type.GetField("StackSize") == null ||
+                    (int)type.GetField("StackSize").GetValue(null) != vm.module.stackSize ||
+                    type.GetField("Version") == null ||
+                    (int)type.GetField("Version").GetValue(null) != VM_PRECOMPILED_VERSION) {
+                    Warn("Warning: {0} does not match {1}\n", file, vm.Name);
+                    return -1;
+                }
+
+                vmPrecompiledCode_t precompiled = new vmPrecompiledCode_t();
+                precompiled.call = (vmPrecompiledFunc_t)Delegate.CreateDelegate(typeof(vmPrecompiledFunc_t), type.GetMethod("Call"));
+                precompiled.trap = (kind, a, b, c) => VM_PrecompiledTrap(precompiled, kind, a, b, c);
+
+                vm.precompiledCode = precompiled;
+            } catch (Exception E) {
+                Warn("Warning: failed to load {0}: {1}\n", file, E.Message);
+                return -1;
+            }
+
+            return 0;
+        }
+
+        static int VM_PrecompiledTrap(vmPrecompiledCode_t precompiled, int kind, int a, int b, int c) {
+            switch (kind) {
+                case VM_TRAP_SYSCALL:
+                    return VM_SystemCall(ref precompiled.vm, precompiled.vm.dataBase, a, b);
+
+                case VM_TRAP_BLOCK_COPY:
+                    VM_BlockCopy((uint)a, (uint)b, (uint)c, ref precompiled.vm);
+                    return 0;
+
+                case VM_TRAP_BREAK:
+                    precompiled.vm.breakCount++;
+                    return 0;
+
+                default:
+                    Com_Error(precompiled.vm.lastError = (vmErrorCode_t)a, "Precompiled code error");
+                    return -1;
+            }
+        }
+
+        static int VM_CallPrecompiled(ref VirtMachine vm, int function, int* args) {
+            vmPrecompiledCode_t precompiled = vm.precompiledCode;
+            int programStack;
+            int stackOnEntry;
+            byte* image;
+            int r;
+
+            programStack = stackOnEntry = vm.programStack;
+            image = vm.dataBase;
+
+            programStack -= (8 + 4 * 13);
+
+            for (int arg = 0; arg < 13; arg++) {
+                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+            }
+
+            *(int*)&image[programStack + 4] = 0;
+            *(int*)&image[programStack] = -1;
+
+            precompiled.vm = vm;
+
+            try {
+                r = precompiled.call(function, image, vm.dirtyPages, programStack, precompiled.trap);
+            } finally {
+                vm = precompiled.vm;
+                vm.programStack = stackOnEntry;
+            }
+
+            return r;
+        }
+    }
+}
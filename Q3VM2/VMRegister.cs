@@ -0,0 +1,1236 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+
+// Register form of the QVM. Every function is lowered from the stack machine to
+// three address code where op stack slots become virtual registers, then the
+// known values of CONST and LOCAL slots are propagated into their users (folding
+// constants, turning LOCAL+LOAD/STORE into frame slot accesses) and definitions
+// nobody reads are dropped before VM_CallRegister executes the result.
+//
+// Each call gets its own register window. The first two slots of a window hold
+// the index of the calling instruction (-1 for the outermost call) and the size
+// of the caller's window, op stack slot n lives in register n + 2.
+
+namespace Q3VM2 {
+    enum vmRegOp_t {
+        ROP_NOP,
+        ROP_ERROR,
+        ROP_BREAK,
+        ROP_ENTER,
+        ROP_LEAVE,
+
+        ROP_MOVI,
+        ROP_MOV,
+        ROP_LOCAL,
+
+        ROP_LOAD1,
+        ROP_LOAD2,
+        ROP_LOAD4,
+        ROP_LOADL1,
+        ROP_LOADL2,
+        ROP_LOADL4,
+
+        ROP_STORE1,
+        ROP_STORE2,
+        ROP_STORE4,
+        ROP_STOREL1,
+        ROP_STOREL2,
+        ROP_STOREL4,
+        ROP_STORELI4,
+
+        ROP_BLOCK_COPY,
+
+        ROP_CALL,
+        ROP_CALLI,
+        ROP_SYSCALL,
+
+        ROP_GOTO,
+        ROP_JUMP,
+
+        ROP_EQ,
+        ROP_NE,
+        ROP_LTI,
+        ROP_LEI,
+        ROP_GTI,
+        ROP_GEI,
+        ROP_LTU,
+        ROP_LEU,
+        ROP_GTU,
+        ROP_GEU,
+        ROP_EQF,
+        ROP_NEF,
+        ROP_LTF,
+        ROP_LEF,
+        ROP_GTF,
+        ROP_GEF,
+
+        ROP_EQI,
+        ROP_NEI,
+        ROP_LTII,
+        ROP_LEII,
+        ROP_GTII,
+        ROP_GEII,
+        ROP_LTUI,
+        ROP_LEUI,
+        ROP_GTUI,
+        ROP_GEUI,
+
+        ROP_NEGI,
+        ROP_BCOM,
+        ROP_SEX8,
+        ROP_SEX16,
+        ROP_NEGF,
+        ROP_CVIF,
+        ROP_CVFI,
+
+        ROP_ADD,
+        ROP_SUB,
+        ROP_DIVI,
+        ROP_DIVU,
+        ROP_MODI,
+        ROP_MODU,
+        ROP_MULI,
+        ROP_MULU,
+        ROP_BAND,
+        ROP_BOR,
+        ROP_BXOR,
+        ROP_LSH,
+        ROP_RSHI,
+        ROP_RSHU,
+        ROP_ADDF,
+        ROP_SUBF,
+        ROP_DIVF,
+        ROP_MULF,
+
+        ROP_ADDI
+    }
+
+    // dst = a op b, value is the immediate / frame offset, target the branch or
+    // call destination as an index into vmRegisterCode_t.code
+    [StructLayout(LayoutKind.Sequential)]
+    struct vmRegInstruction_t {
+        public vmRegOp_t op;
+        public int dst;
+        public int a;
+        public int b;
+        public int value;
+        public int target;
+    }
+
+    class vmRegisterCode_t {
+        public vmRegInstruction_t[] code;
+
+        // Index into code for every OP_ENTER, -1 for other instructions
+        public int[] functions;
+
+        // Index into code for computed jumps, -1 where the op stack is not empty
+        public int[] jumps;
+
+        public int[] registers;
+
+        // First free register while a system call runs, a nested VM_Call starts there
+        public int registerTop;
+
+        // Size of the lowered code before optimization
+        public int loweredCount;
+    }
+
+    unsafe static partial class VM {
+
+        const int REG_UNKNOWN = 0;
+        const int REG_CONST = 1;
+        const int REG_LOCAL = 2;
+        const int REG_COPY = 3;
+
+        static int VM_CompileRegister(ref VirtMachine vm) {
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+            int[] depth = new int[code.Length];
+            int[] irIndex = new int[code.Length];
+            List<vmRegInstruction_t> result = new List<vmRegInstruction_t>();
+            vmRegisterCode_t registerCode = new vmRegisterCode_t();
+            int maxWindow = 0;
+            int minFrame = int.MaxValue;
+
+            if (code.Length == 0 || code[0].op != opcode_t.OP_ENTER)
+                return -1;
+
+            registerCode.functions = new int[code.Length];
+            registerCode.jumps = new int[code.Length];
+
+            for (int start = 0; start < code.Length;) {
+                int end = start + 1;
+
+                while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                    end++;
+
+                int maxDepth = VM_FunctionStackDepths(code, start, end, depth);
+
+                if (maxDepth < 0) {
+                    Warn("VM_CompileRegister: inconsistent op stack in function at {0}\n", start);
+                    return -1;
+                }
+
+                int window = maxDepth + 2;
+                List<vmRegInstruction_t> ir = new List<vmRegInstruction_t>();
+                int[] first = new int[end - start];
+
+                if (VM_LowerFunction(code, depth, start, end, window, ir, first) != 0)
+                    return -1;
+
+                registerCode.loweredCount += ir.Count;
+
+                VM_RegPropagate(code, depth, start, end, ir, first);
+                VM_RegEliminateDeadStores(start, window, ir, first, vm.dataGuarded);
+
+                // Drop the NOPs, anything that pointed at one now points at the
+                // next surviving instruction
+                int[] newIndex = new int[ir.Count];
+
+                for (int i = 0; i < ir.Count; i++) {
+                    newIndex[i] = result.Count;
+
+                    if (ir[i].op != vmRegOp_t.ROP_NOP)
+                        result.Add(ir[i]);
+                }
+
+                for (int t = start; t < end; t++) {
+                    irIndex[t] = newIndex[first[t - start]];
+                    registerCode.functions[t] = t == start ? irIndex[t] : -1;
+                    registerCode.jumps[t] = depth[t] == 0 ? irIndex[t] : -1;
+                }
+
+                maxWindow = Math.Max(maxWindow, window);
+                minFrame = Math.Min(minFrame, code[start].value);
+
+                start = end;
+            }
+
+            registerCode.code = result.ToArray();
+
+            for (int i = 0; i < registerCode.code.Length; i++) {
+                vmRegOp_t op = registerCode.code[i].op;
+
+                if (op == vmRegOp_t.ROP_GOTO || VM_RegIsBranch(op))
+                    registerCode.code[i].target = irIndex[registerCode.code[i].target];
+                else if (op == vmRegOp_t.ROP_CALLI)
+                    registerCode.code[i].target = registerCode.functions[registerCode.code[i].value];
+            }
+
+            // Every guest call takes at least minFrame bytes of the program stack,
+            // which bounds how many windows can be live at once
+            registerCode.registers = new int[(vm.module.stackSize / Math.Max(minFrame, 8) + 64) * maxWindow];
+
+            vm.registerCode = registerCode;
+
+            return 0;
+        }
+
+        static int VM_LowerFunction(vmInstruction_t[] code, int[] depth, int start, int end, int window, List<vmRegInstruction_t> ir, int[] first) {
+            for (int i = start; i < end; i++) {
+                int d = depth[i];
+                int top = d + 1;
+                int next = d;
+                int push = d + 2;
+                vmRegInstruction_t ins = new vmRegInstruction_t();
+
+                first[i - start] = ir.Count;
+                ins.value = code[i].value;
+
+                switch (code[i].op) {
+                    case opcode_t.OP_IGNORE:
+                    case opcode_t.OP_PUSH:
+                    case opcode_t.OP_POP:
+                        continue;
+
+                    case opcode_t.OP_UNDEF:
+                        ins.op = vmRegOp_t.ROP_ERROR;
+                        ins.value = (int)vmErrorCode_t.VM_BAD_INSTRUCTION;
+                        break;
+
+                    case opcode_t.OP_BREAK:
+                        ins.op = vmRegOp_t.ROP_BREAK;
+                        break;
+
+                    case opcode_t.OP_ENTER:
+                        ins.op = vmRegOp_t.ROP_ENTER;
+                        ins.b = window;
+                        break;
+
+                    case opcode_t.OP_LEAVE:
+                        ins.op = vmRegOp_t.ROP_LEAVE;
+                        ins.a = top;
+                        break;
+
+                    case opcode_t.OP_CONST:
+                        ins.op = vmRegOp_t.ROP_MOVI;
+                        ins.dst = push;
+                        break;
+
+                    case opcode_t.OP_LOCAL:
+                        ins.op = vmRegOp_t.ROP_LOCAL;
+                        ins.dst = push;
+                        break;
+
+                    case opcode_t.OP_LOAD1:
+                    case opcode_t.OP_LOAD2:
+                    case opcode_t.OP_LOAD4:
+                        ins.op = vmRegOp_t.ROP_LOAD1 + (code[i].op - opcode_t.OP_LOAD1);
+                        ins.dst = top;
+                        ins.a = top;
+                        break;
+
+                    case opcode_t.OP_STORE1:
+                    case opcode_t.OP_STORE2:
+                    case opcode_t.OP_STORE4:
+                        ins.op = vmRegOp_t.ROP_STORE1 + (code[i].op - opcode_t.OP_STORE1);
+                        ins.a = next;
+                        ins.b = top;
+                        break;
+
+                    case opcode_t.OP_ARG:
+                        ins.op = vmRegOp_t.ROP_STOREL4;
+                        ins.b = top;
+                        break;
+
+                    case opcode_t.OP_BLOCK_COPY:
+                        ins.op = vmRegOp_t.ROP_BLOCK_COPY;
+                        ins.a = next;
+                        ins.b = top;
+                        break;
+
+                    case opcode_t.OP_CALL:
+                        ins.op = vmRegOp_t.ROP_CALL;
+                        ins.dst = top;
+                        ins.a = top;
+                        ins.b = window;
+                        break;
+
+                    case opcode_t.OP_JUMP:
+                        if (d != 1) {
+                            Warn("VM_CompileRegister: computed jump on a non-empty stack at {0}\n", i);
+                            return -1;
+                        }
+
+                        ins.op = vmRegOp_t.ROP_JUMP;
+                        ins.a = top;
+                        ins.value = start;
+                        ins.b = end;
+                        break;
+
+                    case opcode_t.OP_SEX8:
+                    case opcode_t.OP_SEX16:
+                    case opcode_t.OP_NEGI:
+                    case opcode_t.OP_BCOM:
+                    case opcode_t.OP_NEGF:
+                    case opcode_t.OP_CVIF:
+                    case opcode_t.OP_CVFI:
+                        ins.op = VM_RegOpFor(code[i].op);
+                        ins.dst = top;
+                        ins.a = top;
+                        break;
+
+                    default:
+                        if (VM_IsBranch(code[i].op)) {
+                            ins.op = vmRegOp_t.ROP_EQ + (code[i].op - opcode_t.OP_EQ);
+                            ins.a = next;
+                            ins.b = top;
+                            ins.target = code[i].value;
+                            break;
+                        }
+
+                        ins.op = VM_RegOpFor(code[i].op);
+
+                        if (ins.op == vmRegOp_t.ROP_NOP) {
+                            Warn("VM_CompileRegister: bad instruction {0} at {1}\n", code[i].op, i);
+                            return -1;
+                        }
+
+                        ins.dst = next;
+                        ins.a = next;
+                        ins.b = top;
+                        break;
+                }
+
+                ir.Add(ins);
+            }
+
+            // Running off the end of a function is as bad as a wild jump
+            ir.Add(new vmRegInstruction_t { op = vmRegOp_t.ROP_ERROR, value = (int)vmErrorCode_t.VM_PC_OUT_OF_RANGE });
+
+            return 0;
+        }
+
+        static vmRegOp_t VM_RegOpFor(opcode_t op) {
+            switch (op) {
+                case opcode_t.OP_NEGI: return vmRegOp_t.ROP_NEGI;
+                case opcode_t.OP_BCOM: return vmRegOp_t.ROP_BCOM;
+                case opcode_t.OP_SEX8: return vmRegOp_t.ROP_SEX8;
+                case opcode_t.OP_SEX16: return vmRegOp_t.ROP_SEX16;
+                case opcode_t.OP_NEGF: return vmRegOp_t.ROP_NEGF;
+                case opcode_t.OP_CVIF: return vmRegOp_t.ROP_CVIF;
+                case opcode_t.OP_CVFI: return vmRegOp_t.ROP_CVFI;
+                case opcode_t.OP_ADD: return vmRegOp_t.ROP_ADD;
+                case opcode_t.OP_SUB: return vmRegOp_t.ROP_SUB;
+                case opcode_t.OP_DIVI: return vmRegOp_t.ROP_DIVI;
+                case opcode_t.OP_DIVU: return vmRegOp_t.ROP_DIVU;
+                case opcode_t.OP_MODI: return vmRegOp_t.ROP_MODI;
+                case opcode_t.OP_MODU: return vmRegOp_t.ROP_MODU;
+                case opcode_t.OP_MULI: return vmRegOp_t.ROP_MULI;
+                case opcode_t.OP_MULU: return vmRegOp_t.ROP_MULU;
+                case opcode_t.OP_BAND: return vmRegOp_t.ROP_BAND;
+                case opcode_t.OP_BOR: return vmRegOp_t.ROP_BOR;
+                case opcode_t.OP_BXOR: return vmRegOp_t.ROP_BXOR;
+                case opcode_t.OP_LSH: return vmRegOp_t.ROP_LSH;
+                case opcode_t.OP_RSHI: return vmRegOp_t.ROP_RSHI;
+                case opcode_t.OP_RSHU: return vmRegOp_t.ROP_RSHU;
+                case opcode_t.OP_ADDF: return vmRegOp_t.ROP_ADDF;
+                case opcode_t.OP_SUBF: return vmRegOp_t.ROP_SUBF;
+                case opcode_t.OP_DIVF: return vmRegOp_t.ROP_DIVF;
+                case opcode_t.OP_MULF: return vmRegOp_t.ROP_MULF;
+                default: return vmRegOp_t.ROP_NOP;
+            }
+        }
+
+        static bool VM_RegIsBranch(vmRegOp_t op) {
+            return op >= vmRegOp_t.ROP_EQ && op <= vmRegOp_t.ROP_GEUI;
+        }
+
+        static bool VM_RegIsUnary(vmRegOp_t op) {
+            return op >= vmRegOp_t.ROP_NEGI && op <= vmRegOp_t.ROP_CVFI;
+        }
+
+        static bool VM_RegIsBinary(vmRegOp_t op) {
+            return op >= vmRegOp_t.ROP_ADD && op <= vmRegOp_t.ROP_MULF;
+        }
+
+        static bool VM_RegUsesA(vmRegOp_t op) {
+            switch (op) {
+                case vmRegOp_t.ROP_LEAVE:
+                case vmRegOp_t.ROP_MOV:
+                case vmRegOp_t.ROP_LOAD1:
+                case vmRegOp_t.ROP_LOAD2:
+                case vmRegOp_t.ROP_LOAD4:
+                case vmRegOp_t.ROP_STORE1:
+                case vmRegOp_t.ROP_STORE2:
+                case vmRegOp_t.ROP_STORE4:
+                case vmRegOp_t.ROP_BLOCK_COPY:
+                case vmRegOp_t.ROP_CALL:
+                case vmRegOp_t.ROP_JUMP:
+                case vmRegOp_t.ROP_ADDI:
+                    return true;
+                default:
+                    return VM_RegIsBranch(op) || VM_RegIsUnary(op) || VM_RegIsBinary(op);
+            }
+        }
+
+        static bool VM_RegUsesB(vmRegOp_t op) {
+            switch (op) {
+                case vmRegOp_t.ROP_STORE1:
+                case vmRegOp_t.ROP_STORE2:
+                case vmRegOp_t.ROP_STORE4:
+                case vmRegOp_t.ROP_STOREL1:
+                case vmRegOp_t.ROP_STOREL2:
+                case vmRegOp_t.ROP_STOREL4:
+                case vmRegOp_t.ROP_BLOCK_COPY:
+                    return true;
+                default:
+                    return (op >= vmRegOp_t.ROP_EQ && op <= vmRegOp_t.ROP_GEF) || VM_RegIsBinary(op);
+            }
+        }
+
+        static bool VM_RegDefines(vmRegOp_t op) {
+            switch (op) {
+                case vmRegOp_t.ROP_MOVI:
+                case vmRegOp_t.ROP_MOV:
+                case vmRegOp_t.ROP_LOCAL:
+                case vmRegOp_t.ROP_LOAD1:
+                case vmRegOp_t.ROP_LOAD2:
+                case vmRegOp_t.ROP_LOAD4:
+                case vmRegOp_t.ROP_LOADL1:
+                case vmRegOp_t.ROP_LOADL2:
+                case vmRegOp_t.ROP_LOADL4:
+                case vmRegOp_t.ROP_CALL:
+                case vmRegOp_t.ROP_CALLI:
+                case vmRegOp_t.ROP_SYSCALL:
+                case vmRegOp_t.ROP_ADDI:
+                    return true;
+                default:
+                    return VM_RegIsUnary(op) || VM_RegIsBinary(op);
+            }
+        }
+
+        // Definitions that can go away when nobody reads them. Integer division can
+        // still throw, and so can a load from a guarded segment, which is not masked
+        static bool VM_RegIsPure(vmRegOp_t op, bool guarded) {
+            switch (op) {
+                case vmRegOp_t.ROP_LOAD1:
+                case vmRegOp_t.ROP_LOAD2:
+                case vmRegOp_t.ROP_LOAD4:
+                case vmRegOp_t.ROP_LOADL1:
+                case vmRegOp_t.ROP_LOADL2:
+                case vmRegOp_t.ROP_LOADL4:
+                    return !guarded;
+                case vmRegOp_t.ROP_CALL:
+                case vmRegOp_t.ROP_CALLI:
+                case vmRegOp_t.ROP_SYSCALL:
+                case vmRegOp_t.ROP_DIVI:
+                case vmRegOp_t.ROP_DIVU:
+                case vmRegOp_t.ROP_MODI:
+                case vmRegOp_t.ROP_MODU:
+                    return false;
+                default:
+                    return VM_RegDefines(op);
+            }
+        }
+
+        static bool VM_RegFoldUnary(vmRegOp_t op, int a, out int r) {
+            switch (op) {
+                case vmRegOp_t.ROP_NEGI: r = -a; return true;
+                case vmRegOp_t.ROP_BCOM: r = ~a; return true;
+                case vmRegOp_t.ROP_SEX8: r = (sbyte)a; return true;
+                case vmRegOp_t.ROP_SEX16: r = (short)a; return true;
+                case vmRegOp_t.ROP_NEGF: r = VM_FloatToInt(-VM_IntToFloat(a)); return true;
+                case vmRegOp_t.ROP_CVIF: r = VM_FloatToInt((float)a); return true;
+                case vmRegOp_t.ROP_CVFI: r = (int)(long)VM_IntToFloat(a); return true;
+                default: r = 0; return false;
+            }
+        }
+
+        static bool VM_RegFoldBinary(vmRegOp_t op, int a, int b, out int r) {
+            r = 0;
+
+            switch (op) {
+                case vmRegOp_t.ROP_ADD: r = a + b; return true;
+                case vmRegOp_t.ROP_SUB: r = a - b; return true;
+                case vmRegOp_t.ROP_MULI: r = a * b; return true;
+                case vmRegOp_t.ROP_MULU: r = (int)((uint)a * (uint)b); return true;
+                case vmRegOp_t.ROP_BAND: r = a & b; return true;
+                case vmRegOp_t.ROP_BOR: r = a | b; return true;
+                case vmRegOp_t.ROP_BXOR: r = a ^ b; return true;
+                case vmRegOp_t.ROP_LSH: r = a << b; return true;
+                case vmRegOp_t.ROP_RSHI: r = a >> b; return true;
+                case vmRegOp_t.ROP_RSHU: r = (int)((uint)a >> b); return true;
+                case vmRegOp_t.ROP_ADDF: r = VM_FloatToInt(VM_IntToFloat(a) + VM_IntToFloat(b)); return true;
+                case vmRegOp_t.ROP_SUBF: r = VM_FloatToInt(VM_IntToFloat(a) - VM_IntToFloat(b)); return true;
+                case vmRegOp_t.ROP_DIVF: r = VM_FloatToInt(VM_IntToFloat(a) / VM_IntToFloat(b)); return true;
+                case vmRegOp_t.ROP_MULF: r = VM_FloatToInt(VM_IntToFloat(a) * VM_IntToFloat(b)); return true;
+            }
+
+            // Leave the faulting cases to run time
+            if (b == 0 || (b == -1 && a == int.MinValue))
+                return false;
+
+            switch (op) {
+                case vmRegOp_t.ROP_DIVI: r = a / b; return true;
+                case vmRegOp_t.ROP_DIVU: r = (int)((uint)a / (uint)b); return true;
+                case vmRegOp_t.ROP_MODI: r = a % b; return true;
+                case vmRegOp_t.ROP_MODU: r = (int)((uint)a % (uint)b); return true;
+                default: return false;
+            }
+        }
+
+        static bool VM_RegCompare(vmRegOp_t op, int a, int b) {
+            switch (op) {
+                case vmRegOp_t.ROP_EQ: return a == b;
+                case vmRegOp_t.ROP_NE: return a != b;
+                case vmRegOp_t.ROP_LTI: return a < b;
+                case vmRegOp_t.ROP_LEI: return a <= b;
+                case vmRegOp_t.ROP_GTI: return a > b;
+                case vmRegOp_t.ROP_GEI: return a >= b;
+                case vmRegOp_t.ROP_LTU: return (uint)a < (uint)b;
+                case vmRegOp_t.ROP_LEU: return (uint)a <= (uint)b;
+                case vmRegOp_t.ROP_GTU: return (uint)a > (uint)b;
+                case vmRegOp_t.ROP_GEU: return (uint)a >= (uint)b;
+                case vmRegOp_t.ROP_EQF: return VM_IntToFloat(a) == VM_IntToFloat(b);
+                case vmRegOp_t.ROP_NEF: return VM_IntToFloat(a) != VM_IntToFloat(b);
+                case vmRegOp_t.ROP_LTF: return VM_IntToFloat(a) < VM_IntToFloat(b);
+                case vmRegOp_t.ROP_LEF: return VM_IntToFloat(a) <= VM_IntToFloat(b);
+                case vmRegOp_t.ROP_GTF: return VM_IntToFloat(a) > VM_IntToFloat(b);
+                default: return VM_IntToFloat(a) >= VM_IntToFloat(b);
+            }
+        }
+
+        // The integer compare that gives the same result with its operands swapped
+        static vmRegOp_t VM_RegSwapCompare(vmRegOp_t op) {
+            switch (op) {
+                case vmRegOp_t.ROP_LTI: return vmRegOp_t.ROP_GTI;
+                case vmRegOp_t.ROP_LEI: return vmRegOp_t.ROP_GEI;
+                case vmRegOp_t.ROP_GTI: return vmRegOp_t.ROP_LTI;
+                case vmRegOp_t.ROP_GEI: return vmRegOp_t.ROP_LEI;
+                case vmRegOp_t.ROP_LTU: return vmRegOp_t.ROP_GTU;
+                case vmRegOp_t.ROP_LEU: return vmRegOp_t.ROP_GEU;
+                case vmRegOp_t.ROP_GTU: return vmRegOp_t.ROP_LTU;
+                case vmRegOp_t.ROP_GEU: return vmRegOp_t.ROP_LEU;
+                default: return op;
+            }
+        }
+
+        // Forward pass over each basic block tracking which registers hold a known
+        // constant, a known frame address or a copy of another register, and
+        // rewriting their users to match. Every jump target starts from scratch,
+        // computed jumps can only land where the op stack is empty
+        static void VM_RegPropagate(vmInstruction_t[] code, int[] depth, int start, int end, List<vmRegInstruction_t> ir, int[] first) {
+            bool[] label = new bool[ir.Count];
+            bool computedJump = false;
+            int[] kind = new int[258];
+            int[] known = new int[258];
+            int r;
+
+            for (int t = start; t < end; t++) {
+                if (VM_IsBranch(code[t].op))
+                    label[first[code[t].value - start]] = true;
+
+                if (code[t].op == opcode_t.OP_JUMP) {
+                    int v = code[t - 1].value;
+
+                    if (code[t - 1].op != opcode_t.OP_CONST)
+                        computedJump = true;
+                    else if (v >= start && v < end)
+                        label[first[v - start]] = true;
+                }
+            }
+
+            for (int t = start; t < end && computedJump; t++) {
+                if (depth[t] == 0)
+                    label[first[t - start]] = true;
+            }
+
+            for (int i = 0; i < ir.Count; i++) {
+                vmRegInstruction_t ins = ir[i];
+
+                if (label[i] || ins.op == vmRegOp_t.ROP_ENTER)
+                    Array.Clear(kind, 0, kind.Length);
+
+                if (VM_RegUsesA(ins.op) && kind[ins.a] == REG_COPY)
+                    ins.a = known[ins.a];
+                if (VM_RegUsesB(ins.op) && kind[ins.b] == REG_COPY)
+                    ins.b = known[ins.b];
+
+                int ka = VM_RegUsesA(ins.op) ? kind[ins.a] : REG_UNKNOWN;
+                int kb = VM_RegUsesB(ins.op) ? kind[ins.b] : REG_UNKNOWN;
+                int va = VM_RegUsesA(ins.op) ? known[ins.a] : 0;
+                int vb = VM_RegUsesB(ins.op) ? known[ins.b] : 0;
+
+                switch (ins.op) {
+                    case vmRegOp_t.ROP_MOV:
+                        if (ka == REG_CONST || ka == REG_LOCAL) {
+                            ins.op = ka == REG_CONST ? vmRegOp_t.ROP_MOVI : vmRegOp_t.ROP_LOCAL;
+                            ins.value = va;
+                        } else if (ins.a == ins.dst) {
+                            ins.op = vmRegOp_t.ROP_NOP;
+                        }
+                        break;
+
+                    case vmRegOp_t.ROP_LOAD1:
+                    case vmRegOp_t.ROP_LOAD2:
+                    case vmRegOp_t.ROP_LOAD4:
+                        if (ka == REG_LOCAL) {
+                            ins.op = vmRegOp_t.ROP_LOADL1 + (ins.op - vmRegOp_t.ROP_LOAD1);
+                            ins.value = va;
+                        }
+                        break;
+
+                    case vmRegOp_t.ROP_STORE1:
+                    case vmRegOp_t.ROP_STORE2:
+                    case vmRegOp_t.ROP_STORE4:
+                        if (ka == REG_LOCAL) {
+                            ins.op = vmRegOp_t.ROP_STOREL1 + (ins.op - vmRegOp_t.ROP_STORE1);
+                            ins.value = va;
+                        }
+                        break;
+
+                    case vmRegOp_t.ROP_CALL:
+                        if (ka == REG_CONST && va < 0) {
+                            ins.op = vmRegOp_t.ROP_SYSCALL;
+                            ins.value = va;
+                        } else if (ka == REG_CONST && va < code.Length && code[va].op == opcode_t.OP_ENTER) {
+                            ins.op = vmRegOp_t.ROP_CALLI;
+                            ins.value = va;
+                        }
+                        break;
+
+                    case vmRegOp_t.ROP_JUMP:
+                        if (ka == REG_CONST && va >= start && va < end && depth[va] == 0) {
+                            ins.op = vmRegOp_t.ROP_GOTO;
+                            ins.target = va;
+                        }
+                        break;
+
+                    case vmRegOp_t.ROP_ADDI:
+                        if (ka == REG_CONST || ka == REG_LOCAL) {
+                            ins.op = ka == REG_CONST ? vmRegOp_t.ROP_MOVI : vmRegOp_t.ROP_LOCAL;
+                            ins.value += va;
+                        }
+                        break;
+
+                    default:
+                        if (VM_RegIsUnary(ins.op)) {
+                            if (ka == REG_CONST && VM_RegFoldUnary(ins.op, va, out r)) {
+                                ins.op = vmRegOp_t.ROP_MOVI;
+                                ins.value = r;
+                            }
+                        } else if (VM_RegIsBinary(ins.op)) {
+                            if (ka == REG_CONST && kb == REG_CONST && VM_RegFoldBinary(ins.op, va, vb, out r)) {
+                                ins.op = vmRegOp_t.ROP_MOVI;
+                                ins.value = r;
+                            } else if ((ins.op == vmRegOp_t.ROP_ADD || ins.op == vmRegOp_t.ROP_SUB) && kb == REG_CONST) {
+                                ins.value = ins.op == vmRegOp_t.ROP_ADD ? vb : -vb;
+                                ins.op = vmRegOp_t.ROP_ADDI;
+
+                                if (ka == REG_LOCAL) {
+                                    ins.op = vmRegOp_t.ROP_LOCAL;
+                                    ins.value += va;
+                                }
+                            } else if (ins.op == vmRegOp_t.ROP_ADD && ka == REG_CONST) {
+                                ins.op = vmRegOp_t.ROP_ADDI;
+                                ins.a = ins.b;
+                                ins.value = va;
+                            }
+                        } else if (VM_RegIsBranch(ins.op) && ins.op <= vmRegOp_t.ROP_GEF) {
+                            if (ka == REG_CONST && kb == REG_CONST) {
+                                ins.op = VM_RegCompare(ins.op, va, vb) ? vmRegOp_t.ROP_GOTO : vmRegOp_t.ROP_NOP;
+                            } else if (ins.op <= vmRegOp_t.ROP_GEU && kb == REG_CONST) {
+                                ins.op = vmRegOp_t.ROP_EQI + (ins.op - vmRegOp_t.ROP_EQ);
+                                ins.value = vb;
+                            } else if (ins.op <= vmRegOp_t.ROP_GEU && ka == REG_CONST) {
+                                ins.op = vmRegOp_t.ROP_EQI + (VM_RegSwapCompare(ins.op) - vmRegOp_t.ROP_EQ);
+                                ins.a = ins.b;
+                                ins.value = va;
+                            }
+                        }
+                        break;
+                }
+
+                // Stores of a constant into the frame, most often OP_ARG
+                if (ins.op == vmRegOp_t.ROP_STOREL4 && kind[ins.b] == REG_CONST) {
+                    ins.op = vmRegOp_t.ROP_STORELI4;
+                    ins.b = known[ins.b];
+                }
+
+                if (ins.op == vmRegOp_t.ROP_ADDI && ins.value == 0) {
+                    ins.op = ins.a == ins.dst ? vmRegOp_t.ROP_NOP : vmRegOp_t.ROP_MOV;
+                }
+
+                if (VM_RegDefines(ins.op)) {
+                    for (int reg = 0; reg < kind.Length; reg++) {
+                        if (kind[reg] == REG_COPY && known[reg] == ins.dst)
+                            kind[reg] = REG_UNKNOWN;
+                    }
+
+                    switch (ins.op) {
+                        case vmRegOp_t.ROP_MOVI:
+                            kind[ins.dst] = REG_CONST;
+                            known[ins.dst] = ins.value;
+                            break;
+                        case vmRegOp_t.ROP_LOCAL:
+                            kind[ins.dst] = REG_LOCAL;
+                            known[ins.dst] = ins.value;
+                            break;
+                        case vmRegOp_t.ROP_MOV:
+                            kind[ins.dst] = REG_COPY;
+                            known[ins.dst] = ins.a;
+                            break;
+                        default:
+                            kind[ins.dst] = REG_UNKNOWN;
+                            break;
+                    }
+                }
+
+                ir[i] = ins;
+            }
+        }
+
+        // Backward liveness over the whole function, then drop pure definitions of
+        // registers that are dead afterwards. Repeats until nothing changes since
+        // removing one definition can kill the ones feeding it
+        static void VM_RegEliminateDeadStores(int start, int window, List<vmRegInstruction_t> ir, int[] first, bool guarded) {
+            int n = ir.Count;
+            int words = (window + 63) / 64;
+            ulong[] liveIn = new ulong[n * words];
+            ulong[] scratch = new ulong[n * words];
+            ulong[] all = new ulong[words];
+            bool removed = true;
+
+            while (removed) {
+                bool changed = true;
+
+                Array.Clear(liveIn, 0, liveIn.Length);
+
+                while (changed) {
+                    changed = false;
+
+                    Array.Clear(all, 0, words);
+                    for (int i = 0; i < n; i++) {
+                        for (int w = 0; w < words; w++)
+                            all[w] |= liveIn[i * words + w];
+                    }
+
+                    for (int i = n - 1; i >= 0; i--) {
+                        vmRegInstruction_t ins = ir[i];
+                        int o = i * words;
+
+                        for (int w = 0; w < words; w++) {
+                            ulong live = 0;
+
+                            switch (ins.op) {
+                                case vmRegOp_t.ROP_LEAVE:
+                                case vmRegOp_t.ROP_ERROR:
+                                    break;
+                                case vmRegOp_t.ROP_JUMP:
+                                    live = all[w];
+                                    break;
+                                case vmRegOp_t.ROP_GOTO:
+                                    live = liveIn[first[ins.target - start] * words + w];
+                                    break;
+                                default:
+                                    live = liveIn[(i + 1) * words + w];
+                                    if (VM_RegIsBranch(ins.op))
+                                        live |= liveIn[first[ins.target - start] * words + w];
+                                    break;
+                            }
+
+                            scratch[o + w] = live;
+                        }
+
+                        if (VM_RegDefines(ins.op))
+                            scratch[o + (ins.dst >> 6)] &= ~(1UL << (ins.dst & 63));
+
+                        // scratch now holds out - def, add the uses to get liveIn
+                        if (VM_RegUsesA(ins.op))
+                            scratch[o + (ins.a >> 6)] |= 1UL << (ins.a & 63);
+                        if (VM_RegUsesB(ins.op))
+                            scratch[o + (ins.b >> 6)] |= 1UL << (ins.b & 63);
+
+                        for (int w = 0; w < words; w++) {
+                            if (liveIn[o + w] != scratch[o + w]) {
+                                liveIn[o + w] = scratch[o + w];
+                                changed = true;
+                            }
+                        }
+                    }
+                }
+
+                removed = false;
+
+                for (int i = 0; i < n; i++) {
+                    vmRegInstruction_t ins = ir[i];
+
+                    if (!VM_RegIsPure(ins.op, guarded))
+                        continue;
+
+                    // The successors of a pure definition are always just i + 1
+                    if ((liveIn[(i + 1) * words + (ins.dst >> 6)] & (1UL << (ins.dst & 63))) == 0) {
+                        ins.op = vmRegOp_t.ROP_NOP;
+                        ir[i] = ins;
+                        removed = true;
+                    }
+                }
+            }
+        }
+
+        static int VM_CallRegister(ref VirtMachine vm, int function, int* args) {
+            vmRegisterCode_t registerCode = vm.registerCode;
+            int[] functions = registerCode.functions;
+            int[] jumps = registerCode.jumps;
+            int programStack;
+            int stackOnEntry;
+            byte* image;
+            byte* dirty;
+            int dataMask;
+            int stackBottom;
+            int target;
+            int r;
+
+            programStack = stackOnEntry = vm.programStack;
+            image = vm.dataBase;
+            dirty = vm.dirtyPages;
+            dataMask = VM_AccessMask(ref vm);
+            stackBottom = vm.stackBottom;
+
+            programStack -= (8 + 4 * 13);
+
+            for (int arg = 0; arg < 13; arg++) {
+                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+            }
+
+            *(int*)&image[programStack + 4] = 0;
+            *(int*)&image[programStack] = -1;
+
+            fixed (vmRegInstruction_t* code = registerCode.code)
+            fixed (int* registers = registerCode.registers) {
+                int* limit = registers + registerCode.registers.Length;
+                int* regs = registers + (vm.callLevel > 1 ? registerCode.registerTop : 0);
+                vmRegInstruction_t* ip = code + functions[function];
+
+                // Every call writes the return link before the callee's
+                // ROP_ENTER checks its window
+                if (regs + 2 > limit) {
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "Register window overflow");
+                    return -1;
+                }
+
+                regs[0] = -1;
+                regs[1] = 0;
+
+                while (true) {
+                    switch (ip->op) {
+                        case vmRegOp_t.ROP_ERROR:
+                            Com_Error(vm.lastError = (vmErrorCode_t)ip->value, "Bad VM instruction");
+                            return -1;
+                        case vmRegOp_t.ROP_BREAK:
+                            vm.breakCount++;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_ENTER:
+                            programStack -= ip->value;
+
+                            // ROP_STOREL* do not mark dirty pages, frames have to
+                            // stay on the stack pages
+                            if (programStack < stackBottom) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "VM stack overflow");
+                                return -1;
+                            }
+
+                            if (regs + ip->b > limit) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "Register window overflow");
+                                return -1;
+                            }
+
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LEAVE:
+                            programStack += ip->value;
+                            r = regs[ip->a];
+
+                            if (regs[0] == -1)
+                                goto done;
+
+                            ip = code + regs[0];
+                            regs -= regs[1];
+                            regs[ip->dst] = r;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MOVI:
+                            regs[ip->dst] = ip->value;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MOV:
+                            regs[ip->dst] = regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOCAL:
+                            regs[ip->dst] = ip->value + programStack;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOAD1:
+                            regs[ip->dst] = image[regs[ip->a] & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOAD2:
+                            regs[ip->dst] = *(ushort*)&image[regs[ip->a] & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOAD4:
+                            regs[ip->dst] = *(int*)&image[regs[ip->a] & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOADL1:
+                            regs[ip->dst] = image[(ip->value + programStack) & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOADL2:
+                            regs[ip->dst] = *(ushort*)&image[(ip->value + programStack) & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LOADL4:
+                            regs[ip->dst] = *(int*)&image[(ip->value + programStack) & dataMask];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STORE1:
+                            image[regs[ip->a] & dataMask] = (byte)regs[ip->b];
+                            dirty[(regs[ip->a] & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STORE2:
+                            *(short*)&image[regs[ip->a] & dataMask] = (short)regs[ip->b];
+                            dirty[(regs[ip->a] & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                            dirty[((regs[ip->a] & dataMask) + 1) >> VM_DIRTY_SHIFT] = 1;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STORE4:
+                            *(int*)&image[regs[ip->a] & dataMask] = regs[ip->b];
+                            dirty[(regs[ip->a] & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                            dirty[((regs[ip->a] & dataMask) + 3) >> VM_DIRTY_SHIFT] = 1;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STOREL1:
+                            image[(ip->value + programStack) & dataMask] = (byte)regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STOREL2:
+                            *(short*)&image[(ip->value + programStack) & dataMask] = (short)regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STOREL4:
+                            *(int*)&image[(ip->value + programStack) & dataMask] = regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_STORELI4:
+                            *(int*)&image[(ip->value + programStack) & dataMask] = ip->b;
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_BLOCK_COPY:
+                            VM_BlockCopy((uint)regs[ip->a], (uint)regs[ip->b], (uint)ip->value, ref vm);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_CALL:
+                            target = regs[ip->a];
+
+                            if (target < 0) {
+                                registerCode.registerTop = (int)(regs - registers) + ip->b;
+                                regs[ip->dst] = VM_SystemCall(ref vm, image, programStack, target);
+                                ip++;
+                                continue;
+                            }
+
+                            if ((uint)target >= (uint)functions.Length || (target = functions[target]) < 0) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_CALL");
+                                return -1;
+                            }
+
+                            if (regs + ip->b + 2 > limit) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "Register window overflow");
+                                return -1;
+                            }
+
+                            regs[ip->b] = (int)(ip - code);
+                            regs[ip->b + 1] = ip->b;
+                            regs += ip->b;
+                            ip = code + target;
+                            continue;
+                        case vmRegOp_t.ROP_CALLI:
+                            if (regs + ip->b + 2 > limit) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "Register window overflow");
+                                return -1;
+                            }
+
+                            regs[ip->b] = (int)(ip - code);
+                            regs[ip->b + 1] = ip->b;
+                            regs += ip->b;
+                            ip = code + ip->target;
+                            continue;
+                        case vmRegOp_t.ROP_SYSCALL:
+                            registerCode.registerTop = (int)(regs - registers) + ip->b;
+                            regs[ip->dst] = VM_SystemCall(ref vm, image, programStack, ip->value);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_GOTO:
+                            ip = code + ip->target;
+                            continue;
+                        case vmRegOp_t.ROP_JUMP:
+                            target = regs[ip->a];
+
+                            if (target < ip->value || target >= ip->b || (target = jumps[target]) < 0) {
+                                Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_JUMP");
+                                return -1;
+                            }
+
+                            ip = code + target;
+                            continue;
+                        case vmRegOp_t.ROP_EQ:
+                            ip = regs[ip->a] == regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_NE:
+                            ip = regs[ip->a] != regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LTI:
+                            ip = regs[ip->a] < regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LEI:
+                            ip = regs[ip->a] <= regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GTI:
+                            ip = regs[ip->a] > regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GEI:
+                            ip = regs[ip->a] >= regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LTU:
+                            ip = (uint)regs[ip->a] < (uint)regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LEU:
+                            ip = (uint)regs[ip->a] <= (uint)regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GTU:
+                            ip = (uint)regs[ip->a] > (uint)regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GEU:
+                            ip = (uint)regs[ip->a] >= (uint)regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_EQF:
+                            ip = *(float*)&regs[ip->a] == *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_NEF:
+                            ip = *(float*)&regs[ip->a] != *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LTF:
+                            ip = *(float*)&regs[ip->a] < *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LEF:
+                            ip = *(float*)&regs[ip->a] <= *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GTF:
+                            ip = *(float*)&regs[ip->a] > *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GEF:
+                            ip = *(float*)&regs[ip->a] >= *(float*)&regs[ip->b] ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_EQI:
+                            ip = regs[ip->a] == ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_NEI:
+                            ip = regs[ip->a] != ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LTII:
+                            ip = regs[ip->a] < ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LEII:
+                            ip = regs[ip->a] <= ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GTII:
+                            ip = regs[ip->a] > ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GEII:
+                            ip = regs[ip->a] >= ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LTUI:
+                            ip = (uint)regs[ip->a] < (uint)ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_LEUI:
+                            ip = (uint)regs[ip->a] <= (uint)ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GTUI:
+                            ip = (uint)regs[ip->a] > (uint)ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_GEUI:
+                            ip = (uint)regs[ip->a] >= (uint)ip->value ? code + ip->target : ip + 1;
+                            continue;
+                        case vmRegOp_t.ROP_NEGI:
+                            regs[ip->dst] = -regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_BCOM:
+                            regs[ip->dst] = ~regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_SEX8:
+                            regs[ip->dst] = (sbyte)regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_SEX16:
+                            regs[ip->dst] = (short)regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_NEGF:
+                            *(float*)&regs[ip->dst] = -*(float*)&regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_CVIF:
+                            *(float*)&regs[ip->dst] = (float)regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_CVFI:
+                            regs[ip->dst] = (int)(long)*(float*)&regs[ip->a];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_ADD:
+                            regs[ip->dst] = regs[ip->a] + regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_SUB:
+                            regs[ip->dst] = regs[ip->a] - regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_DIVI:
+                            regs[ip->dst] = regs[ip->a] / regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_DIVU:
+                            regs[ip->dst] = (int)((uint)regs[ip->a] / (uint)regs[ip->b]);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MODI:
+                            regs[ip->dst] = regs[ip->a] % regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MODU:
+                            regs[ip->dst] = (int)((uint)regs[ip->a] % (uint)regs[ip->b]);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MULI:
+                            regs[ip->dst] = regs[ip->a] * regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MULU:
+                            regs[ip->dst] = (int)((uint)regs[ip->a] * (uint)regs[ip->b]);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_BAND:
+                            regs[ip->dst] = regs[ip->a] & regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_BOR:
+                            regs[ip->dst] = regs[ip->a] | regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_BXOR:
+                            regs[ip->dst] = regs[ip->a] ^ regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_LSH:
+                            regs[ip->dst] = regs[ip->a] << regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_RSHI:
+                            regs[ip->dst] = regs[ip->a] >> regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_RSHU:
+                            regs[ip->dst] = (int)((uint)regs[ip->a] >> regs[ip->b]);
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_ADDF:
+                            *(float*)&regs[ip->dst] = *(float*)&regs[ip->a] + *(float*)&regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_SUBF:
+                            *(float*)&regs[ip->dst] = *(float*)&regs[ip->a] - *(float*)&regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_DIVF:
+                            *(float*)&regs[ip->dst] = *(float*)&regs[ip->a] / *(float*)&regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_MULF:
+                            *(float*)&regs[ip->dst] = *(float*)&regs[ip->a] * *(float*)&regs[ip->b];
+                            ip++;
+                            continue;
+                        case vmRegOp_t.ROP_ADDI:
+                            regs[ip->dst] = regs[ip->a] + ip->value;
+                            ip++;
+                            continue;
+                        default:
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_INSTRUCTION, "Bad VM instruction");
+                            return -1;
+                    }
+                }
+            }
+
+        done:
+            vm.programStack = stackOnEntry;
+
+            return r;
+        }
+    }
+}
@@ -0,0 +1,434 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text;
+
+// Streaming replication to a hot standby. VM_Replicate writes the full state of
+// a primary to a stream, then every top level call as it happens: a CALL
+// record with the function, the arguments and the pages written since the last
+// record, a SYSCALL record with the result and the pages each syscall wrote,
+// and a RETURN record with the result and the pages the call wrote.
+//
+// A standby is a VM created from the same module. VM_ReplicaApply reads one
+// record at a time and applies the state in it. If the primary goes away in
+// the middle of a call, VM_ReplicaResume replays that call: the guest runs
+// again, its syscalls get the recorded results and memory back without running
+// the handlers, and once the log runs out the remaining syscalls run for real.
+// This relies on guest code being deterministic, which it is short of what it
+// learns from syscalls.
+//
+// The stack is dead between top level calls and the guest writes to it again
+// on replay, so only the full sync sends it. Records are read completely before
+// anything is applied, a record cut off by the primary going away is dropped.
+
+namespace Q3VM2 {
+    unsafe class vmReplication_t {
+        // Primary: the log and the generation the standby is in sync at
+        public BinaryWriter writer;
+        public int generation;
+        public byte[] savedDirty;
+        public byte[] page;
+
+        // Standby: the function and arguments of the call in flight, null when
+        // idle, and what its syscalls returned so far
+        public BinaryReader reader;
+        public int callFunction;
+        public int[] call;
+        public Queue<vmReplicaRecord_t> syscalls;
+    }
+
+    class vmReplicaRecord_t {
+        public int type;
+        public int function;
+        public int[] args;
+        public int index;
+        public int result;
+
+        public List<int> pages = new List<int>();
+        public List<byte[]> data = new List<byte[]>();
+
+        // Null when the record leaves the heap alone
+        public vmHeap_t heap;
+        public int programStack;
+        public vmErrorCode_t lastError;
+    }
+
+    unsafe static partial class VM {
+
+        const int VM_REPLICA_MAGIC = 0x52563351; // "Q3VR"
+        const int VM_REPLICA_VERSION = 3;
+
+        const int VM_REPLICA_SYNC = 1;
+        const int VM_REPLICA_CALL = 2;
+        const int VM_REPLICA_SYSCALL = 3;
+        const int VM_REPLICA_RETURN = 4;
+
+        const int VM_REPLICA_ARGS = 13;
+
+        // Starts streaming vm to a standby, beginning with a full sync
+        public static bool VM_Replicate(ref VirtMachine vm, Stream stream) {
+            vmReplication_t rep = new vmReplication_t();
+
+            if (vm.callLevel != 0) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_RESTORE_ON_RUNNING_VM, "VM_Replicate on running vm");
+                return false;
+            }
+
+            rep.writer = new BinaryWriter(stream, Encoding.UTF8, true);
+            rep.generation = -1;
+
+            try {
+                rep.writer.Write(VM_REPLICA_MAGIC);
+                rep.writer.Write(VM_REPLICA_VERSION);
+                rep.writer.Write(vm.dataMask);
+                rep.writer.Write(VM_ModuleHash(vm.module));
+
+                rep.writer.Write(VM_REPLICA_SYNC);
+                VM_ReplicateState(ref vm, rep);
+                rep.writer.Flush();
+            } catch (IOException e) {
+                Warn("VM_Replicate: {0}\n", e.Message);
+                return false;
+            }
+
+            vm.replication = rep;
+
+            return true;
+        }
+
+        public static void VM_StopReplication(ref VirtMachine vm) {
+            vmReplication_t rep = vm.replication;
+
+            vm.replication = null;
+
+            if (rep != null && rep.writer != null) {
+                try {
+                    rep.writer.Flush();
+                } catch (IOException) {
+                }
+            }
+        }
+
+        // The standby went away, the primary carries on without it
+        static void VM_ReplicationLost(ref VirtMachine vm, IOException e) {
+            Warn("Replication stopped: {0}\n", e.Message);
+            vm.replication = null;
+        }
+
+        // Pages written since the last record, the heap, programStack and
+        // lastError
+        static void VM_ReplicateState(ref VirtMachine vm, vmReplication_t rep) {
+            BinaryWriter writer = rep.writer;
+            int stackPage = vm.stackBottom >> VM_DIRTY_SHIFT;
+            bool full = rep.generation < 0;
+            int generation = VM_CollectDirty(ref vm);
+            int[] pageGenerations = vm.pageGenerations;
+
+            for (int page = 0; page < pageGenerations.Length; page++) {
+                if (full || (pageGenerations[page] > rep.generation && page < stackPage))
+                    VM_ReplicateWritePage(ref vm, rep, page);
+            }
+            writer.Write(-1);
+
+            VM_HeapWrite(writer, vm.heap);
+            writer.Write(vm.programStack);
+            writer.Write((int)vm.lastError);
+
+            rep.generation = generation;
+        }
+
+        static void VM_ReplicateWritePage(ref VirtMachine vm, vmReplication_t rep, int page) {
+            int offset = page << VM_DIRTY_SHIFT;
+            int n = VM_ReplicaPageLength(vm.dataMask, page);
+
+            if (rep.page == null || rep.page.Length < n)
+                rep.page = new byte[n];
+
+            Marshal.Copy((IntPtr)(vm.dataBase + offset), rep.page, 0, n);
+            rep.writer.Write(page);
+            rep.writer.Write(rep.page, 0, n);
+        }
+
+        // Like snapshots, the last page takes the slack behind the segment along
+        static int VM_ReplicaPageLength(int dataMask, int page) {
+            return Math.Min(VM_DIRTY_PAGE, VM_DataExtent(dataMask) - (page << VM_DIRTY_SHIFT));
+        }
+
+        static void VM_ReplicateCall(ref VirtMachine vm, int function, int* args) {
+            vmReplication_t rep = vm.replication;
+
+            if (rep.writer == null)
+                return;
+
+            try {
+                rep.writer.Write(VM_REPLICA_CALL);
+                VM_ReplicateState(ref vm, rep);
+                rep.writer.Write(function);
+
+                for (int i = 0; i < VM_REPLICA_ARGS; i++)
+                    rep.writer.Write(args[i]);
+
+                rep.writer.Flush();
+            } catch (IOException e) {
+                VM_ReplicationLost(ref vm, e);
+            }
+        }
+
+        static void VM_ReplicateReturn(ref VirtMachine vm, int result) {
+            vmReplication_t rep = vm.replication;
+
+            if (rep.writer == null)
+                return;
+
+            try {
+                rep.writer.Write(VM_REPLICA_RETURN);
+                rep.writer.Write(result);
+                VM_ReplicateState(ref vm, rep);
+                rep.writer.Flush();
+            } catch (IOException e) {
+                VM_ReplicationLost(ref vm, e);
+            }
+        }
+
+        // Runs a syscall of the top level call and logs what it did to guest
+        // memory. The marks the guest made before it are set aside so only the
+        // pages the handler wrote get logged, nested calls included
+        static int VM_ReplicateSystemCall(ref VirtMachine vm, int* args) {
+            vmReplication_t rep = vm.replication;
+            int pages = (vm.dataMask + 1) >> VM_DIRTY_SHIFT;
+            byte* dirty = vm.dirtyPages;
+            int heapChanges;
+            int r;
+
+            if (rep.writer == null)
+                return VM_ReplaySystemCall(ref vm, rep, args);
+
+            if (rep.savedDirty == null || rep.savedDirty.Length != pages)
+                rep.savedDirty = new byte[pages];
+
+            Marshal.Copy((IntPtr)dirty, rep.savedDirty, 0, pages);
+            memset(dirty, 0, (uint)pages);
+            heapChanges = vm.heap.allocations + vm.heap.frees;
+
+            try {
+                r = VM_DispatchSystemCall(ref vm, args);
+
+                if (vm.replication == rep) {
+                    try {
+                        rep.writer.Write(VM_REPLICA_SYSCALL);
+                        rep.writer.Write(args[0]);
+                        rep.writer.Write(r);
+
+                        for (int page = 0; page < pages; page++) {
+                            if (dirty[page] != 0)
+                                VM_ReplicateWritePage(ref vm, rep, page);
+                        }
+                        rep.writer.Write(-1);
+
+                        if (vm.heap.allocations + vm.heap.frees != heapChanges) {
+                            rep.writer.Write(true);
+                            VM_HeapWrite(rep.writer, vm.heap);
+                        } else {
+                            rep.writer.Write(false);
+                        }
+
+                        rep.writer.Flush();
+                    } catch (IOException e) {
+                        VM_ReplicationLost(ref vm, e);
+                    }
+                }
+            } finally {
+                for (int page = 0; page < pages; page++)
+                    dirty[page] |= rep.savedDirty[page];
+            }
+
+            return r;
+        }
+
+        // Standby side, checks that vm runs the same module as the primary
+        public static vmReplication_t VM_ReplicaOpen(ref VirtMachine vm, Stream stream) {
+            vmReplication_t replica = new vmReplication_t();
+
+            replica.reader = new BinaryReader(stream, Encoding.UTF8, true);
+            replica.syscalls = new Queue<vmReplicaRecord_t>();
+
+            if (replica.reader.ReadInt32() != VM_REPLICA_MAGIC || replica.reader.ReadInt32() != VM_REPLICA_VERSION) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_REPLICA_MISMATCH, "Not a replication stream");
+                return null;
+            }
+
+            if (replica.reader.ReadInt32() != vm.dataMask || replica.reader.ReadString() != VM_ModuleHash(vm.module)) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_REPLICA_MISMATCH, "Replication stream is for another module");
+                return null;
+            }
+
+            return replica;
+        }
+
+        // Applies the next record, false once the stream ends
+        public static bool VM_ReplicaApply(ref VirtMachine vm, vmReplication_t replica) {
+            vmReplicaRecord_t record;
+
+            if (vm.callLevel != 0) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_RESTORE_ON_RUNNING_VM, "VM_ReplicaApply on running vm");
+                return false;
+            }
+
+            try {
+                record = VM_ReplicaRead(ref vm, replica.reader);
+            } catch (EndOfStreamException) {
+                return false;
+            }
+
+            switch (record.type) {
+                case VM_REPLICA_SYNC:
+                    VM_ReplicaApplyState(ref vm, record);
+                    replica.call = null;
+                    replica.syscalls.Clear();
+                    break;
+                case VM_REPLICA_CALL:
+                    VM_ReplicaApplyState(ref vm, record);
+                    replica.callFunction = record.function;
+                    replica.call = record.args;
+                    replica.syscalls.Clear();
+                    break;
+                case VM_REPLICA_SYSCALL:
+                    replica.syscalls.Enqueue(record);
+                    break;
+                case VM_REPLICA_RETURN:
+                    VM_ReplicaApplyState(ref vm, record);
+                    replica.call = null;
+                    replica.syscalls.Clear();
+                    break;
+            }
+
+            return true;
+        }
+
+        // Finishes the call the primary was in when the log ended. False when
+        // there was none
+        public static bool VM_ReplicaResume(ref VirtMachine vm, vmReplication_t replica, out IntPtr result) {
+            int[] args = replica.call;
+
+            result = IntPtr.Zero;
+
+            if (args == null)
+                return false;
+
+            replica.call = null;
+            vm.replication = replica;
+
+            try {
+                result = VM_CallFunction(ref vm, replica.callFunction, args);
+            } finally {
+                vm.replication = null;
+                replica.syscalls.Clear();
+            }
+
+            return true;
+        }
+
+        static int VM_ReplaySystemCall(ref VirtMachine vm, vmReplication_t replica, int* args) {
+            vmReplicaRecord_t record;
+
+            if (replica.syscalls.Count == 0 || replica.syscalls.Peek().index != args[0]) {
+                // Past the end of the log, from here on the syscalls are live
+                vm.replication = null;
+                return VM_DispatchSystemCall(ref vm, args);
+            }
+
+            record = replica.syscalls.Dequeue();
+
+            VM_ReplicaApplyPages(ref vm, record);
+            if (record.heap != null)
+                VM_HeapCopy(vm.heap, record.heap);
+
+            return record.result;
+        }
+
+        static vmReplicaRecord_t VM_ReplicaRead(ref VirtMachine vm, BinaryReader reader) {
+            vmReplicaRecord_t record = new vmReplicaRecord_t();
+
+            record.type = reader.ReadInt32();
+
+            switch (record.type) {
+                case VM_REPLICA_SYNC:
+                    VM_ReplicaReadState(ref vm, reader, record);
+                    break;
+                case VM_REPLICA_CALL:
+                    VM_ReplicaReadState(ref vm, reader, record);
+                    record.function = reader.ReadInt32();
+                    record.args = new int[VM_REPLICA_ARGS];
+                    for (int i = 0; i < VM_REPLICA_ARGS; i++)
+                        record.args[i] = reader.ReadInt32();
+                    break;
+                case VM_REPLICA_SYSCALL:
+                    record.index = reader.ReadInt32();
+                    record.result = reader.ReadInt32();
+                    VM_ReplicaReadPages(ref vm, reader, record);
+                    if (reader.ReadBoolean()) {
+                        record.heap = VM_HeapEmpty();
+                        VM_HeapRead(reader, record.heap);
+                    }
+                    break;
+                case VM_REPLICA_RETURN:
+                    record.result = reader.ReadInt32();
+                    VM_ReplicaReadState(ref vm, reader, record);
+                    break;
+                default:
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_REPLICA_MISMATCH, "Bad replication record");
+                    break;
+            }
+
+            return record;
+        }
+
+        static void VM_ReplicaReadState(ref VirtMachine vm, BinaryReader reader, vmReplicaRecord_t record) {
+            VM_ReplicaReadPages(ref vm, reader, record);
+
+            record.heap = VM_HeapEmpty();
+            VM_HeapRead(reader, record.heap);
+            record.programStack = reader.ReadInt32();
+            record.lastError = (vmErrorCode_t)reader.ReadInt32();
+        }
+
+        static void VM_ReplicaReadPages(ref VirtMachine vm, BinaryReader reader, vmReplicaRecord_t record) {
+            int pages = (vm.dataMask + 1) >> VM_DIRTY_SHIFT;
+            int page;
+
+            while ((page = reader.ReadInt32()) != -1) {
+                byte[] data;
+
+                if ((uint)page >= (uint)pages) {
+                    Com_Error(vm.lastError = vmErrorCode_t.VM_REPLICA_MISMATCH, "Bad page in replication record");
+                    return;
+                }
+
+                data = reader.ReadBytes(VM_ReplicaPageLength(vm.dataMask, page));
+                if (data.Length != VM_ReplicaPageLength(vm.dataMask, page))
+                    throw new EndOfStreamException();
+
+                record.pages.Add(page);
+                record.data.Add(data);
+            }
+        }
+
+        static void VM_ReplicaApplyState(ref VirtMachine vm, vmReplicaRecord_t record) {
+            VM_ReplicaApplyPages(ref vm, record);
+            VM_HeapCopy(vm.heap, record.heap);
+
+            vm.programStack = record.programStack;
+            vm.lastError = record.lastError;
+        }
+
+        static void VM_ReplicaApplyPages(ref VirtMachine vm, vmReplicaRecord_t record) {
+            for (int i = 0; i < record.pages.Count; i++) {
+                int offset = record.pages[i] << VM_DIRTY_SHIFT;
+
+                Marshal.Copy(record.data[i], 0, (IntPtr)(vm.dataBase + offset), record.data[i].Length);
+                VM_MarkDirty(ref vm, offset, record.data[i].Length);
+            }
+        }
+    }
+}
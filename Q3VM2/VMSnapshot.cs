@@ -0,0 +1,237 @@
+﻿using System;
+using System.Collections.Generic;
+
+// In-memory snapshots for rollback. A snapshot holds a copy of the data
+// segment, the program stack, the heap bookkeeping and lastError, which is all
+// the guest visible state of an idle VM. Engine state only depends on the code
+// and is left alone.
+//
+// Snapshots are pooled per VM. VM_ReleaseSnapshot hands one back and the next
+// VM_Snapshot reuses its buffer and heap containers, so a steady snapshot and
+// rollback cycle stops allocating once the pool has warmed up.
+//
+// Every engine marks the page it stores to in vm.dirtyPages, one byte per
+// VM_DIRTY_PAGE bytes of the data segment. The table is a host allocation of
+// its own, no guest address reaches it even with guard pages. Snapshotting or restoring folds the
+// marks into pageGenerations, the generation a page was last written in. A
+// snapshot remembers the generation it was in sync at, so refreshing or
+// restoring it only copies the pages written since. The program stack is not
+// marked, frames and arguments are written all over the place, so its pages
+// always count as written. Every engine raises VM_STACK_OVERFLOW on a frame
+// below stackBottom, so unmarked frame stores never reach other pages.
+
+namespace Q3VM2 {
+    unsafe class vmSnapshot_t {
+        public byte* data;
+        public int dataAlloc;
+
+        public int programStack;
+        public vmErrorCode_t lastError;
+        public vmHeap_t heap;
+
+        // The pageGenerations of the vm the snapshot is in sync with, and at
+        // which generation
+        public int[] pageGenerations;
+        public int generation;
+    }
+
+    unsafe static partial class VM {
+
+        const int VM_DIRTY_SHIFT = 12;
+        const int VM_DIRTY_PAGE = 1 << VM_DIRTY_SHIFT;
+
+        // The data segment and its 4 bytes of slack for unaligned loads
+        static int VM_DataExtent(int dataMask) {
+            return dataMask + 1 + 4;
+        }
+
+        // A clear dirty page table for vm.dataAlloc bytes. It covers the whole
+        // pages they are mapped in, a guarded segment leaves the slack up to the
+        // end of its last page reachable and stores there mark past the segment
+        static byte* VM_AllocDirty(ref VirtMachine vm) {
+            int pageSize = Math.Max(Environment.SystemPageSize, VM_DIRTY_PAGE);
+            int length = (int)(((long)vm.dataAlloc + pageSize - 1) / pageSize * pageSize >> VM_DIRTY_SHIFT);
+            byte* dirty = (byte*)Com_malloc((uint)length, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+
+            if (dirty != null)
+                memset(dirty, 0, (uint)length);
+
+            return dirty;
+        }
+
+        // For host code writing to guest memory, syscalls in particular
+        public static void VM_MarkDirty(ref VirtMachine vm, int vmAddr, int length) {
+            int pages = (vm.dataMask + 1) >> VM_DIRTY_SHIFT;
+            int first;
+            int last;
+
+            if (length <= 0 || vm.dirtyPages == null)
+                return;
+
+            vmAddr &= vm.dataMask;
+            first = vmAddr >> VM_DIRTY_SHIFT;
+            last = Math.Min(first + (int)(((vmAddr & (VM_DIRTY_PAGE - 1)) + (long)length - 1) >> VM_DIRTY_SHIFT), pages - 1);
+
+            for (int page = first; page <= last; page++)
+                vm.dirtyPages[page] = 1;
+        }
+
+        // Starts a new generation and stamps every page marked since the last one
+        static int VM_CollectDirty(ref VirtMachine vm) {
+            int pages = (vm.dataMask + 1) >> VM_DIRTY_SHIFT;
+            int stackPage = vm.stackBottom >> VM_DIRTY_SHIFT;
+            int generation = ++vm.generation;
+            int[] pageGenerations = vm.pageGenerations;
+            byte* dirty = vm.dirtyPages;
+
+            if (pageGenerations == null)
+                pageGenerations = vm.pageGenerations = new int[pages];
+
+            for (int page = 0; page < pages; page++) {
+                if (dirty[page] != 0 || page >= stackPage) {
+                    dirty[page] = 0;
+                    pageGenerations[page] = generation;
+                }
+            }
+
+            return generation;
+        }
+
+        // Copies the pages written after generation from src to dest, the last
+        // page takes the slack behind the data segment along
+        static void VM_CopyDirty(ref VirtMachine vm, byte* dest, byte* src, int generation) {
+            int[] pageGenerations = vm.pageGenerations;
+            int length = VM_DataExtent(vm.dataMask);
+
+            for (int page = 0; page < pageGenerations.Length; page++) {
+                if (pageGenerations[page] > generation) {
+                    int offset = page << VM_DIRTY_SHIFT;
+                    int n = page == pageGenerations.Length - 1 ? length - offset : VM_DIRTY_PAGE;
+
+                    Buffer.MemoryCopy(src + offset, dest + offset, n, n);
+                }
+            }
+        }
+
+        public static vmSnapshot_t VM_Snapshot(ref VirtMachine vm) {
+            vmSnapshot_t snapshot = null;
+
+            if (vm.snapshotPool != null && vm.snapshotPool.Count != 0)
+                snapshot = vm.snapshotPool.Pop();
+            else
+                snapshot = new vmSnapshot_t();
+
+            VM_Snapshot(ref vm, snapshot);
+
+            return snapshot;
+        }
+
+        // Overwrites snapshot with the current state of vm, only the pages
+        // written since when it was last in sync with vm
+        public static void VM_Snapshot(ref VirtMachine vm, vmSnapshot_t snapshot) {
+            int length = VM_DataExtent(vm.dataMask);
+            bool inSync = snapshot.data != null && snapshot.pageGenerations != null && snapshot.pageGenerations == vm.pageGenerations;
+            int generation = VM_CollectDirty(ref vm);
+
+            if (snapshot.data == null || snapshot.dataAlloc != length) {
+                if (snapshot.data != null)
+                    Com_free(snapshot.data, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+
+                snapshot.data = (byte*)Com_malloc((uint)length, ref vm, vmMallocType_t.VM_ALLOC_DATA_SEC);
+                snapshot.dataAlloc = length;
+                inSync = false;
+            }
+
+            if (snapshot.heap == null)
+                snapshot.heap = VM_HeapEmpty();
+
+            if (inSync)
+                VM_CopyDirty(ref vm, snapshot.data, vm.dataBase, snapshot.generation);
+            else
+                Buffer.MemoryCopy(vm.dataBase, snapshot.data, length, length);
+
+            VM_HeapCopy(snapshot.heap, vm.heap);
+
+            snapshot.programStack = vm.programStack;
+            snapshot.lastError = vm.lastError;
+            snapshot.pageGenerations = vm.pageGenerations;
+            snapshot.generation = generation;
+        }
+
+        // Puts vm back into the state it had when snapshot was taken. The
+        // snapshot stays valid and can be restored again
+        public static bool VM_Restore(ref VirtMachine vm, vmSnapshot_t snapshot) {
+            int length = VM_DataExtent(vm.dataMask);
+            int since = snapshot != null ? snapshot.generation : 0;
+            int generation;
+
+            if (vm.callLevel != 0 || VM_Suspended(ref vm)) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_RESTORE_ON_RUNNING_VM, "VM_Restore on running vm");
+                return false;
+            }
+
+            if (snapshot == null || snapshot.data == null || snapshot.dataAlloc != length) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_SNAPSHOT_MISMATCH, "Snapshot does not belong to this vm");
+                return false;
+            }
+
+            VM_CollectDirty(ref vm);
+
+            if (snapshot.pageGenerations == vm.pageGenerations) {
+                VM_CopyDirty(ref vm, vm.dataBase, snapshot.data, since);
+            } else {
+                Buffer.MemoryCopy(snapshot.data, vm.dataBase, length, length);
+                since = -1;
+            }
+
+            // What was just copied back differs from every other snapshot
+            generation = ++vm.generation;
+            for (int page = 0; page < vm.pageGenerations.Length; page++) {
+                if (vm.pageGenerations[page] > since)
+                    vm.pageGenerations[page] = generation;
+            }
+
+            VM_HeapCopy(vm.heap, snapshot.heap);
+
+            vm.programStack = snapshot.programStack;
+            vm.lastError = snapshot.lastError;
+
+            snapshot.pageGenerations = vm.pageGenerations;
+            snapshot.generation = generation;
+
+            return true;
+        }
+
+        public static void VM_ReleaseSnapshot(ref VirtMachine vm, vmSnapshot_t snapshot) {
+            if (snapshot == null)
+                return;
+
+            if (vm.snapshotPool == null)
+                vm.snapshotPool = new Stack<vmSnapshot_t>();
+
+            vm.snapshotPool.Push(snapshot);
+        }
+
+        // For snapshots that are not released back into a pool
+        public static void VM_FreeSnapshot(vmSnapshot_t snapshot) {
+            if (snapshot == null || snapshot.data == null)
+                return;
+
+            Com_free(snapshot.data, vmMallocType_t.VM_ALLOC_DATA_SEC);
+            snapshot.data = null;
+            snapshot.dataAlloc = 0;
+            snapshot.heap = null;
+            snapshot.pageGenerations = null;
+        }
+
+        static void VM_FreeSnapshotPool(ref VirtMachine vm) {
+            if (vm.snapshotPool == null)
+                return;
+
+            while (vm.snapshotPool.Count != 0)
+                VM_FreeSnapshot(vm.snapshotPool.Pop());
+
+            vm.snapshotPool = null;
+        }
+    }
+}
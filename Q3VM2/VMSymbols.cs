@@ -0,0 +1,163 @@
+﻿using System;
+using System.Globalization;
+using System.IO;
+
+// Code symbols and direct calls. VM_LoadSymbols reads the .map file q3asm
+// writes next to the .qvm, a "segment value name" line per symbol, and keeps
+// the code segment ones, whose value is the instruction the function starts
+// at. The host looks a function up once with VM_FindFunction, keeps the result
+// as a handle and VM_CallFunction enters it directly, instead of going through
+// vmMain and its dispatch on the command.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        const int VM_MAP_CODE_SEGMENT = 0;
+
+        // Replaces the symbols of module, instances created before keep seeing
+        // the old ones. The number of code symbols or -1
+        public static int VM_LoadSymbols(vmModule_t module, string path) {
+            vmSymbol_t* symbols = null;
+            vmSymbol_t** prev = &symbols;
+            int count = 0;
+            string[] lines;
+
+            try {
+                lines = File.ReadAllLines(path);
+            } catch (IOException e) {
+                Warn("VM_LoadSymbols: {0}\n", e.Message);
+                return -1;
+            }
+
+            foreach (string line in lines) {
+                string[] tokens = line.Split((char[])null, StringSplitOptions.RemoveEmptyEntries);
+                int segment;
+                int value;
+
+                if (tokens.Length < 3 || !int.TryParse(tokens[0], out segment) ||
+                    !int.TryParse(tokens[1], NumberStyles.HexNumber, CultureInfo.InvariantCulture, out value)) {
+                    Warn("Warning: bad line in {0}: {1}\n", path, line);
+                    continue;
+                }
+
+                if (segment != VM_MAP_CODE_SEGMENT)
+                    continue;
+
+                if (value < 0 || value >= module.instructionCount) {
+                    Warn("Warning: {0} is outside the code of {1}\n", tokens[2], module.Name);
+                    continue;
+                }
+
+                *prev = VM_NewSymbol(tokens[2], value);
+                prev = &(*prev)->next;
+                count++;
+            }
+
+            VM_FreeSymbols(module);
+            module.symbols = symbols;
+            module.numSymbols = count;
+
+            return count;
+        }
+
+        static vmSymbol_t* VM_NewSymbol(string name, int value) {
+            vmSymbol_t* symbol = (vmSymbol_t*)Com_malloc((uint)(sizeof(vmSymbol_t) + name.Length * sizeof(char)), vmMallocType_t.VM_ALLOC_DEBUG);
+            char* symName = symbol->symName;
+
+            symbol->next = null;
+            symbol->symValue = value;
+            symbol->profileCount = 0;
+
+            for (int i = 0; i < name.Length; i++)
+                symName[i] = name[i];
+            symName[name.Length] = '\0';
+
+            return symbol;
+        }
+
+        static void VM_FreeSymbols(vmModule_t module) {
+            vmSymbol_t* symbol = module.symbols;
+
+            while (symbol != null) {
+                vmSymbol_t* next = symbol->next;
+
+                Com_free(symbol, vmMallocType_t.VM_ALLOC_DEBUG);
+                symbol = next;
+            }
+
+            module.symbols = null;
+            module.numSymbols = 0;
+        }
+
+        static bool VM_SymbolIs(vmSymbol_t* symbol, string name) {
+            char* symName = symbol->symName;
+            int i;
+
+            for (i = 0; i < name.Length; i++) {
+                if (symName[i] != name[i])
+                    return false;
+            }
+
+            return symName[i] == '\0';
+        }
+
+        // Whether instruction is where a function starts
+        static bool VM_IsFunction(vmModule_t module, int instruction) {
+            if (instruction < 0 || instruction >= module.instructionCount)
+                return false;
+
+            if (module.functionStarts != null)
+                return Array.BinarySearch(module.functionStarts, instruction) >= 0;
+
+            return (module.codeBase[module.instructionPointers[instruction]] & VM_OPCODE_MASK) == (int)opcode_t.OP_ENTER;
+        }
+
+        // The handle for VM_CallFunction, -1 when there is no such function
+        public static int VM_FindFunction(ref VirtMachine vm, string name) {
+            for (vmSymbol_t* symbol = vm.symbols; symbol != null; symbol = symbol->next) {
+                if (VM_SymbolIs(symbol, name))
+                    return VM_IsFunction(vm.module, symbol->symValue) ? symbol->symValue : -1;
+            }
+
+            return -1;
+        }
+
+        public static IntPtr VM_CallFunction(ref VirtMachine vm, int function, params int[] args) {
+            fixed (int* a = args) {
+                return VM_CallFunction(ref vm, function, a, args != null ? args.Length : 0);
+            }
+        }
+
+        // Calls the function at instruction function with count arguments, floats
+        // go as their bits
+        public static IntPtr VM_CallFunction(ref VirtMachine vm, int function, int* args, int count) {
+            int* callArgs = stackalloc int[13];
+
+            if (vm.codeLength < 1) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_NOT_LOADED, "VM not loaded");
+                return (IntPtr)(-1);
+            }
+
+            if (!VM_IsFunction(vm.module, function)) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM_CallFunction on something that is not a function");
+                return (IntPtr)(-1);
+            }
+
+            if (count < 0 || count > 13) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_ARGUMENTS, "VM_CallFunction with more than 13 arguments");
+                return (IntPtr)(-1);
+            }
+
+            for (int i = 0; i < count; i++)
+                callArgs[i] = args[i];
+
+            byte* opStack = null;
+            if (vm.interpret == vmInterpret_t.VMI_BYTECODE) {
+                byte* buffer = stackalloc byte[VM_OPSTACK_SIZE];
+                opStack = buffer;
+            }
+
+            return VM_CallEntry(ref vm, function, callArgs, opStack);
+        }
+    }
+}
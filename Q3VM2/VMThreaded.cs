@@ -0,0 +1,585 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+// Direct-threaded variant of VM_CallInterpreted. Every QVM instruction becomes
+// one fixed size record holding its handler and operand, with branch targets
+// already resolved to record numbers. Record numbers equal instruction numbers,
+// so OP_JUMP, OP_CALL and OP_LEAVE need no instructionPointers lookup either.
+// VM_CallInterpreted stays the reference engine.
+//
+// Common lcc sequences are fused into superinstructions by rewriting the
+// handler of the first record only. The records they cover are left intact and
+// the fused handler reads its extra operands from them, so a jump landing in
+// the middle of a sequence still executes the original instructions.
+//
+// Constant calls and jumps inside functions VM_Verify accepted get handlers
+// without the target checks, whether fusion is enabled or not.
+
+namespace Q3VM2 {
+    [StructLayout(LayoutKind.Sequential)]
+    struct vmThreadedInstruction_t {
+        public int handler;
+        public int value;
+    }
+
+    enum vmFusedOp_t {
+        FOP_LOCAL_LOAD4 = opcode_t.OP_MAX,
+        FOP_LOCAL_CONST_STORE4,
+        FOP_CONST_ADD,
+        FOP_CONST_CALL,
+        FOP_CONST_EQ,
+        FOP_CONST_NE,
+        FOP_CONST_LTI,
+        FOP_CONST_LEI,
+        FOP_CONST_GTI,
+        FOP_CONST_GEI,
+
+        // Verified targets only
+        FOP_CONST_SYSCALL,
+        FOP_CONST_CALL_VERIFIED,
+        FOP_CONST_JUMP_VERIFIED,
+
+        // Tiered execution, see VMTiered.cs
+        FOP_TIER_ENTER,
+        FOP_TIER_LOOP,
+        FOP_TIER_COMPILED
+    }
+
+    unsafe static partial class VM {
+
+        public static bool vm_fuseInstructions = true;
+
+        static int VM_PrepareThreaded(ref VirtMachine vm) {
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+
+            vm.threadedCode = (vmThreadedInstruction_t*)Com_malloc((uint)(code.Length * sizeof(vmThreadedInstruction_t)), ref vm, vmMallocType_t.VM_ALLOC_CODE_SEC);
+            if (vm.threadedCode == null) {
+                Com_Error(vmErrorCode_t.VM_MALLOC_FAILED, "Threaded code malloc failed: out of memory?");
+                return -1;
+            }
+
+            for (int i = 0; i < code.Length; i++) {
+                vm.threadedCode[i].handler = (int)code[i].op;
+                vm.threadedCode[i].value = code[i].value;
+            }
+
+            vm.fusedInstructions = vm_fuseInstructions ? VM_FuseInstructions(vm.threadedCode, code) : 0;
+
+            if (vm.verifiedFunctions != null)
+                VM_ThreadVerified(vm.threadedCode, code, vm.verifiedFunctions);
+
+            return 0;
+        }
+
+        static int VM_FuseInstructions(vmThreadedInstruction_t* threaded, vmInstruction_t[] code) {
+            int fused = 0;
+
+            for (int i = 0; i < code.Length - 1; i++) {
+                opcode_t next = code[i + 1].op;
+                int handler = -1;
+
+                switch (code[i].op) {
+                    case opcode_t.OP_LOCAL:
+                        if (next == opcode_t.OP_LOAD4) {
+                            handler = (int)vmFusedOp_t.FOP_LOCAL_LOAD4;
+                        } else if (next == opcode_t.OP_CONST && i + 2 < code.Length && code[i + 2].op == opcode_t.OP_STORE4) {
+                            handler = (int)vmFusedOp_t.FOP_LOCAL_CONST_STORE4;
+                        }
+                        break;
+                    case opcode_t.OP_CONST:
+                        switch (next) {
+                            case opcode_t.OP_ADD: handler = (int)vmFusedOp_t.FOP_CONST_ADD; break;
+                            case opcode_t.OP_CALL: handler = (int)vmFusedOp_t.FOP_CONST_CALL; break;
+                            case opcode_t.OP_EQ: handler = (int)vmFusedOp_t.FOP_CONST_EQ; break;
+                            case opcode_t.OP_NE: handler = (int)vmFusedOp_t.FOP_CONST_NE; break;
+                            case opcode_t.OP_LTI: handler = (int)vmFusedOp_t.FOP_CONST_LTI; break;
+                            case opcode_t.OP_LEI: handler = (int)vmFusedOp_t.FOP_CONST_LEI; break;
+                            case opcode_t.OP_GTI: handler = (int)vmFusedOp_t.FOP_CONST_GTI; break;
+                            case opcode_t.OP_GEI: handler = (int)vmFusedOp_t.FOP_CONST_GEI; break;
+                        }
+                        break;
+                }
+
+                if (handler != -1) {
+                    threaded[i].handler = handler;
+                    fused++;
+                }
+            }
+
+            return fused;
+        }
+
+        static void VM_ThreadVerified(vmThreadedInstruction_t* threaded, vmInstruction_t[] code, bool[] verifiedFunctions) {
+            bool verified = false;
+
+            for (int i = 0; i < code.Length - 1; i++) {
+                if (code[i].op == opcode_t.OP_ENTER)
+                    verified = verifiedFunctions[i];
+
+                if (!verified || code[i].op != opcode_t.OP_CONST)
+                    continue;
+
+                if (code[i + 1].op == opcode_t.OP_CALL)
+                    threaded[i].handler = (int)(code[i].value < 0 ? vmFusedOp_t.FOP_CONST_SYSCALL : vmFusedOp_t.FOP_CONST_CALL_VERIFIED);
+                else if (code[i + 1].op == opcode_t.OP_JUMP)
+                    threaded[i].handler = (int)vmFusedOp_t.FOP_CONST_JUMP_VERIFIED;
+            }
+        }
+
+        static int VM_CallThreaded(ref VirtMachine vm, int function, int* args) {
+            int programStack;
+            int stackOnEntry;
+            byte* image;
+            int r;
+
+            programStack = stackOnEntry = vm.programStack;
+            image = vm.dataBase;
+
+            programStack -= (8 + 4 * 13);
+
+            for (int arg = 0; arg < 13; arg++) {
+                *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+            }
+
+            *(int*)&image[programStack + 4] = 0;
+
+            r = VM_ThreadedExecute(ref vm, function, programStack);
+
+            vm.programStack = stackOnEntry;
+
+            return r;
+        }
+
+        // Runs the function at instruction entry until it returns, programStack
+        // is the caller's frame with the arguments already in place
+        static int VM_ThreadedExecute(ref VirtMachine vm, int entry, int programStack) {
+            byte* stack = stackalloc byte[1024 + 15];
+
+            int* opStack;
+            byte opStackOfs;
+            vmThreadedInstruction_t* code;
+            vmThreadedInstruction_t* ip;
+            byte* image;
+            byte* dirty;
+            int dataMask;
+            int stackBottom;
+            int instructionCount;
+            int handler;
+            int r0, r1;
+
+            vm.currentlyInterpreting = 1;
+
+            image = vm.dataBase;
+            dirty = vm.dirtyPages;
+            code = vm.threadedCode;
+            dataMask = VM_AccessMask(ref vm);
+            stackBottom = vm.stackBottom;
+            instructionCount = vm.instructionCount;
+            ip = code + entry;
+
+            *(int*)&image[programStack] = -1;
+
+            opStack = (int*)stack;
+            *opStack = 0x0000BEEF;
+            opStackOfs = 0;
+
+            while (true) {
+                r0 = opStack[opStackOfs];
+                r1 = opStack[(byte)(opStackOfs - 1)];
+            nextInstruction2:
+                handler = ip->handler;
+            dispatch:
+                switch (handler) {
+                    case (int)opcode_t.OP_UNDEF:
+                        Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_INSTRUCTION, "Bad VM instruction");
+                        return -1;
+                    case (int)opcode_t.OP_IGNORE:
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_BREAK:
+                        vm.breakCount++;
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_CONST:
+                        r1 = r0;
+                        r0 = opStack[++opStackOfs] = ip->value;
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_LOCAL:
+                        r1 = r0;
+                        r0 = opStack[++opStackOfs] = ip->value + programStack;
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_LOAD4:
+                        r0 = opStack[opStackOfs] = *(int*)&image[r0 & dataMask];
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_LOAD2:
+                        r0 = opStack[opStackOfs] = *(ushort*)&image[r0 & dataMask];
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_LOAD1:
+                        r0 = opStack[opStackOfs] = image[r0 & dataMask];
+                        ip++;
+                        goto nextInstruction2;
+                    case (int)opcode_t.OP_STORE4:
+                        *(int*)&image[r1 & dataMask] = r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                        dirty[((r1 & dataMask) + 3) >> VM_DIRTY_SHIFT] = 1;
+                        opStackOfs -= 2;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_STORE2:
+                        *(short*)&image[r1 & dataMask] = (short)r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                        dirty[((r1 & dataMask) + 1) >> VM_DIRTY_SHIFT] = 1;
+                        opStackOfs -= 2;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_STORE1:
+                        image[r1 & dataMask] = (byte)r0;
+                        dirty[(r1 & dataMask) >> VM_DIRTY_SHIFT] = 1;
+                        opStackOfs -= 2;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_ARG:
+                        *(int*)&image[(ip->value + programStack) & dataMask] = r0;
+                        opStackOfs--;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_BLOCK_COPY:
+                        VM_BlockCopy((uint)r1, (uint)r0, (uint)ip->value, ref vm);
+                        opStackOfs -= 2;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_CALL:
+                        *(int*)&image[programStack] = (int)(ip - code) + 1;
+                        opStackOfs--;
+
+                        if (r0 < 0) {
+                            opStack[++opStackOfs] = VM_SystemCall(ref vm, image, programStack, r0);
+                            ip++;
+                        } else if ((uint)r0 >= (uint)instructionCount) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_CALL");
+                            return -1;
+                        } else {
+                            ip = code + r0;
+                        }
+                        continue;
+                    case (int)opcode_t.OP_PUSH:
+                        opStackOfs++;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_POP:
+                        opStackOfs--;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_ENTER:
+                        programStack -= ip->value;
+
+                        // Frame stores are not marked dirty, they have to stay
+                        // on the stack pages
+                        if (programStack < stackBottom) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "VM stack overflow");
+                            return -1;
+                        }
+
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_LEAVE:
+                        programStack += ip->value;
+                        r0 = *(int*)&image[programStack];
+
+                        if (r0 == -1) {
+                            goto done;
+                        } else if ((uint)r0 >= (uint)instructionCount) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_LEAVE");
+                            return -1;
+                        }
+
+                        ip = code + r0;
+                        continue;
+                    case (int)opcode_t.OP_JUMP:
+                        if ((uint)r0 >= (uint)instructionCount) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_JUMP");
+                            return -1;
+                        }
+
+                        opStackOfs--;
+                        ip = code + r0;
+                        continue;
+                    case (int)opcode_t.OP_EQ:
+                        opStackOfs -= 2;
+                        ip = r1 == r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_NE:
+                        opStackOfs -= 2;
+                        ip = r1 != r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LTI:
+                        opStackOfs -= 2;
+                        ip = r1 < r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LEI:
+                        opStackOfs -= 2;
+                        ip = r1 <= r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GTI:
+                        opStackOfs -= 2;
+                        ip = r1 > r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GEI:
+                        opStackOfs -= 2;
+                        ip = r1 >= r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LTU:
+                        opStackOfs -= 2;
+                        ip = (uint)r1 < (uint)r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LEU:
+                        opStackOfs -= 2;
+                        ip = (uint)r1 <= (uint)r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GTU:
+                        opStackOfs -= 2;
+                        ip = (uint)r1 > (uint)r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GEU:
+                        opStackOfs -= 2;
+                        ip = (uint)r1 >= (uint)r0 ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_EQF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) == VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_NEF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) != VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LTF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) < VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_LEF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) <= VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GTF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) > VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_GEF:
+                        opStackOfs -= 2;
+                        ip = VM_IntToFloat(r1) >= VM_IntToFloat(r0) ? code + ip->value : ip + 1;
+                        continue;
+                    case (int)opcode_t.OP_NEGI:
+                        opStack[opStackOfs] = -r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_ADD:
+                        opStack[--opStackOfs] = r1 + r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_SUB:
+                        opStack[--opStackOfs] = r1 - r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_DIVI:
+                        opStack[--opStackOfs] = r1 / r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_DIVU:
+                        opStack[--opStackOfs] = (int)((uint)r1 / (uint)r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_MODI:
+                        opStack[--opStackOfs] = r1 % r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_MODU:
+                        opStack[--opStackOfs] = (int)((uint)r1 % (uint)r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_MULI:
+                        opStack[--opStackOfs] = r1 * r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_MULU:
+                        opStack[--opStackOfs] = (int)((uint)r1 * (uint)r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_BAND:
+                        opStack[--opStackOfs] = r1 & r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_BOR:
+                        opStack[--opStackOfs] = r1 | r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_BXOR:
+                        opStack[--opStackOfs] = r1 ^ r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_BCOM:
+                        opStack[opStackOfs] = ~r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_LSH:
+                        opStack[--opStackOfs] = r1 << r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_RSHI:
+                        opStack[--opStackOfs] = r1 >> r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_RSHU:
+                        opStack[--opStackOfs] = (int)((uint)r1 >> r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_NEGF:
+                        opStack[opStackOfs] = VM_FloatToInt(-VM_IntToFloat(r0));
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_ADDF:
+                        opStack[--opStackOfs] = VM_FloatToInt(VM_IntToFloat(r1) + VM_IntToFloat(r0));
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_SUBF:
+                        opStack[--opStackOfs] = VM_FloatToInt(VM_IntToFloat(r1) - VM_IntToFloat(r0));
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_DIVF:
+                        opStack[--opStackOfs] = VM_FloatToInt(VM_IntToFloat(r1) / VM_IntToFloat(r0));
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_MULF:
+                        opStack[--opStackOfs] = VM_FloatToInt(VM_IntToFloat(r1) * VM_IntToFloat(r0));
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_CVIF:
+                        opStack[opStackOfs] = VM_FloatToInt((float)r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_CVFI:
+                        opStack[opStackOfs] = (int)(long)VM_IntToFloat(r0);
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_SEX8:
+                        opStack[opStackOfs] = (sbyte)r0;
+                        ip++;
+                        continue;
+                    case (int)opcode_t.OP_SEX16:
+                        opStack[opStackOfs] = (short)r0;
+                        ip++;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_LOCAL_LOAD4:
+                        r1 = r0;
+                        r0 = opStack[++opStackOfs] = *(int*)&image[(ip->value + programStack) & dataMask];
+                        ip += 2;
+                        goto nextInstruction2;
+                    case (int)vmFusedOp_t.FOP_LOCAL_CONST_STORE4:
+                        *(int*)&image[(ip->value + programStack) & dataMask] = ip[1].value;
+                        ip += 3;
+                        goto nextInstruction2;
+                    case (int)vmFusedOp_t.FOP_CONST_ADD:
+                        r0 = opStack[opStackOfs] = r0 + ip->value;
+                        ip += 2;
+                        goto nextInstruction2;
+                    case (int)vmFusedOp_t.FOP_CONST_CALL:
+                        *(int*)&image[programStack] = (int)(ip - code) + 2;
+
+                        if (ip->value < 0) {
+                            opStack[++opStackOfs] = VM_SystemCall(ref vm, image, programStack, ip->value);
+                            ip += 2;
+                        } else if ((uint)ip->value >= (uint)instructionCount) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_CALL");
+                            return -1;
+                        } else {
+                            ip = code + ip->value;
+                        }
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_SYSCALL:
+                        *(int*)&image[programStack] = (int)(ip - code) + 2;
+                        opStack[++opStackOfs] = VM_SystemCall(ref vm, image, programStack, ip->value);
+                        ip += 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_CALL_VERIFIED:
+                        *(int*)&image[programStack] = (int)(ip - code) + 2;
+                        ip = code + ip->value;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_JUMP_VERIFIED:
+                        ip = code + ip->value;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_EQ:
+                        opStackOfs--;
+                        ip = r0 == ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_NE:
+                        opStackOfs--;
+                        ip = r0 != ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_LTI:
+                        opStackOfs--;
+                        ip = r0 < ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_LEI:
+                        opStackOfs--;
+                        ip = r0 <= ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_GTI:
+                        opStackOfs--;
+                        ip = r0 > ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_CONST_GEI:
+                        opStackOfs--;
+                        ip = r0 >= ip->value ? code + ip[1].value : ip + 2;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_TIER_ENTER:
+                        if (VM_TierEnter(ref vm, (int)(ip - code))) {
+                            ip->handler = (int)vmFusedOp_t.FOP_TIER_COMPILED;
+                            goto case (int)vmFusedOp_t.FOP_TIER_COMPILED;
+                        }
+
+                        programStack -= ip->value;
+
+                        if (programStack < stackBottom) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_OVERFLOW, "VM stack overflow");
+                            return -1;
+                        }
+
+                        ip++;
+                        continue;
+                    case (int)vmFusedOp_t.FOP_TIER_LOOP:
+                        handler = VM_TierLoop(ref vm, (int)(ip - code));
+                        goto dispatch;
+                    case (int)vmFusedOp_t.FOP_TIER_COMPILED:
+                        // Runs the whole call including OP_LEAVE, so return the same way
+                        opStack[++opStackOfs] = vm.compiledFunctions[ip - code](ref vm, image, programStack);
+                        r0 = *(int*)&image[programStack];
+
+                        if (r0 == -1) {
+                            goto done;
+                        } else if ((uint)r0 >= (uint)instructionCount) {
+                            Com_Error(vm.lastError = vmErrorCode_t.VM_PC_OUT_OF_RANGE, "VM program counter out of range in OP_LEAVE");
+                            return -1;
+                        }
+
+                        ip = code + r0;
+                        continue;
+                    default:
+                        Com_Error(vm.lastError = vmErrorCode_t.VM_BAD_INSTRUCTION, "Bad VM instruction");
+                        return -1;
+                }
+            }
+
+        done:
+            vm.currentlyInterpreting = 0;
+
+            if (opStackOfs != 1 || *opStack != 0x0000BEEF) {
+                Com_Error(vm.lastError = vmErrorCode_t.VM_STACK_ERROR, "Interpreter stack error");
+            }
+
+            return opStack[opStackOfs];
+        }
+    }
+}
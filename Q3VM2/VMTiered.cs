@@ -0,0 +1,166 @@
+﻿using System;
+using System.Reflection.Emit;
+using System.Threading;
+
+// Tiered execution on top of the threaded interpreter. The OP_ENTER of every
+// verified function and the targets of its backward branches get counting
+// handlers. Once a function has been entered or looped vm_tierThreshold times
+// it is handed to the IL compiler on a thread pool thread. The compiled
+// delegate is published in vm.compiledFunctions and the interpreter patches the
+// OP_ENTER record to call it the next time the function is entered. The worker
+// never touches the threaded code itself, so VM_Free does not have to wait.
+//
+// Compiled functions call the functions that are still cold through
+// VM_CompiledCall, which runs them on the interpreter again.
+
+namespace Q3VM2 {
+    class vmTieredCode_t {
+        public vmInstruction_t[] code;
+
+        // Entry plus back edge count per function, indexed by its OP_ENTER
+        public int[] counts;
+        public int[] state;
+
+        // Handler replaced by FOP_TIER_LOOP and the function the loop is in
+        public int[] loopHandlers;
+        public int[] loopFunctions;
+
+        public int pending;
+        public int compiledCount;
+    }
+
+    unsafe static partial class VM {
+
+        public static int vm_tierThreshold = 1000;
+
+        const int TIER_NONE = 0;
+        const int TIER_INTERPRETED = 1;
+        const int TIER_QUEUED = 2;
+        const int TIER_COMPILED = 3;
+        const int TIER_FAILED = 4;
+
+        static void VM_PrepareTiered(ref VirtMachine vm) {
+            vmTieredCode_t tiered = new vmTieredCode_t();
+            vmInstruction_t[] code = VM_DecodeInstructions(ref vm);
+            int start = 0;
+
+            tiered.code = code;
+            tiered.counts = new int[code.Length];
+            tiered.state = new int[code.Length];
+            tiered.loopHandlers = new int[code.Length];
+            tiered.loopFunctions = new int[code.Length];
+
+            vm.compiledFunctions = new vmCompiledFunc_t[code.Length];
+            vm.tieredCode = tiered;
+
+            for (int i = 0; i < code.Length; i++) {
+                int target = -1;
+
+                if (code[i].op == opcode_t.OP_ENTER) {
+                    start = i;
+
+                    // The rest of the function is left alone
+                    if (!vm.verifiedFunctions[i]) {
+                        tiered.state[i] = TIER_FAILED;
+                        continue;
+                    }
+
+                    tiered.state[i] = TIER_INTERPRETED;
+                    vm.threadedCode[i].handler = (int)vmFusedOp_t.FOP_TIER_ENTER;
+                    continue;
+                }
+
+                if (tiered.state[start] != TIER_INTERPRETED)
+                    continue;
+
+                if (VM_IsBranch(code[i].op))
+                    target = code[i].value;
+                else if (code[i].op == opcode_t.OP_JUMP && code[i - 1].op == opcode_t.OP_CONST)
+                    target = code[i - 1].value;
+
+                if (target > start && target <= i && tiered.loopHandlers[target] == 0) {
+                    tiered.loopHandlers[target] = vm.threadedCode[target].handler;
+                    tiered.loopFunctions[target] = start;
+                    vm.threadedCode[target].handler = (int)vmFusedOp_t.FOP_TIER_LOOP;
+                }
+            }
+        }
+
+        // Returns true when the function at start has a compiled version to run
+        static bool VM_TierEnter(ref VirtMachine vm, int start) {
+            vmTieredCode_t tiered = vm.tieredCode;
+
+            if (Volatile.Read(ref vm.compiledFunctions[start]) != null)
+                return true;
+
+            if (++tiered.counts[start] == vm_tierThreshold)
+                VM_TierUp(ref vm, start);
+
+            return false;
+        }
+
+        // Counts a back edge and returns the handler it stands in for
+        static int VM_TierLoop(ref VirtMachine vm, int header) {
+            vmTieredCode_t tiered = vm.tieredCode;
+            int start = tiered.loopFunctions[header];
+
+            if (++tiered.counts[start] == vm_tierThreshold)
+                VM_TierUp(ref vm, start);
+
+            return tiered.loopHandlers[header];
+        }
+
+        static void VM_TierUp(ref VirtMachine vm, int start) {
+            vmTieredCode_t tiered = vm.tieredCode;
+            VirtMachine copy = vm;
+
+            if (tiered.state[start] != TIER_INTERPRETED)
+                return;
+
+            tiered.state[start] = TIER_QUEUED;
+
+            // The loop counters of this function have done their job
+            for (int i = start + 1; i < tiered.code.Length && tiered.code[i].op != opcode_t.OP_ENTER; i++) {
+                if (tiered.loopHandlers[i] != 0)
+                    vm.threadedCode[i].handler = tiered.loopHandlers[i];
+            }
+
+            Interlocked.Increment(ref tiered.pending);
+            ThreadPool.QueueUserWorkItem(_ => VM_TierCompile(tiered, copy, start));
+        }
+
+        // Runs on a worker thread, vm is a copy and only read
+        static void VM_TierCompile(vmTieredCode_t tiered, VirtMachine vm, int start) {
+            vmInstruction_t[] code = tiered.code;
+            vmCompiledFunc_t[] compiledFunctions = vm.compiledFunctions;
+            DynamicMethod[] methods = new DynamicMethod[code.Length];
+            int[] depth = new int[code.Length];
+            Type[] parameters = new Type[] { typeof(VirtMachine).MakeByRefType(), typeof(byte*), typeof(int) };
+            int end = start + 1;
+
+            while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                end++;
+
+            try {
+                int maxDepth = VM_FunctionStackDepths(code, start, end, depth);
+
+                // Calls to other functions go through VM_CompiledCall, only
+                // recursion becomes a direct call
+                methods[start] = new DynamicMethod(string.Format("{0}_{1}", vm.Name, start), typeof(int), parameters, typeof(VM), true);
+
+                if (maxDepth >= 0 && VM_CompileFunction(ref vm, code, methods, depth, maxDepth, start, end) == 0) {
+                    Volatile.Write(ref compiledFunctions[start], (vmCompiledFunc_t)methods[start].CreateDelegate(typeof(vmCompiledFunc_t)));
+                    tiered.state[start] = TIER_COMPILED;
+                    Interlocked.Increment(ref tiered.compiledCount);
+                } else {
+                    tiered.state[start] = TIER_FAILED;
+                }
+            } catch (Exception E) {
+                Warn("VM_TierCompile: {0}\n", E.Message);
+                tiered.state[start] = TIER_FAILED;
+            }
+
+            Interlocked.Decrement(ref tiered.pending);
+        }
+    }
+}
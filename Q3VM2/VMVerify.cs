@@ -0,0 +1,71 @@
+﻿using System;
+
+// Load time verification of the decoded code. A function is verified when its
+// op stack has a consistent depth at every instruction, every OP_LEAVE releases
+// the frame its OP_ENTER reserved, and every branch, constant jump and constant
+// call lands where it may: inside the function on an empty op stack for jumps,
+// on an OP_ENTER or a system call for calls. Engines can drop the runtime checks
+// on those targets. Computed jumps and calls stay checked, so does OP_LEAVE since
+// the return address lives in guest memory.
+
+namespace Q3VM2 {
+    unsafe static partial class VM {
+
+        static int VM_Verify(vmModule_t module) {
+            vmInstruction_t[] code = module.instructions;
+            int[] depth = new int[code.Length];
+            int verified = 0;
+
+            module.verifiedFunctions = new bool[code.Length];
+
+            if (code.Length == 0 || code[0].op != opcode_t.OP_ENTER)
+                return 0;
+
+            for (int start = 0; start < code.Length;) {
+                int end = start + 1;
+
+                while (end < code.Length && code[end].op != opcode_t.OP_ENTER)
+                    end++;
+
+                if (VM_VerifyFunction(code, depth, start, end)) {
+                    module.verifiedFunctions[start] = true;
+                    verified++;
+                } else {
+                    Warn("VM_Verify: function at {0} could not be verified\n", start);
+                }
+
+                start = end;
+            }
+
+            return verified;
+        }
+
+        static bool VM_VerifyFunction(vmInstruction_t[] code, int[] depth, int start, int end) {
+            if (VM_FunctionStackDepths(code, start, end, depth) < 0)
+                return false;
+
+            for (int i = start + 1; i < end; i++) {
+                int target = code[i - 1].value;
+
+                switch (code[i].op) {
+                    case opcode_t.OP_LEAVE:
+                        if (code[i].value != code[start].value)
+                            return false;
+                        break;
+
+                    case opcode_t.OP_JUMP:
+                        if (code[i - 1].op == opcode_t.OP_CONST && (target < start || target >= end || depth[target] != 0))
+                            return false;
+                        break;
+
+                    case opcode_t.OP_CALL:
+                        if (code[i - 1].op == opcode_t.OP_CONST && target >= 0 && (target >= code.Length || code[target].op != opcode_t.OP_ENTER))
+                            return false;
+                        break;
+                }
+            }
+
+            return true;
+        }
+    }
+}